@@ -0,0 +1,150 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the selection of spatial index backends along with the KD tree     *
+* backend, which answers searches directly from the tree of the parser       *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "backend.h"
+
+static const backend_t *backends[] = {
+    &kd_backend, &grid_backend, &rtree_backend
+};
+
+static void *kd_build(tree_t *tree);
+static node_t *kd_nearest(void *index, query_t *query, int *num_cmp);
+static int kd_radius(void *index, query_t *query, double radius,
+                     report_t report, void *arg);
+static int kd_range(void *index, query_t *query, double *lo, double *hi,
+                    report_t report, void *arg);
+static size_t kd_memory(void *index);
+static size_t kd_estimate(int num_locations, const double *lo,
+                          const double *hi);
+static size_t node_memory(node_t *root);
+static void kd_free(void *index);
+static int count_nodes(node_t *root);
+static void collect_nodes(node_t *root, entry_t *entries, int *num_entries);
+
+const backend_t kd_backend = {
+    "kd", kd_build, kd_nearest, kd_radius, kd_range, kd_memory, kd_estimate,
+    kd_free
+};
+
+/* Return the backend with the given name, or NULL if there is none */
+const backend_t
+*find_backend(const char *name) {
+    for (int i = 0; i < (int) (sizeof(backends) / sizeof(backends[0])); i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            return backends[i];
+        }
+    }
+    return NULL;
+}
+
+/* Copy every location of the tree into a new array. User is responsible
+    to free the returned array */
+entry_t
+*collect_entries(tree_t *tree, int *num_entries) {
+    int num_nodes = count_nodes(tree->root);
+    entry_t *entries = (entry_t *) malloc(sizeof(entry_t) * (num_nodes + 1));
+    assert(entries != NULL);
+
+    *num_entries = 0;
+    collect_nodes(tree->root, entries, num_entries);
+
+    return entries;
+}
+
+/* Count the locations (nodes) of the subtree */
+static int
+count_nodes(node_t *root) {
+    if (root == NULL) {
+        return 0;
+    }
+    return 1 + count_nodes(root->left) + count_nodes(root->rght);
+}
+
+/* Record the locations of the subtree in pre-order */
+static void
+collect_nodes(node_t *root, entry_t *entries, int *num_entries) {
+    if (root == NULL) {
+        return;
+    }
+
+    double *coordinates = root->group.records->coordinates;
+    entry_t *entry = &entries[(*num_entries)++];
+    entry->coordinates[0] = coordinates[0];
+    entry->coordinates[1] = coordinates[1];
+    entry->node = root;
+
+    collect_nodes(root->left, entries, num_entries);
+    collect_nodes(root->rght, entries, num_entries);
+}
+
+/* Check if an entry lies within the radius (and attribute ranges) of the
+    query, recording its distance */
+int
+entry_matches(entry_t *entry, query_t *query, double radius, double *dist) {
+    *dist = calc_dist(entry->coordinates, query->coordinates);
+    if (*dist > radius) {
+        return 0;
+    }
+    return in_range(entry->node->group.records->coordinates,
+                    query);
+}
+
+/* The KD tree backend searches the tree itself */
+static void
+*kd_build(tree_t *tree) {
+    return tree;
+}
+
+static node_t
+*kd_nearest(void *index, query_t *query, int *num_cmp) {
+    tree_t *tree = index;
+    double nearest_dist = INFINITY;
+    node_t *nearest_node = NULL;
+
+    *num_cmp = 0;
+    recursive_traverse_search(tree->root, query, &nearest_dist,
+                              &nearest_node, num_cmp, 0, NULL);
+    return nearest_node;
+}
+
+static int
+kd_radius(void *index, query_t *query, double radius, report_t report,
+          void *arg) {
+    tree_t *tree = index;
+    return recursive_radius_search(tree->root, query, radius, report, arg, 0);
+}
+
+static int
+kd_range(void *index, query_t *query, double *lo, double *hi,
+         report_t report, void *arg) {
+    tree_t *tree = index;
+    return recursive_range_search(tree->root, query, lo, hi, report, arg, 0);
+}
+
+static size_t
+kd_memory(void *index) {
+    tree_t *tree = index;
+    return sizeof(tree_t) + node_memory(tree->root);
+}
+
+/* The KD tree is the index, so it adds nothing to the tree */
+static size_t
+kd_estimate(int num_locations, const double *lo, const double *hi) {
+    return 0;
+}
+
+static size_t
+node_memory(node_t *root) {
+    if (root == NULL) {
+        return 0;
+    }
+    return sizeof(node_t) + node_memory(root->left) + node_memory(root->rght);
+}
+
+/* The tree belongs to the dataset so it is not freed here */
+static void
+kd_free(void *index) {
+}
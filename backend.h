@@ -0,0 +1,52 @@
+#ifndef backend_h
+#define backend_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "kdtree.h"
+#include "csvparser.h"
+#include "search.h"
+
+#define GRID_POINTS_PER_CELL 4           /* average locations per grid cell */
+#define RTREE_FANOUT 16                  /* entries per R-tree node */
+
+/* Spatial index over the locations (KD tree nodes) of a dataset. The KD
+    tree built by the parser owns the records and groups co-located ones,
+    every backend indexes its nodes */
+typedef struct {
+    const char *name;
+    void *(*build)(tree_t *tree);
+    /* Nearest location to the key, or NULL if none is in range */
+    node_t *(*nearest)(void *index, query_t *query, int *num_cmp);
+    /* Each search below returns the number of comparisons made */
+    int (*radius)(void *index, query_t *query, double radius,
+                  report_t report, void *arg);
+    int (*range)(void *index, query_t *query, double *lo, double *hi,
+                 report_t report, void *arg);
+    size_t (*memory)(void *index);       /* bytes used by the index */
+    /* Bytes the index would use over num_locations locations bounded by
+        [lo, hi], known before the tree is built */
+    size_t (*estimate)(int num_locations, const double *lo, const double *hi);
+    void (*free)(void *index);
+} backend_t;
+
+/* Location stored by the grid and R-tree backends */
+typedef struct {
+    double coordinates[METRIC_DIMENSION];
+    node_t *node;
+} entry_t;
+
+extern const backend_t kd_backend;
+extern const backend_t grid_backend;
+extern const backend_t rtree_backend;
+
+/* prototypes for the functions in this library */
+const backend_t *find_backend(const char *name);
+entry_t *collect_entries(tree_t *tree, int *num_entries);
+int entry_matches(entry_t *entry, query_t *query, double radius,
+                  double *dist);
+
+#endif /* backend_h */
@@ -0,0 +1,437 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the balanced construction of the KD Tree. Every node is the median *
+* location of its subtree, so the shape depends only on the set of          *
+* locations and is the same whichever number of workers builds it           *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "balance.h"
+
+/* Share of a partition pass done by one worker */
+typedef struct {
+    location_t *locations;
+    location_t *tmp;
+    int start, end;                      /* locations of this worker */
+    int axis;
+    location_t pivot;
+    double value;
+    int less, equal;                     /* counted by the worker */
+    int less_at, greater_at, pivot_at;   /* where the worker scatters to */
+} chunk_t;
+
+/* Subtree built by another worker */
+typedef struct {
+    location_t *locations;
+    location_t *tmp;
+    int num_locations;
+    unsigned depth;
+    int num_threads;
+    node_t *root;
+} subtree_t;
+
+static location_t *group_locations(record_t *records, int num_records,
+                                   int *num_locations, group_t **groups);
+static uint64_t hash_coordinates(const double *coordinates);
+static node_t *build_node(location_t *locations, location_t *tmp,
+                          int num_locations, unsigned depth, int num_threads);
+static void *build_subtree(void *arg);
+static void partition(location_t *locations, location_t *tmp,
+                      int num_locations, int nth, int axis, int num_threads);
+static void select_location(location_t *locations, int start, int end,
+                            int nth, int axis);
+static int count_below(location_t *locations, int num_locations, int axis,
+                       double value, int num_threads);
+static void run_chunks(void *(*work)(void *), chunk_t *chunks,
+                       int num_chunks);
+static void split_chunks(chunk_t *chunks, int num_chunks, location_t *locations,
+                         location_t *tmp, int start, int end, int axis);
+static void *count_chunk(void *arg);
+static void *scatter_chunk(void *arg);
+static void *copy_chunk(void *arg);
+static void *count_below_chunk(void *arg);
+
+/* Order locations by one axis, then by id so that no two are equal */
+static inline int
+key_cmp(const location_t *a, const location_t *b, int axis) {
+    if (a->coordinates[axis] != b->coordinates[axis]) {
+        return (a->coordinates[axis] < b->coordinates[axis]) ? -1 : 1;
+    }
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+/* Build a balanced tree over the records, which must have been read in
+    order of id, into an empty tree. Records at the same location are
+    grouped as by insert_in_order, the latest first. The strings of the
+    records are owned by the tree from then on, but not the array */
+tree_t
+*build_balanced_tree(tree_t *tree, record_t *records, int num_records,
+                     int num_threads) {
+    assert(tree != NULL && tree->root == NULL);
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    int num_locations;
+    group_t *groups;
+    location_t *locations = group_locations(records, num_records,
+                                            &num_locations, &groups);
+    location_t *tmp = NULL;
+    if (num_threads > 1) {
+        tmp = (location_t *) malloc(sizeof(location_t) * (num_locations + 1));
+        assert(tmp != NULL);
+    }
+
+    tree->root = build_node(locations, tmp, num_locations, 0, num_threads);
+
+    free(tmp);
+    free(locations);
+    free(groups);
+    return tree;
+}
+
+/* Gather the records sharing every coordinate into one location each,
+    using a hash table of the locations seen so far, then copy the records
+    of each location into an array of their own */
+static location_t
+*group_locations(record_t *records, int num_records, int *num_locations,
+                 group_t **groups) {
+    int size = 1;
+    while (size < 2 * num_records) {
+        size *= 2;
+    }
+    int *slots = (int *) malloc(sizeof(int) * size);
+    int *owners = (int *) malloc(sizeof(int) * (num_records + 1));
+    location_t *locations = (location_t *) malloc(sizeof(location_t) *
+                                                  (num_records + 1));
+    *groups = (group_t *) calloc(num_records + 1, sizeof(group_t));
+    assert(slots != NULL && owners != NULL && locations != NULL &&
+           *groups != NULL);
+    memset(slots, -1, sizeof(int) * size);
+
+    *num_locations = 0;
+    for (int i = 0; i < num_records; i++) {
+        record_t *record = &records[i];
+        int slot = (int) (hash_coordinates(record->coordinates) & (size - 1));
+        while (slots[slot] >= 0 &&
+               !same_point(locations[slots[slot]].coordinates,
+                           record->coordinates)) {
+            slot = (slot + 1) & (size - 1);
+        }
+
+        if (slots[slot] < 0) {
+            /* First record at this location */
+            location_t *location = &locations[*num_locations];
+            memcpy(location->coordinates, record->coordinates,
+                   sizeof(record->coordinates));
+            location->id = record->id;
+            location->group = &(*groups)[*num_locations];
+            slots[slot] = (*num_locations)++;
+        }
+        owners[i] = slots[slot];
+        locations[owners[i]].group->capacity++;
+    }
+
+    for (int l = 0; l < *num_locations; l++) {
+        group_t *group = &(*groups)[l];
+        group->records = (record_t *) malloc(sizeof(record_t) *
+                                             group->capacity);
+        assert(group->records != NULL);
+    }
+    /* The latest record goes first, as on the stack of insert_in_order */
+    for (int i = num_records - 1; i >= 0; i--) {
+        group_t *group = &(*groups)[owners[i]];
+        group->records[group->num_records++] = records[i];
+    }
+
+    free(owners);
+    free(slots);
+    return locations;
+}
+
+static uint64_t
+hash_coordinates(const double *coordinates) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (int d = 0; d < DIMENSION; d++) {
+        /* Adding zero turns -0 into 0, which same_point takes as equal */
+        double value = coordinates[d] + 0.0;
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        hash = (hash ^ bits) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/* Place the median location at the root of the subtree. Locations with
+    the same coordinate as the median on this axis must all go right, so
+    the root is the first of them in (coordinate, id) order */
+static node_t
+*build_node(location_t *locations, location_t *tmp, int num_locations,
+            unsigned depth, int num_threads) {
+    if (num_locations == 0) {
+        return NULL;
+    }
+
+    int axis = depth % DIMENSION;
+    int mid = num_locations / 2;
+    partition(locations, tmp, num_locations, mid, axis, num_threads);
+    double value = locations[mid].coordinates[axis];
+    int split = count_below(locations, mid, axis, value, num_threads);
+    if (split < mid) {
+        partition(locations, tmp, mid + 1, split, axis, num_threads);
+    }
+
+    node_t *node = (node_t *) malloc(sizeof(*node));
+    assert(node != NULL);
+    node->group = *locations[split].group;
+
+    location_t *rght = locations + split + 1;
+    location_t *rght_tmp = tmp ? tmp + split + 1 : NULL;
+    int num_rght = num_locations - split - 1;
+
+    /* Hand the left subtree to another worker once it is large enough to
+        be worth a thread, splitting the workers between both sides */
+    pthread_t worker;
+    subtree_t left = {locations, tmp, split, depth + 1, num_threads / 2, NULL};
+    if (num_threads > 1 && num_locations >= PARALLEL_BUILD_MIN &&
+        pthread_create(&worker, NULL, build_subtree, &left) == 0) {
+        node->rght = build_node(rght, rght_tmp, num_rght, depth + 1,
+                                num_threads - num_threads / 2);
+        pthread_join(worker, NULL);
+        node->left = left.root;
+    } else {
+        node->left = build_node(locations, tmp, split, depth + 1, 1);
+        node->rght = build_node(rght, rght_tmp, num_rght, depth + 1, 1);
+    }
+    summarise_node(node);
+
+    return node;
+}
+
+static void
+*build_subtree(void *arg) {
+    subtree_t *subtree = arg;
+    subtree->root = build_node(subtree->locations, subtree->tmp,
+                               subtree->num_locations, subtree->depth,
+                               subtree->num_threads);
+    return NULL;
+}
+
+/* Partially order the locations so that the nth one (in (coordinate, id)
+    order) is in its sorted position. Large ranges are partitioned around
+    a pivot by every worker at once, each scattering its share into the
+    spare array, until the range is small enough for a serial quickselect */
+static void
+partition(location_t *locations, location_t *tmp, int num_locations, int nth,
+          int axis, int num_threads) {
+    int lo = 0, hi = num_locations;
+    chunk_t *chunks = NULL;
+
+    if (num_threads > 1) {
+        chunks = (chunk_t *) malloc(sizeof(chunk_t) * num_threads);
+        assert(chunks != NULL);
+    }
+    while (num_threads > 1 && hi - lo >= PARALLEL_SELECT_MIN) {
+        /* Median of the first, middle and last locations as the pivot */
+        location_t *a = &locations[lo], *b = &locations[lo + (hi - lo) / 2];
+        location_t *c = &locations[hi - 1], *pivot;
+        if (key_cmp(a, b, axis) < 0) {
+            pivot = (key_cmp(b, c, axis) < 0) ? b :
+                    (key_cmp(a, c, axis) < 0) ? c : a;
+        } else {
+            pivot = (key_cmp(a, c, axis) < 0) ? a :
+                    (key_cmp(b, c, axis) < 0) ? c : b;
+        }
+
+        split_chunks(chunks, num_threads, locations, tmp, lo, hi, axis);
+        for (int t = 0; t < num_threads; t++) {
+            chunks[t].pivot = *pivot;
+        }
+        run_chunks(count_chunk, chunks, num_threads);
+
+        /* Every worker scatters its lesser locations after those of the
+            workers before it, and likewise for the greater ones */
+        int less_at = lo, num_less = 0;
+        for (int t = 0; t < num_threads; t++) {
+            num_less += chunks[t].less;
+        }
+        int pivot_at = lo + num_less, greater_at = pivot_at + 1;
+        for (int t = 0; t < num_threads; t++) {
+            chunks[t].less_at = less_at;
+            chunks[t].greater_at = greater_at;
+            chunks[t].pivot_at = pivot_at;
+            less_at += chunks[t].less;
+            greater_at += chunks[t].end - chunks[t].start - chunks[t].less -
+                          chunks[t].equal;
+        }
+        run_chunks(scatter_chunk, chunks, num_threads);
+        run_chunks(copy_chunk, chunks, num_threads);
+
+        /* Continue only with the side holding the nth location */
+        if (nth < pivot_at) {
+            hi = pivot_at;
+        } else if (nth > pivot_at) {
+            lo = pivot_at + 1;
+        } else {
+            lo = hi;
+        }
+    }
+    free(chunks);
+
+    if (lo < hi) {
+        select_location(locations, lo, hi, nth, axis);
+    }
+}
+
+/* Serial quickselect of the nth location within [start, end) */
+static void
+select_location(location_t *locations, int start, int end, int nth,
+                int axis) {
+    int lo = start, hi = end - 1;
+
+    while (lo < hi) {
+        location_t pivot = locations[lo + (hi - lo) / 2];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (key_cmp(&locations[i], &pivot, axis) < 0) {
+                i++;
+            }
+            while (key_cmp(&locations[j], &pivot, axis) > 0) {
+                j--;
+            }
+            if (i <= j) {
+                location_t swap = locations[i];
+                locations[i++] = locations[j];
+                locations[j--] = swap;
+            }
+        }
+
+        /* Continue only with the side holding the nth location */
+        if (nth <= j) {
+            hi = j;
+        } else if (nth >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+}
+
+/* Count the locations lying below value on the axis */
+static int
+count_below(location_t *locations, int num_locations, int axis, double value,
+            int num_threads) {
+    int count = 0;
+
+    if (num_threads > 1 && num_locations >= PARALLEL_SELECT_MIN) {
+        chunk_t *chunks = (chunk_t *) malloc(sizeof(chunk_t) * num_threads);
+        assert(chunks != NULL);
+        split_chunks(chunks, num_threads, locations, NULL, 0, num_locations,
+                     axis);
+        for (int t = 0; t < num_threads; t++) {
+            chunks[t].value = value;
+        }
+        run_chunks(count_below_chunk, chunks, num_threads);
+        for (int t = 0; t < num_threads; t++) {
+            count += chunks[t].less;
+        }
+        free(chunks);
+    } else {
+        for (int i = 0; i < num_locations; i++) {
+            count += locations[i].coordinates[axis] < value;
+        }
+    }
+
+    return count;
+}
+
+/* Divide [start, end) evenly between the workers */
+static void
+split_chunks(chunk_t *chunks, int num_chunks, location_t *locations,
+             location_t *tmp, int start, int end, int axis) {
+    for (int t = 0; t < num_chunks; t++) {
+        chunks[t].locations = locations;
+        chunks[t].tmp = tmp;
+        chunks[t].start = start + (int) ((long) (end - start) * t /
+                                         num_chunks);
+        chunks[t].end = start + (int) ((long) (end - start) * (t + 1) /
+                                       num_chunks);
+        chunks[t].axis = axis;
+    }
+}
+
+/* Run one pass with a thread per chunk, the first one on the calling
+    thread */
+static void
+run_chunks(void *(*work)(void *), chunk_t *chunks, int num_chunks) {
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * num_chunks);
+    int *started = (int *) calloc(num_chunks, sizeof(int));
+    assert(threads != NULL && started != NULL);
+
+    for (int t = 1; t < num_chunks; t++) {
+        started[t] = pthread_create(&threads[t], NULL, work, &chunks[t]) == 0;
+        if (!started[t]) {
+            work(&chunks[t]);
+        }
+    }
+    work(&chunks[0]);
+    for (int t = 1; t < num_chunks; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    free(started);
+    free(threads);
+}
+
+static void
+*count_chunk(void *arg) {
+    chunk_t *chunk = arg;
+    chunk->less = chunk->equal = 0;
+    for (int i = chunk->start; i < chunk->end; i++) {
+        int cmp = key_cmp(&chunk->locations[i], &chunk->pivot, chunk->axis);
+        chunk->less += cmp < 0;
+        chunk->equal += cmp == 0;
+    }
+    return NULL;
+}
+
+static void
+*scatter_chunk(void *arg) {
+    chunk_t *chunk = arg;
+    int less_at = chunk->less_at, greater_at = chunk->greater_at;
+    for (int i = chunk->start; i < chunk->end; i++) {
+        location_t *location = &chunk->locations[i];
+        int cmp = key_cmp(location, &chunk->pivot, chunk->axis);
+        if (cmp < 0) {
+            chunk->tmp[less_at++] = *location;
+        } else if (cmp > 0) {
+            chunk->tmp[greater_at++] = *location;
+        } else {
+            chunk->tmp[chunk->pivot_at] = *location;
+        }
+    }
+    return NULL;
+}
+
+static void
+*copy_chunk(void *arg) {
+    chunk_t *chunk = arg;
+    memcpy(&chunk->locations[chunk->start], &chunk->tmp[chunk->start],
+           sizeof(location_t) * (chunk->end - chunk->start));
+    return NULL;
+}
+
+static void
+*count_below_chunk(void *arg) {
+    chunk_t *chunk = arg;
+    chunk->less = 0;
+    for (int i = chunk->start; i < chunk->end; i++) {
+        chunk->less += chunk->locations[i].coordinates[chunk->axis] <
+                       chunk->value;
+    }
+    return NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef balance_h
+#define balance_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "kdtree.h"
+#include "csvparser.h"
+
+#define PARALLEL_SELECT_MIN 65536        /* fewest locations partitioned by
+                                            every worker together */
+#define PARALLEL_BUILD_MIN 4096          /* fewest locations of a subtree
+                                            handed to another worker */
+
+/* Location being placed in a balanced tree, along with the records stored
+    at it */
+typedef struct {
+    double coordinates[DIMENSION];
+    int id;                              /* first record at the location,
+                                            breaking ties between equal
+                                            coordinates */
+    group_t *group;                      /* records at the location */
+} location_t;
+
+/* prototypes for the functions in this library */
+tree_t *build_balanced_tree(tree_t *tree, record_t *records,
+                            int num_records, int num_threads);
+
+#endif /* balance_h */
@@ -0,0 +1,219 @@
+/*****************************************************************************
+*    Melbourne Census Dataset Information Retrieval using a KD Tree          *
+*    (Compare the spatial index backends side by side)                       *
+*    Developed by: Oliver Ming Hui Tan                                       *
+******************************************************************************/
+
+#include <time.h>
+#include "csvparser.h"
+#include "kdtree.h"
+#include "search.h"
+#include "backend.h"
+#include "balance.h"
+
+#define NUM_QUERIES 2000                 /* keys searched per backend */
+#define BENCH_RADIUS 0.0005              /* radius of the radius searches */
+#define JITTER 0.001                     /* spread of synthetic locations */
+
+/* Function prototypes */
+double now(void);
+double jitter(void);
+tree_t *make_synthetic_tree(entry_t *points, int num_points, int num_records,
+                            int build_threads, double *build_time);
+void report_nothing(node_t *node, double dist, void *arg);
+void bench_backend(const backend_t *backend, tree_t *tree, double tree_time,
+                   query_t *queries);
+
+/* Measure the build time, memory and query cost of every backend on the
+ * dataset and on synthetic datasets scaled up from it.
+ *
+ * To run the program type:
+ * ./bench <csv_filename> [-B threads] [scale ...]
+ *
+ *      <csv_filename> arg     - Dataset file
+ *      -B <threads>           - Build balanced trees with <threads> workers
+ *                               instead of inserting in dataset order
+ *      scale arg              - Build a synthetic dataset of <scale> times
+ *                               the records of the dataset, each one a
+ *                               jittered copy of a location of the dataset
+ *
+ * Build times of the grid and R-tree leave out the KD tree built by the
+ * parser, which every backend indexes. Query costs are averaged over
+ * NUM_QUERIES keys drawn near locations of the dataset.
+ */
+int main(int argc, const char * argv[]) {
+    const backend_t *backends[] = {&kd_backend, &grid_backend, &rtree_backend};
+    int num_backends = (int) (sizeof(backends) / sizeof(backends[0]));
+
+    if (argc < 2) {
+        fprintf(stderr, "No file read.");
+        return EXIT_FAILURE;
+    }
+
+    FILE *fp = fopen(argv[1], "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening file '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    /* Workers building a balanced tree, or 0 to insert in dataset order */
+    int build_threads = 0;
+    int first_scale = 2;
+    if (argc > 3 && strcmp(argv[2], "-B") == 0) {
+        build_threads = atoi(argv[3]);
+        first_scale = 4;
+    }
+
+    srand(20003);
+    double start = now();
+    tree_t *tree = make_empty_tree();
+    char *buffer;
+    if (build_threads > 0) {
+        buffer = read_and_parse_balanced(fp, tree, build_threads);
+    } else {
+        buffer = read_and_parse(fp, tree);
+    }
+    double tree_time = now() - start;
+    fclose(fp);
+
+    int num_points;
+    entry_t *points = collect_entries(tree, &num_points);
+    int num_records = 0;
+    for (int i = 0; i < num_points; i++) {
+        num_records += points[i].node->group.num_records;
+    }
+
+    /* Keys are taken near random locations so that the dense centre is
+        searched as often as the data itself */
+    query_t *queries = (query_t *) malloc(sizeof(query_t) * NUM_QUERIES);
+    assert(queries != NULL);
+    for (int i = 0; i < NUM_QUERIES; i++) {
+        double key[METRIC_DIMENSION];
+        entry_t *point = &points[rand() % num_points];
+        key[0] = point->coordinates[0] + jitter();
+        key[1] = point->coordinates[1] + jitter();
+        fill_query(&queries[i], key, METRIC_DIMENSION, 0);
+    }
+
+    printf("%-8s %10s %8s %10s %10s %10s %10s %10s\n", "dataset", "records",
+           "index", "build ms", "memory KB", "nn cmp", "radius cmp",
+           "us/key");
+    for (int b = 0; b < num_backends; b++) {
+        printf("%-8s %10d ", "csv", num_records);
+        bench_backend(backends[b], tree, tree_time, queries);
+    }
+
+    for (int i = first_scale; i < argc; i++) {
+        int scale = atoi(argv[i]);
+        if (scale < 1) {
+            fprintf(stderr, "Invalid scale '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        double synthetic_time;
+        tree_t *synthetic = make_synthetic_tree(points, num_points,
+                                                num_records * scale,
+                                                build_threads,
+                                                &synthetic_time);
+        for (int b = 0; b < num_backends; b++) {
+            printf("x%-7d %10d ", scale, num_records * scale);
+            bench_backend(backends[b], synthetic, synthetic_time, queries);
+        }
+        free_tree(synthetic);
+    }
+
+    free(queries);
+    free(points);
+    free_tree(tree);
+    free(buffer);
+
+    return 0;
+}
+
+/* Build the index of a backend over the tree, then time a nearest and a
+    radius search for every key */
+void
+bench_backend(const backend_t *backend, tree_t *tree, double tree_time,
+              query_t *queries) {
+    double start = now();
+    void *index = backend->build(tree);
+    double build_time = (backend == &kd_backend) ? tree_time : now() - start;
+
+    long nearest_cmp = 0, radius_cmp = 0;
+    start = now();
+    for (int i = 0; i < NUM_QUERIES; i++) {
+        int num_cmp;
+        backend->nearest(index, &queries[i], &num_cmp);
+        nearest_cmp += num_cmp;
+        radius_cmp += backend->radius(index, &queries[i], BENCH_RADIUS,
+                                      report_nothing, NULL);
+    }
+    double query_time = now() - start;
+
+    printf("%8s %10.1f %10.1f %10.1f %10.1f %10.2f\n", backend->name,
+           build_time * 1e3, backend->memory(index) / 1024.0,
+           (double) nearest_cmp / NUM_QUERIES,
+           (double) radius_cmp / NUM_QUERIES, query_time * 1e6 / NUM_QUERIES);
+
+    backend->free(index);
+}
+
+/* Build a tree of new records, each placed at a jittered copy of a random
+    location of the dataset, timing the construction of the tree alone */
+tree_t
+*make_synthetic_tree(entry_t *points, int num_points, int num_records,
+                     int build_threads, double *build_time) {
+    tree_t *tree = make_empty_tree();
+    record_t *records = (record_t *) calloc(num_records + 1,
+                                            sizeof(record_t));
+    assert(tree != NULL && records != NULL);
+
+    for (int i = 0; i < num_records; i++) {
+        record_t *record = &records[i];
+        entry_t *point = &points[rand() % num_points];
+        record_t *original = point->node->group.records;
+        memcpy(record->coordinates, original->coordinates,
+               sizeof(record->coordinates));
+        record->coordinates[0] += jitter();
+        record->coordinates[1] += jitter();
+        record->id = i;
+        record->census_yr = original->census_yr;
+        record->trade_name = duplicate_string("");
+        record->location = duplicate_string("");
+        record->city_area_name = duplicate_string("");
+        record->industry_desc = duplicate_string("");
+    }
+
+    double start = now();
+    if (build_threads > 0) {
+        tree = build_balanced_tree(tree, records, num_records, build_threads);
+    } else {
+        for (int i = 0; i < num_records; i++) {
+            tree = insert_in_order(tree, &records[i]);
+        }
+        order_groups(tree);
+    }
+    *build_time = now() - start;
+    free(records);
+
+    return tree;
+}
+
+/* Uniform offset within [-JITTER, JITTER] */
+double
+jitter(void) {
+    return JITTER * (2.0 * rand() / RAND_MAX - 1.0);
+}
+
+/* Seconds on a monotonic clock */
+double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Radius searches are only counted, not reported */
+void
+report_nothing(node_t *node, double dist, void *arg) {
+}
@@ -5,6 +5,16 @@
 * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include "csvparser.h"
+#include "balance.h"
+
+static void parse_record(char *line, int id, record_t *record,
+                         strings_t *strings);
+static char *copy_field(const char *info, strings_t *strings);
+static size_t hash_string(const char *string);
+static void grow_slots(strings_t *strings);
+static char *store_text(strings_t *strings, const char *string,
+                        size_t size);
+static int point_cmp(const void *a, const void *b);
 
 /* Read the csv and record each row of information into a KD Tree. 
    User is responsible to free the return pointer of this function after
@@ -15,52 +25,471 @@ char
     size_t lineBufferLength = 0;
     /* Flag to check if a line is read */
     ssize_t read_flag = 0;
-    /* Indicate the field order to parse the records */
-    int field = 0;
-    char *token;
+    /* Number of records read so far, used as the id of each record */
+    int num_records = 0;
     
     /* Skips header line */
     read_flag = getline(&line, &lineBufferLength, file);
     
     /* Read and record each row of information into the KD Tree */
     while((read_flag = getline(&line, &lineBufferLength, file)) != -1){
-        /* Reset field order after each row */
-        field = 0;
-        /* Separate information via tokenisation method */
-        token = strtok(line, DELIMITER);
-        
-        record_t *new_record = (record_t *) malloc(sizeof(record_t));
-        assert(new_record != NULL);
-        
-        /* Walk through tokens and match each token to their respective
-           field */
-        while(token != NULL) {
-            field_match(token, field, new_record);
-            
-            /* Point the token to the next information to be recorded */
-            token = strtok(NULL, DELIMITER);
-            field++;
-        }
-        
-        /* Insert each data as a linked-list node */
-        linknode_t *new_node = (linknode_t *) malloc(sizeof(linknode_t));
-        assert(new_node != NULL);
-        new_node->data = new_record;
-        new_node->next = NULL;
-        /* Insert the linked-list node as a data of a node in the KD Tree */
-        tree = insert_in_order(tree, new_node);
+        record_t new_record;
+        parse_record(line, num_records++, &new_record, tree->strings);
+        /* Insert the record into the group of its location in the KD Tree */
+        tree = insert_in_order(tree, &new_record);
         
     }
+    order_groups(tree);
+    
+    return line;
+}
+
+/* Read the csv and build a balanced KD Tree over every row once all of
+   them are read, using num_threads workers. User is responsible to free
+   the return pointer of this function after use */
+char
+*read_and_parse_balanced(FILE *file, tree_t *tree, int num_threads) {
+    char *line = NULL;
+    size_t lineBufferLength = 0;
+    ssize_t read_flag = 0;
+    int num_records = 0;
+    int max_records = INITIAL_RECORDS;
+    record_t *records = (record_t *) malloc(sizeof(record_t) * max_records);
+    assert(records != NULL);
+    
+    /* Skips header line */
+    read_flag = getline(&line, &lineBufferLength, file);
+    
+    while((read_flag = getline(&line, &lineBufferLength, file)) != -1){
+        if (num_records == max_records) {
+            max_records *= 2;
+            records = (record_t *) realloc(records, sizeof(record_t) *
+                                           max_records);
+            assert(records != NULL);
+        }
+        parse_record(line, num_records, &records[num_records],
+                     tree->strings);
+        num_records++;
+    }
+    
+    tree = build_balanced_tree(tree, records, num_records, num_threads);
+    free(records);
+    
+    return line;
+}
+
+/* Read the csv and keep only the rows located inside the region (every
+   row if it is NULL), projecting their locations if a projection is
+   given, then build a balanced KD Tree over them if num_threads is
+   positive and insert them in order otherwise. Ids stay the row numbers
+   of the whole file. User is responsible to free the return pointer of
+   this function after use */
+char
+*read_and_parse_region(FILE *file, tree_t *tree, int num_threads,
+                       const region_t *region,
+                       const projection_t *projection) {
+    char *line = NULL;
+    size_t lineBufferLength = 0;
+    ssize_t read_flag = 0;
+    int num_records = 0, num_kept = 0;
+    int max_records = INITIAL_RECORDS;
+    record_t *records = (record_t *) malloc(sizeof(record_t) * max_records);
+    assert(records != NULL);
+    
+    /* Skips header line */
+    read_flag = getline(&line, &lineBufferLength, file);
+    
+    while((read_flag = getline(&line, &lineBufferLength, file)) != -1){
+        if (num_kept == max_records) {
+            max_records *= 2;
+            records = (record_t *) realloc(records, sizeof(record_t) *
+                                           max_records);
+            assert(records != NULL);
+        }
+        record_t *record = &records[num_kept];
+        parse_record(line, num_records++, record, tree->strings);
+        if (region != NULL && !in_region(region, record->coordinates)) {
+            /* Shared strings stay in the table of the tree */
+            if (tree->strings == NULL) {
+                free_fields(record);
+            }
+            continue;
+        }
+        if (projection != NULL) {
+            project_point(projection, record->coordinates);
+        }
+        if (num_threads > 0) {
+            num_kept++;
+        } else {
+            tree = insert_in_order(tree, record);
+        }
+    }
+    
+    if (num_threads > 0) {
+        tree = build_balanced_tree(tree, records, num_kept, num_threads);
+    } else {
+        order_groups(tree);
+    }
+    free(records);
     
     return line;
 }
 
+/* Set up the projection around the centroid of every location of the csv,
+   leaving the file at its start. Only the latitude is needed for the
+   scales, so no trigonometry is left for the search */
+void
+centre_projection(FILE *file, projection_t *projection) {
+    int num_records;
+    double *locations = read_locations(file, &num_records);
+    double sum[METRIC_DIMENSION] = {0};
+    
+    for (int i = 0; i < num_records; i++) {
+        for (int d = 0; d < METRIC_DIMENSION; d++) {
+            sum[d] += locations[i * METRIC_DIMENSION + d];
+        }
+    }
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        projection->origin[d] = num_records ? sum[d] / num_records : 0;
+    }
+    free(locations);
+    rewind(file);
+    
+    double metres = EARTH_RADIUS * M_PI / 180;
+    projection->scale[0] = metres * cos(projection->origin[1] * M_PI / 180);
+    projection->scale[1] = metres;
+}
+
+/* Read the metric coordinates of every row of the csv, returning an array
+   of num_records * METRIC_DIMENSION values. User is responsible to free
+   the return pointer of this function after use */
+double
+*read_locations(FILE *file, int *num_records) {
+    char *line = NULL;
+    size_t lineBufferLength = 0;
+    ssize_t read_flag = 0;
+    int max_records = INITIAL_RECORDS;
+    double *coordinates = (double *) malloc(sizeof(double) *
+                                            METRIC_DIMENSION * max_records);
+    assert(coordinates != NULL);
+    record_t record;
+    
+    *num_records = 0;
+    /* Skips header line */
+    read_flag = getline(&line, &lineBufferLength, file);
+    
+    while((read_flag = getline(&line, &lineBufferLength, file)) != -1){
+        if (*num_records == max_records) {
+            max_records *= 2;
+            coordinates = (double *) realloc(coordinates, sizeof(double) *
+                                             METRIC_DIMENSION * max_records);
+            assert(coordinates != NULL);
+        }
+        parse_record(line, *num_records, &record, NULL);
+        memcpy(&coordinates[*num_records * METRIC_DIMENSION],
+               record.coordinates, sizeof(double) * METRIC_DIMENSION);
+        free_fields(&record);
+        (*num_records)++;
+    }
+    
+    free(line);
+    return coordinates;
+}
+
+/* Predict the bytes that the tree of the csv would hold in each layout,
+   without building it, leaving the file at its start. layouts has room
+   for every layout, and balanced is set if the tree is to be built from
+   medians rather than by inserting in order. The locations are projected
+   if projection is not NULL, and lo and hi receive their bounding box so
+   that the index over them can be predicted too */
+void
+survey_csv(FILE *file, int balanced, const projection_t *projection,
+           memory_t *layouts, double *lo, double *hi) {
+    char *line = NULL;
+    size_t lineBufferLength = 0;
+    ssize_t read_flag = 0;
+    int num_records = 0;
+    int max_records = INITIAL_RECORDS;
+    double *points = (double *) malloc(sizeof(double) * DIMENSION *
+                                       max_records);
+    assert(points != NULL);
+    memory_t *plain = &layouts[LAYOUT_PLAIN];
+    memory_t *compact = &layouts[LAYOUT_COMPACT];
+    memset(plain, 0, sizeof(*plain));
+    memset(compact, 0, sizeof(*compact));
+    /* Strings are shared in the order they are read, as when loading */
+    strings_t *strings = make_strings();
+    record_t record;
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        lo[d] = hi[d] = 0;
+    }
+    
+    /* Skips header line */
+    read_flag = getline(&line, &lineBufferLength, file);
+    
+    while((read_flag = getline(&line, &lineBufferLength, file)) != -1){
+        if (num_records == max_records) {
+            max_records *= 2;
+            points = (double *) realloc(points, sizeof(double) * DIMENSION *
+                                        max_records);
+            assert(points != NULL);
+        }
+        parse_record(line, num_records, &record, strings);
+        measure_fields(&record, plain);
+        if (projection != NULL) {
+            project_point(projection, record.coordinates);
+        }
+        for (int d = 0; d < METRIC_DIMENSION; d++) {
+            double value = record.coordinates[d];
+            if (num_records == 0 || value < lo[d]) {
+                lo[d] = value;
+            }
+            if (num_records == 0 || value > hi[d]) {
+                hi[d] = value;
+            }
+        }
+        memcpy(&points[num_records * DIMENSION], record.coordinates,
+               sizeof(record.coordinates));
+        num_records++;
+    }
+    
+    /* Each location is a node, whose records are grown by doubling when
+        inserted in order */
+    qsort(points, num_records, sizeof(double) * DIMENSION, point_cmp);
+    long num_nodes = 0;
+    for (int i = 0, j; i < num_records; i = j) {
+        for (j = i + 1; j < num_records &&
+             point_cmp(&points[i * DIMENSION], &points[j * DIMENSION]) == 0;
+             j++);
+        int capacity = j - i;
+        if (!balanced) {
+            for (capacity = 1; capacity < j - i; capacity *= 2);
+        }
+        plain->slack += sizeof(record_t) * (capacity - (j - i));
+        num_nodes++;
+    }
+    seal_strings(strings);
+    measure_strings(strings, compact);
+    
+    for (int l = LAYOUT_PLAIN; l <= LAYOUT_COMPACT; l++) {
+        layouts[l].nodes = sizeof(tree_t) + sizeof(node_t) * num_nodes;
+        layouts[l].records = sizeof(record_t) * num_records;
+        layouts[l].num_nodes = num_nodes;
+        layouts[l].num_records = num_records;
+    }
+    
+    free_strings(strings);
+    free(points);
+    free(line);
+    rewind(file);
+}
+
+/* Order points by every coordinate in turn, equal points being those
+   that same_point groups together */
+static int
+point_cmp(const void *a, const void *b) {
+    const double *p = a, *q = b;
+    for (int d = 0; d < DIMENSION; d++) {
+        if (p[d] != q[d]) {
+            return (p[d] < q[d]) ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/* Count the text of the fields owned by a record */
+void
+measure_fields(record_t *record, memory_t *memory) {
+    char *strings[4] = {record->trade_name, record->location,
+                        record->city_area_name, record->industry_desc};
+    for (int i = 0; i < 4; i++) {
+        memory->strings += strlen(strings[i]) + 1;
+    }
+    memory->num_strings += 4;
+}
+
+/* Create an empty table of strings */
+strings_t
+*make_strings(void) {
+    strings_t *strings = (strings_t *) malloc(sizeof(*strings));
+    assert(strings != NULL);
+    strings->num_slots = INITIAL_SLOTS;
+    strings->slots = (char **) calloc(strings->num_slots, sizeof(char *));
+    assert(strings->slots != NULL);
+    strings->num_strings = 0;
+    strings->blocks = NULL;
+    strings->num_blocks = strings->max_blocks = 0;
+    strings->text = NULL;
+    strings->left = 0;
+    strings->bytes = 0;
+    return strings;
+}
+
+/* Return the copy of the string held by the table, adding it the first
+   time it is seen. The table must not be sealed */
+char
+*intern_string(strings_t *strings, const char *string) {
+    assert(strings->slots != NULL);
+    size_t slot = hash_string(string) & (strings->num_slots - 1);
+    while (strings->slots[slot] != NULL) {
+        if (strcmp(strings->slots[slot], string) == 0) {
+            return strings->slots[slot];
+        }
+        slot = (slot + 1) & (strings->num_slots - 1);
+    }
+    
+    char *copy = store_text(strings, string, strlen(string) + 1);
+    strings->slots[slot] = copy;
+    strings->num_strings++;
+    if (2 * strings->num_strings > strings->num_slots) {
+        grow_slots(strings);
+    }
+    return copy;
+}
+
+/* FNV-1a hash of a string */
+static size_t
+hash_string(const char *string) {
+    size_t hash = 14695981039346656037UL;
+    for (; *string != '\0'; string++) {
+        hash = (hash ^ (unsigned char) *string) * 1099511628211UL;
+    }
+    return hash;
+}
+
+/* Double the slots of the table, placing every string again */
+static void
+grow_slots(strings_t *strings) {
+    size_t num_slots = 2 * strings->num_slots;
+    char **slots = (char **) calloc(num_slots, sizeof(char *));
+    assert(slots != NULL);
+    for (size_t i = 0; i < strings->num_slots; i++) {
+        if (strings->slots[i] != NULL) {
+            size_t slot = hash_string(strings->slots[i]) & (num_slots - 1);
+            while (slots[slot] != NULL) {
+                slot = (slot + 1) & (num_slots - 1);
+            }
+            slots[slot] = strings->slots[i];
+        }
+    }
+    free(strings->slots);
+    strings->slots = slots;
+    strings->num_slots = num_slots;
+}
+
+/* Copy size bytes of text into the blocks of the table */
+static char
+*store_text(strings_t *strings, const char *string, size_t size) {
+    if (size > strings->left) {
+        if (strings->num_blocks == strings->max_blocks) {
+            strings->max_blocks = strings->max_blocks ?
+                                  2 * strings->max_blocks : 16;
+            strings->blocks = (char **) realloc(strings->blocks,
+                                                sizeof(char *) *
+                                                strings->max_blocks);
+            assert(strings->blocks != NULL);
+        }
+        /* A string longer than a block is given a block of its own, and
+            the last block keeps filling */
+        size_t block_size = (size > STRING_BLOCK) ? size : STRING_BLOCK;
+        char *block = (char *) malloc(block_size);
+        assert(block != NULL);
+        strings->blocks[strings->num_blocks++] = block;
+        strings->bytes += block_size;
+        if (block_size > size) {
+            strings->text = block;
+            strings->left = block_size;
+        } else {
+            memcpy(block, string, size);
+            return block;
+        }
+    }
+    
+    char *copy = strings->text;
+    memcpy(copy, string, size);
+    strings->text += size;
+    strings->left -= size;
+    return copy;
+}
+
+/* Drop the slots of the table, keeping its strings. No string can be
+   added afterwards */
+void
+seal_strings(strings_t *strings) {
+    free(strings->slots);
+    strings->slots = NULL;
+    strings->num_slots = 0;
+}
+
+/* Count the text held by the table and the table itself */
+void
+measure_strings(strings_t *strings, memory_t *memory) {
+    memory->strings += strings->bytes;
+    memory->string_table += sizeof(*strings) +
+                            sizeof(char *) * (strings->num_slots +
+                                              strings->max_blocks);
+    memory->num_strings += strings->num_strings;
+}
+
+/* Release the table along with every string in it */
+void
+free_strings(strings_t *strings) {
+    assert(strings != NULL);
+    for (int i = 0; i < strings->num_blocks; i++) {
+        free(strings->blocks[i]);
+    }
+    free(strings->blocks);
+    free(strings->slots);
+    free(strings);
+}
+
+/* Free the strings owned by a record, but not the record itself */
+void
+free_fields(record_t *record) {
+    free(record->trade_name);
+    free(record->city_area_name);
+    free(record->location);
+    free(record->industry_desc);
+    free(record->rendered);
+}
+
+/* Record a row of information into the given record, sharing its strings
+   through the table of strings if there is one */
+static void
+parse_record(char *line, int id, record_t *record, strings_t *strings) {
+    /* Indicate the field order to parse the records */
+    int field = 0;
+    /* Rest of the line still to be tokenised */
+    char *rest;
+    /* Separate information via tokenisation method */
+    char *token = strtok_r(line, DELIMITER, &rest);
+    
+    record->id = id;
+    record->rendered = NULL;
+    
+    /* Walk through tokens and match each token to their respective
+       field */
+    while(token != NULL) {
+        field_match(token, field, record, &rest, strings);
+        
+        /* Point the token to the next information to be recorded */
+        token = strtok_r(NULL, DELIMITER, &rest);
+        field++;
+    }
+}
+
 /* Match and record each information according to their respective field
-   orders */
+   orders. rest is the tokeniser state of the line, since a field may span
+   several tokens */
 void
-field_match(char *token, int field, record_t *record) {
+field_match(char *token, int field, record_t *record, char **rest,
+            strings_t *strings) {
     if (field == CENSUS_YR) {
         record->census_yr = atoi(token);
+#if DIMENSION > YEAR_AXIS
+        /* The census year is indexed as the third axis */
+        (record->coordinates)[YEAR_AXIS] = record->census_yr;
+#endif
         
     } else if (field == BLOCK_ID) {
         record->block_id = atoi(token);
@@ -73,44 +502,49 @@ field_match(char *token, int field, record_t *record) {
         
     } else if (field == CITY_AREA_NAME) {
         /* Check the string before recording the information */
-        char *info = check_and_correct(token);
-        record->city_area_name = (char*) malloc(sizeof(char) * (strlen(info) + 1));
-        assert(record->city_area_name != NULL);
-        strcpy(record->city_area_name, info);
+        char *info = check_and_correct(token, rest);
+        record->city_area_name = copy_field(info, strings);
         
     } else if (field == TRADING_NAME) {
-        char *info = check_and_correct(token);
-        record->trade_name = (char*) malloc(sizeof(char) * (strlen(info) + 1));
-        assert(record->trade_name != NULL);
-        strcpy(record->trade_name, info);
+        char *info = check_and_correct(token, rest);
+        record->trade_name = copy_field(info, strings);
         
     } else if (field == INDUSTRY_CODE) {
         record->industry_code = atoi(token);
         
     } else if (field == INDUSTRY_DESC) {
-        char *info = check_and_correct(token);
-        record->industry_desc = (char*) malloc(sizeof(char) * (strlen(info) + 1));
-        assert(record->industry_desc != NULL);
-        strcpy(record->industry_desc, info);
+        char *info = check_and_correct(token, rest);
+        record->industry_desc = copy_field(info, strings);
         
     } else if (field == X_COORDINATE) {
-        (record->coordinates)[0] = atof(token);
+        (record->coordinates)[0] = record->degrees[0] = atof(token);
         
     } else if (field == Y_COORDINATE) {
-        (record->coordinates)[1] = atof(token);
+        (record->coordinates)[1] = record->degrees[1] = atof(token);
         
     } else {
-        char *info = check_and_correct(token);
-        record->location = (char*) malloc(sizeof(char) * (strlen(info) + 1));
-        assert(record->location != NULL);
-        strcpy(record->location, info);
+        char *info = check_and_correct(token, rest);
+        record->location = copy_field(info, strings);
+    }
+}
+
+/* Copy the text of a field, or find its shared copy in the table of
+   strings if there is one */
+static char
+*copy_field(const char *info, strings_t *strings) {
+    if (strings != NULL) {
+        return intern_string(strings, info);
     }
+    char *copy = (char*) malloc(sizeof(char) * (strlen(info) + 1));
+    assert(copy != NULL);
+    strcpy(copy, info);
+    return copy;
 }
 
 /* Check if the string contains delimiter and return the corrected string to
    be recorded into its field */
 char
-*check_and_correct(char *token) {
+*check_and_correct(char *token, char **rest) {
     /* Check if token starts with abnormal-string indicator (") */
     if (token[0] != ABNORMAL_INDICATOR) {
         return token;
@@ -139,7 +573,7 @@ char
         char *info = token;
         
         char *prev_tok = token;
-        while ((token = strtok(NULL, DELIMITER)) != NULL) {
+        while ((token = strtok_r(NULL, DELIMITER, rest)) != NULL) {
             /* Change the end-string of the previous token back to the
                delimiter (,) to concatenate the previous token with the
                current token */
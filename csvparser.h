@@ -5,9 +5,15 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
 #include "kdtree.h"
 
 #define DELIMITER ","                    /* Information separator */
+#define INITIAL_RECORDS 1024             /* records held before growing */
+#define STRING_BLOCK 65536               /* bytes of text per block of a
+                                            string table */
+#define INITIAL_SLOTS 1024               /* slots of a new string table */
+#define EARTH_RADIUS 6371008.8           /* mean radius in metres */
 
 #define ABNORMAL_INDICATOR '"'           /* Abnormal string format indicator
                                             - Use to indicate presence of
@@ -26,19 +32,96 @@
 #define LOCATION 10                      /* list of field orders */
 
 /* Contains information of each record */
-typedef struct {
+struct record {
+    int id;                              /* row number in the dataset */
     int census_yr, block_id, property_id, base_prop_id, industry_code;
-    double coordinates[2];
+    double coordinates[DIMENSION];
+    double degrees[METRIC_DIMENSION];    /* x and y as read, which are
+                                            printed even when the
+                                            coordinates are projected */
     char *trade_name;
     char *location;
     char *city_area_name;
     char *industry_desc;
-} record_t;
+    char *rendered;                      /* record as printed in the output
+                                            format, created on first use */
+    int rendered_len;
+    int rendered_format;
+};
+
+/* Distinct strings of the fields, so that records repeating a string
+    share one copy. The text is packed into blocks, which only a string
+    longer than a block has to itself, and found through an open
+    addressing table kept at most half full */
+struct strings {
+    char **slots;                        /* string of each slot, or NULL,
+                                            until the table is sealed */
+    size_t num_slots;                    /* a power of two, 0 once
+                                            sealed */
+    size_t num_strings;
+    char **blocks;
+    int num_blocks;
+    int max_blocks;
+    char *text;                          /* free text of the last block */
+    size_t left;                         /* bytes free at text */
+    size_t bytes;                        /* bytes of every block */
+};
+
+/* Part of the plane on the metric axes, including lo but not hi. Bounds
+    may be infinite */
+typedef struct {
+    double lo[METRIC_DIMENSION];
+    double hi[METRIC_DIMENSION];
+} region_t;
+
+/* Local plane in metres around an origin, approximating the earth by the
+    equirectangular projection: each axis is scaled by the metres in one
+    degree at the latitude of the origin */
+typedef struct {
+    double origin[METRIC_DIMENSION];     /* degrees */
+    double scale[METRIC_DIMENSION];      /* metres per degree */
+} projection_t;
+
+/* Project a location from degrees into the plane of the projection */
+static inline void
+project_point(const projection_t *projection, double *coordinates) {
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        coordinates[d] = (coordinates[d] - projection->origin[d]) *
+                         projection->scale[d];
+    }
+}
+
+/* Check if a location lies inside the region */
+static inline int
+in_region(const region_t *region, const double *coordinates) {
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        if (coordinates[d] < region->lo[d] || coordinates[d] >= region->hi[d]) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
 /* Function prototypes */
 char* read_and_parse(FILE *file, tree_t *tree);
-void field_match(char *token, int field, record_t *record);
-char* check_and_correct(char *token);
+char* read_and_parse_balanced(FILE *file, tree_t *tree, int num_threads);
+char* read_and_parse_region(FILE *file, tree_t *tree, int num_threads,
+                            const region_t *region,
+                            const projection_t *projection);
+void centre_projection(FILE *file, projection_t *projection);
+void survey_csv(FILE *file, int balanced, const projection_t *projection,
+                memory_t *layouts, double *lo, double *hi);
+double *read_locations(FILE *file, int *num_records);
+void free_fields(record_t *record);
+void measure_fields(record_t *record, memory_t *memory);
+strings_t *make_strings(void);
+char *intern_string(strings_t *strings, const char *string);
+void seal_strings(strings_t *strings);
+void measure_strings(strings_t *strings, memory_t *memory);
+void free_strings(strings_t *strings);
+void field_match(char *token, int field, record_t *record, char **rest,
+                 strings_t *strings);
+char* check_and_correct(char *token, char **rest);
 void char_swap(char *s1, char *s2);
 void remove_dupe_quote(char *string);
 char *clean_field(char *field);
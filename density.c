@@ -0,0 +1,331 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the density search that counts the records in each cell of a grid *
+* over a box in one traversal of the KD tree. Subtrees lying inside a single *
+* cell are counted from their summary without visiting their points         *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "density.h"
+
+static void reset_density(density_t *density);
+static int recursive_density_search(node_t *root, query_t *query,
+                                    density_t *density);
+static int density_cell(density_t *density, double value, int axis);
+static int summary_cell(density_t *density, summary_t *summary);
+static void count_group(density_t *density, group_t *group, int cell);
+static int find_industry(density_t *density, int code);
+static void write_matrix(output_t *out, const char *key, const char *name,
+                         int *counts, density_t *density);
+static int total_count(int *counts, density_t *density);
+
+/* Start with no grid, counting each industry as well if by_industry is
+    set */
+void
+init_density(density_t *density, int by_industry) {
+    memset(density, 0, sizeof(*density));
+    density->by_industry = by_industry;
+}
+
+/* Obtain a density key input by the user: the corners of the box, the
+    number of columns and rows, then optionally the range of each attribute
+    axis. The grid of the density is laid out for the key and emptied */
+query_t
+*get_density_key(density_t *density, char **key) {
+    char *search_key = NULL;
+    size_t lineBufferLength = 0;
+    /* Flag to check if a line is read */
+    ssize_t read_flag;
+
+    if ((read_flag = getline(&search_key, &lineBufferLength, stdin)) == -1) {
+        /* No key is found */
+        free(search_key);
+        return NULL;
+    }
+
+    /* Create a duplicate string of search key for output later */
+    *key = duplicate_string(search_key);
+
+    query_t *query = (query_t *) malloc(sizeof(query_t));
+    assert(query != NULL);
+
+    double values[KEY_LENGTH + 4];
+    int num_values = parse_key(search_key, values, KEY_LENGTH + 4);
+    fill_query(query, values, num_values, 4);
+
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        density->lo[d] = fmin(values[d], values[METRIC_DIMENSION + d]);
+        density->hi[d] = fmax(values[d], values[METRIC_DIMENSION + d]);
+        double cells = values[2 * METRIC_DIMENSION + d];
+        density->cells[d] = (cells < 1) ? 1 :
+                            (cells > MAX_CELLS) ? MAX_CELLS : (int) cells;
+    }
+    /* Give up rows rather than exceed the largest grid */
+    if ((long) density->cells[0] * density->cells[1] > MAX_CELLS) {
+        density->cells[1] = MAX_CELLS / density->cells[0];
+    }
+    reset_density(density);
+
+    free(search_key);
+    return query;
+}
+
+/* Empty every cell of the grid */
+static void
+reset_density(density_t *density) {
+    int num_cells = density->cells[0] * density->cells[1];
+    density->counts = (int *) realloc(density->counts,
+                                      sizeof(int) * num_cells);
+    assert(density->counts != NULL);
+    memset(density->counts, 0, sizeof(int) * num_cells);
+
+    for (int i = 0; i < density->num_industries; i++) {
+        free(density->industry_counts[i]);
+    }
+    density->num_industries = 0;
+}
+
+/* Count the records of every location in the grid of the density (and
+    inside the attribute ranges of the query), returning the number of
+    nodes visited */
+int
+density_search(tree_t *tree, query_t *query, density_t *density) {
+    assert(tree != NULL);
+    return recursive_density_search(tree->root, query, density);
+}
+
+static int
+recursive_density_search(node_t *root, query_t *query, density_t *density) {
+    if (root == NULL) {
+        return 0;
+    }
+    summary_t *summary = &root->summary;
+
+    /* Skip subtrees lying outside the box or an attribute range */
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        if (summary->hi[d] < density->lo[d] ||
+            summary->lo[d] >= density->hi[d]) {
+            return 1;
+        }
+    }
+    int inside = 1;
+    for (int d = METRIC_DIMENSION; d < DIMENSION; d++) {
+        if (summary->hi[d] < query->lo[d] || summary->lo[d] > query->hi[d]) {
+            return 1;
+        }
+        inside &= summary->lo[d] >= query->lo[d] &&
+                  summary->hi[d] <= query->hi[d];
+    }
+
+    /* A subtree inside a single cell and every attribute range is counted
+        as a whole, unless its industries are needed */
+    int cell;
+    if (inside && !density->by_industry &&
+        (cell = summary_cell(density, summary)) >= 0) {
+        density->counts[cell] += summary->num_records;
+        return 1;
+    }
+
+    double *coordinates = root->group.records->coordinates;
+    int x = density_cell(density, coordinates[0], 0);
+    int y = density_cell(density, coordinates[1], 1);
+    if (x >= 0 && y >= 0 && in_range(coordinates, query)) {
+        count_group(density, &root->group, y * density->cells[0] + x);
+    }
+
+    return 1 + recursive_density_search(root->left, query, density) +
+           recursive_density_search(root->rght, query, density);
+}
+
+/* Return the column (or row) holding the value, or -1 if it lies outside
+    the grid. Cells only grow with the value, so a box whose corners share
+    a cell lies entirely inside it */
+static int
+density_cell(density_t *density, double value, int axis) {
+    if (value < density->lo[axis] || value >= density->hi[axis]) {
+        return -1;
+    }
+    int cell = (int) ((value - density->lo[axis]) /
+                      (density->hi[axis] - density->lo[axis]) *
+                      density->cells[axis]);
+    return (cell < density->cells[axis]) ? cell : density->cells[axis] - 1;
+}
+
+/* Return the cell holding the whole box of a summary, or -1 if there is
+    none */
+static int
+summary_cell(density_t *density, summary_t *summary) {
+    int x = density_cell(density, summary->lo[0], 0);
+    int y = density_cell(density, summary->lo[1], 1);
+    if (x < 0 || y < 0 || x != density_cell(density, summary->hi[0], 0) ||
+        y != density_cell(density, summary->hi[1], 1)) {
+        return -1;
+    }
+    return y * density->cells[0] + x;
+}
+
+static void
+count_group(density_t *density, group_t *group, int cell) {
+    density->counts[cell] += group->num_records;
+    if (density->by_industry) {
+        for (int i = 0; i < group->num_records; i++) {
+            int industry = find_industry(density,
+                                         group->records[i].industry_code);
+            density->industry_counts[industry][cell]++;
+        }
+    }
+}
+
+/* Return the index of an industry code, adding it in order the first time
+    it is found */
+static int
+find_industry(density_t *density, int code) {
+    int lo = 0, hi = density->num_industries;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (density->industries[mid] < code) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < density->num_industries && density->industries[lo] == code) {
+        return lo;
+    }
+
+    if (density->num_industries == density->max_industries) {
+        density->max_industries = density->max_industries ?
+                                  2 * density->max_industries : 16;
+        density->industries = (int *) realloc(density->industries,
+                                              sizeof(int) *
+                                              density->max_industries);
+        density->industry_counts = (int **) realloc(
+            density->industry_counts,
+            sizeof(int *) * density->max_industries);
+        assert(density->industries != NULL &&
+               density->industry_counts != NULL);
+    }
+    int move = density->num_industries - lo;
+    memmove(&density->industries[lo + 1], &density->industries[lo],
+            sizeof(int) * move);
+    memmove(&density->industry_counts[lo + 1], &density->industry_counts[lo],
+            sizeof(int *) * move);
+    density->industries[lo] = code;
+    density->industry_counts[lo] = (int *) calloc(density->cells[0] *
+                                                  density->cells[1],
+                                                  sizeof(int));
+    assert(density->industry_counts[lo] != NULL);
+    density->num_industries++;
+
+    return lo;
+}
+
+/* Write the grid of counts of a key, followed by the grid of each industry
+    found when counting industries. Text and csv print one line per row
+    from the lowest y, jsonl one object per key, and binary the
+    little-endian int32 query index, columns, rows and number of industries followed by the
+    counts, then the code and counts of each industry */
+void
+write_density(output_t *out, const char *key, density_t *density) {
+    int num_cells = density->cells[0] * density->cells[1];
+
+    if (out->format == FORMAT_BINARY) {
+        write_int32(out, out->query_index);
+        write_int32(out, density->cells[0]);
+        write_int32(out, density->cells[1]);
+        write_int32(out, density->num_industries);
+        for (int c = 0; c < num_cells; c++) {
+            write_int32(out, density->counts[c]);
+        }
+        for (int i = 0; i < density->num_industries; i++) {
+            write_int32(out, density->industries[i]);
+            for (int c = 0; c < num_cells; c++) {
+                write_int32(out, density->industry_counts[i][c]);
+            }
+        }
+
+    } else if (out->format == FORMAT_JSONL) {
+        fputs("{\"key\":", out->fp);
+        write_json_string(out->fp, key);
+        fprintf(out->fp, ",\"columns\":%d,\"rows\":%d,\"counts\":",
+                density->cells[0], density->cells[1]);
+        write_matrix(out, key, NULL, density->counts, density);
+        if (density->by_industry) {
+            fputs(",\"industries\":{", out->fp);
+            for (int i = 0; i < density->num_industries; i++) {
+                fprintf(out->fp, "%s\"%d\":", i ? "," : "",
+                        density->industries[i]);
+                write_matrix(out, key, NULL, density->industry_counts[i],
+                             density);
+            }
+            fputc('}', out->fp);
+        }
+        fputs("}\n", out->fp);
+
+    } else {
+        write_matrix(out, key, "all", density->counts, density);
+        for (int i = 0; i < density->num_industries; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), "%d", density->industries[i]);
+            write_matrix(out, key, name, density->industry_counts[i],
+                         density);
+        }
+    }
+}
+
+/* Write one grid of counts in the text, csv or jsonl format */
+static void
+write_matrix(output_t *out, const char *key, const char *name, int *counts,
+             density_t *density) {
+    int columns = density->cells[0], rows = density->cells[1];
+
+    if (out->format == FORMAT_JSONL) {
+        fputc('[', out->fp);
+        for (int y = 0; y < rows; y++) {
+            fputs(y ? ",[" : "[", out->fp);
+            for (int x = 0; x < columns; x++) {
+                fprintf(out->fp, "%s%d", x ? "," : "", counts[y * columns + x]);
+            }
+            fputc(']', out->fp);
+        }
+        fputc(']', out->fp);
+        return;
+    }
+
+    if (out->format == FORMAT_TEXT) {
+        fprintf(out->fp, "%s --> %s: %d x %d cells, %d records\n", key, name,
+                columns, rows, total_count(counts, density));
+    }
+    for (int y = 0; y < rows; y++) {
+        if (out->format == FORMAT_CSV) {
+            fprintf(out->fp, "%s,%s,%d", key, name, y);
+        }
+        for (int x = 0; x < columns; x++) {
+            if (out->format == FORMAT_CSV) {
+                fprintf(out->fp, ",%d", counts[y * columns + x]);
+            } else {
+                fprintf(out->fp, "%s%d", x ? " " : "", counts[y * columns + x]);
+            }
+        }
+        fputc('\n', out->fp);
+    }
+}
+
+static int
+total_count(int *counts, density_t *density) {
+    int total = 0;
+    for (int i = 0; i < density->cells[0] * density->cells[1]; i++) {
+        total += counts[i];
+    }
+    return total;
+}
+
+void
+free_density(density_t *density) {
+    assert(density != NULL);
+    for (int i = 0; i < density->num_industries; i++) {
+        free(density->industry_counts[i]);
+    }
+    free(density->industry_counts);
+    free(density->industries);
+    free(density->counts);
+}
@@ -0,0 +1,40 @@
+#ifndef density_h
+#define density_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "kdtree.h"
+#include "csvparser.h"
+#include "search.h"
+#include "output.h"
+
+#define MAX_CELLS 1048576                /* cells of the largest grid */
+
+/* Number of records in each cell of a grid laid over a box, and optionally
+    the number of each industry. A cell includes its lower edges but not
+    its upper ones */
+typedef struct {
+    double lo[METRIC_DIMENSION];         /* box covered by the grid */
+    double hi[METRIC_DIMENSION];
+    int cells[METRIC_DIMENSION];         /* columns (x) and rows (y) */
+    int *counts;                         /* records per cell, row by row
+                                            from the lowest y */
+    int by_industry;                     /* set to count each industry */
+    int *industries;                     /* codes found, in increasing
+                                            order */
+    int **industry_counts;               /* records per cell of each code */
+    int num_industries;
+    int max_industries;
+} density_t;
+
+/* prototypes for the functions in this library */
+void init_density(density_t *density, int by_industry);
+query_t *get_density_key(density_t *density, char **key);
+int density_search(tree_t *tree, query_t *query, density_t *density);
+void write_density(output_t *out, const char *key, density_t *density);
+void free_density(density_t *density);
+
+#endif /* density_h */
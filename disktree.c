@@ -0,0 +1,769 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the out-of-core KD tree. The tree is written to a file of fixed    *
+* size blocks, each packing the top levels of a subtree so that a path from  *
+* the root crosses few blocks, and searched through a bounded buffer pool   *
+* that evicts the least recently used block and reads sibling blocks ahead  *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "disktree.h"
+
+/* Subtree waiting to be placed in a block while the tree is written */
+typedef struct {
+    node_t *root;
+    long patch;                          /* position of the reference to
+                                            it in the file, -1 if none */
+    int partner;                         /* subtree of the other child of
+                                            its parent, -1 if none */
+    int32_t block;                       /* block it was placed in */
+} pending_t;
+
+/* Tree being written into a file of blocks */
+typedef struct {
+    FILE *fp;
+    FILE *records;                       /* records, until they follow the
+                                            blocks */
+    char block[DISK_BLOCK];              /* block being filled */
+    node_t *slots[NODES_PER_BLOCK];      /* and the nodes placed in it */
+    int64_t number;                      /* of the block, 0 if none */
+    int num_nodes;
+    int64_t offset;                      /* bytes of records written */
+    int64_t num_records;
+    pending_t *pending;
+    int num_pending;
+    int max_pending;
+    int32_t *siblings;                   /* of each block written */
+    int num_blocks;
+    int max_blocks;
+} writer_t;
+
+static int add_pending(writer_t *writer, node_t *root, long patch,
+                       int partner);
+static int count_nodes(node_t *root, int limit);
+static void start_block(writer_t *writer);
+static void finish_block(writer_t *writer);
+static int64_t place_subtree(writer_t *writer, int p);
+static int write_group(FILE *fp, group_t *group, int64_t *num_records);
+static int copy_file(FILE *from, FILE *to);
+static void init_pool(pool_t *pool, int fd, int num_frames);
+static char *fetch_block(pool_t *pool, int64_t block, int read_ahead);
+static int find_frame(pool_t *pool, int64_t block);
+static int take_frame(pool_t *pool, int64_t block);
+static void touch_frame(pool_t *pool, int frame);
+static void unlink_frame(pool_t *pool, int frame);
+static void read_block(pool_t *pool, int frame, int64_t block);
+static void free_pool(pool_t *pool);
+static void get_node(disk_tree_t *disk, int64_t ref, disk_node_t *node);
+static void recursive_disk_nearest(disk_tree_t *disk, int64_t ref,
+                                   query_t *query, double *nearest_dist,
+                                   disk_node_t *nearest_node, int *found,
+                                   int *num_cmp, unsigned depth);
+static int recursive_disk_radius(disk_tree_t *disk, int64_t ref,
+                                 query_t *query, double radius,
+                                 unsigned depth);
+static void load_records(disk_tree_t *disk, disk_node_t *node, double dist);
+static void hand_out(disk_tree_t *disk, result_set_t *set);
+static void forget_records(disk_tree_t *disk);
+
+/* Open the disk tree at path, first writing it from the CSV file (built
+    as opts ask) if it is missing or older than the CSV file. Building
+    holds the whole tree in memory once, searching only the pool. Exits if
+    neither can be read */
+disk_tree_t
+*prepare_disk_tree(const char *filename, const char *path, int num_frames,
+                   const engine_opts_t *opts) {
+    struct stat csv_stat, disk_stat;
+
+    if (stat(path, &disk_stat) != 0 ||
+        (stat(filename, &csv_stat) == 0 &&
+         csv_stat.st_mtime >= disk_stat.st_mtime)) {
+        engine_t *engine = open_engine(filename, opts);
+        dataset_t *data = engine_enter(engine, 0);
+        int written = write_disk_tree(data->tree, path);
+        engine_exit(engine, 0);
+        close_engine(engine);
+        if (!written) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    disk_tree_t *disk = open_disk_tree(path, num_frames);
+    if (disk == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return disk;
+}
+
+/* Write the tree into a file of blocks, returning 0 if it cannot be
+    written. A subtree too large for a block fills one breadth first from
+    its root, and the children left over become subtrees of their own.
+    Subtrees that fit are packed whole into a shared block, in the order
+    they are met, so that a block only ever splits the top of a large
+    subtree. A reference to a subtree is filled in once its block is
+    known, and the records of the nodes follow the blocks */
+int
+write_disk_tree(tree_t *tree, const char *path) {
+    writer_t writer;
+    memset(&writer, 0, sizeof(writer));
+    if (!(writer.fp = fopen(path, "wb"))) {
+        fprintf(stderr, "Error writing to file '%s'\n", path);
+        return 0;
+    }
+    /* Records are gathered apart until the number of blocks is known */
+    writer.records = tmpfile();
+    assert(writer.records != NULL);
+
+    disk_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DISK_MAGIC, sizeof(header.magic));
+    header.dimension = DIMENSION;
+    header.block_size = DISK_BLOCK;
+    header.root = -1;
+    fwrite(writer.block, sizeof(writer.block), 1, writer.fp);
+
+    if (tree->root != NULL) {
+        add_pending(&writer, tree->root, -1, -1);
+    }
+    for (int p = 0; p < writer.num_pending; p++) {
+        if (count_nodes(writer.pending[p].root, NODES_PER_BLOCK + 1) >
+            NODES_PER_BLOCK - writer.num_nodes) {
+            finish_block(&writer);
+        }
+        if (writer.number == 0) {
+            start_block(&writer);
+        }
+        int64_t ref = place_subtree(&writer, p);
+        if (p == 0) {
+            header.root = ref;
+        }
+        if (writer.num_nodes == NODES_PER_BLOCK) {
+            finish_block(&writer);
+        }
+    }
+    finish_block(&writer);
+
+    /* Siblings are only known once both are placed */
+    for (int b = 0; b < writer.num_blocks; b++) {
+        fseek(writer.fp, (long) (1 + b) * DISK_BLOCK +
+                         offsetof(block_header_t, sibling), SEEK_SET);
+        fwrite(&writer.siblings[b], sizeof(int32_t), 1, writer.fp);
+    }
+    fseek(writer.fp, 0, SEEK_END);
+
+    header.num_node_blocks = writer.num_blocks;
+    header.records_offset = (int64_t) (1 + writer.num_blocks) * DISK_BLOCK;
+    header.num_records = writer.num_records;
+    int written = copy_file(writer.records, writer.fp);
+    fclose(writer.records);
+    free(writer.pending);
+    free(writer.siblings);
+
+    fseek(writer.fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, writer.fp);
+    written = written && !ferror(writer.fp);
+    if (fclose(writer.fp) != 0 || !written) {
+        fprintf(stderr, "Error writing to file '%s'\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+/* Queue a subtree for placing. patch is the position in the file of the
+    reference to it (-1 for the root), and partner the subtree of the other
+    child of its parent (-1 for none) */
+static int
+add_pending(writer_t *writer, node_t *root, long patch, int partner) {
+    if (writer->num_pending == writer->max_pending) {
+        writer->max_pending = writer->max_pending ?
+                              2 * writer->max_pending : 64;
+        writer->pending = (pending_t *) realloc(writer->pending,
+                                                sizeof(pending_t) *
+                                                writer->max_pending);
+        assert(writer->pending != NULL);
+    }
+    pending_t *pending = &writer->pending[writer->num_pending];
+    pending->root = root;
+    pending->patch = patch;
+    pending->partner = partner;
+    pending->block = -1;
+    return writer->num_pending++;
+}
+
+/* Count the nodes of a subtree, stopping once there are limit of them */
+static int
+count_nodes(node_t *root, int limit) {
+    if (root == NULL || limit <= 0) {
+        return 0;
+    }
+    int count = 1 + count_nodes(root->left, limit - 1);
+    return count + count_nodes(root->rght, limit - count);
+}
+
+/* Open the next block, with no sibling until one is placed */
+static void
+start_block(writer_t *writer) {
+    if (writer->num_blocks == writer->max_blocks) {
+        writer->max_blocks = writer->max_blocks ? 2 * writer->max_blocks : 64;
+        writer->siblings = (int32_t *) realloc(writer->siblings,
+                                               sizeof(int32_t) *
+                                               writer->max_blocks);
+        assert(writer->siblings != NULL);
+    }
+    writer->siblings[writer->num_blocks] = -1;
+    writer->number = 1 + writer->num_blocks++;
+    writer->num_nodes = 0;
+    memset(writer->block, 0, sizeof(writer->block));
+}
+
+/* Write the open block, if any, at the end of the file */
+static void
+finish_block(writer_t *writer) {
+    if (writer->number == 0) {
+        return;
+    }
+    ((block_header_t *) writer->block)->num_nodes = writer->num_nodes;
+    fseek(writer->fp, 0, SEEK_END);
+    fwrite(writer->block, sizeof(writer->block), 1, writer->fp);
+    writer->number = 0;
+}
+
+/* Fill the open block breadth first from the root of a pending subtree,
+    queueing the children that do not fit, and return the reference of
+    the root */
+static int64_t
+place_subtree(writer_t *writer, int p) {
+    disk_node_t *nodes = (disk_node_t *) (writer->block +
+                                          sizeof(block_header_t));
+    int64_t number = writer->number;
+    int64_t ref = number * NODES_PER_BLOCK + writer->num_nodes;
+    pending_t *pending = &writer->pending[p];
+    pending->block = (int32_t) number;
+
+    /* Point the parent at the subtree, and the two blocks of a pair of
+        children at each other */
+    if (pending->patch >= 0) {
+        fseek(writer->fp, pending->patch, SEEK_SET);
+        fwrite(&ref, sizeof(ref), 1, writer->fp);
+    }
+    int32_t partner = (pending->partner >= 0) ?
+                      writer->pending[pending->partner].block : -1;
+    if (partner >= 0 && partner != number) {
+        if (writer->siblings[number - 1] < 0) {
+            writer->siblings[number - 1] = partner;
+        }
+        if (writer->siblings[partner - 1] < 0) {
+            writer->siblings[partner - 1] = (int32_t) number;
+        }
+    }
+
+    int first = writer->num_nodes;
+    writer->slots[writer->num_nodes++] = pending->root;
+    for (int s = first; s < writer->num_nodes; s++) {
+        node_t *node = writer->slots[s];
+        memcpy(nodes[s].coordinates, node->group.records->coordinates,
+               sizeof(nodes[s].coordinates));
+        nodes[s].records = writer->offset;
+        nodes[s].num_records = node->group.num_records;
+        nodes[s].length = write_group(writer->records, &node->group,
+                                      &writer->num_records);
+        writer->offset += nodes[s].length;
+
+        /* Children stay in this block while there is room */
+        node_t *children[2] = {node->left, node->rght};
+        int queued = -1;
+        for (int c = 0; c < 2; c++) {
+            if (children[c] == NULL) {
+                nodes[s].child[c] = -1;
+            } else if (writer->num_nodes < NODES_PER_BLOCK) {
+                writer->slots[writer->num_nodes] = children[c];
+                nodes[s].child[c] = number * NODES_PER_BLOCK +
+                                    writer->num_nodes++;
+            } else {
+                long patch = (long) number * DISK_BLOCK +
+                             sizeof(block_header_t) +
+                             sizeof(disk_node_t) * s +
+                             offsetof(disk_node_t, child) +
+                             sizeof(int64_t) * c;
+                int added = add_pending(writer, children[c], patch, queued);
+                if (queued >= 0) {
+                    writer->pending[queued].partner = added;
+                }
+                queued = added;
+            }
+        }
+    }
+    return ref;
+}
+
+/* Write the records of a location, returning the number of bytes
+    written */
+static int
+write_group(FILE *fp, group_t *group, int64_t *num_records) {
+    int length = 0;
+
+    for (int i = 0; i < group->num_records; i++) {
+        record_t *record = &group->records[i];
+        char *strings[4] = {record->trade_name, record->location,
+                            record->city_area_name, record->industry_desc};
+        disk_record_t stored = {record->id, record->census_yr,
+                                record->block_id, record->property_id,
+                                record->base_prop_id, record->industry_code};
+        memcpy(stored.coordinates, record->coordinates,
+               sizeof(stored.coordinates));
+        for (int s = 0; s < 4; s++) {
+            stored.lengths[s] = (int32_t) strlen(strings[s]) + 1;
+        }
+
+        fwrite(&stored, sizeof(stored), 1, fp);
+        length += (int) sizeof(stored);
+        for (int s = 0; s < 4; s++) {
+            fwrite(strings[s], 1, stored.lengths[s], fp);
+            length += stored.lengths[s];
+        }
+        *num_records += 1;
+    }
+
+    return length;
+}
+
+/* Append the whole of one file to another, returning 0 on failure */
+static int
+copy_file(FILE *from, FILE *to) {
+    char buffer[DISK_BLOCK];
+    size_t length;
+
+    rewind(from);
+    while ((length = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+        if (fwrite(buffer, 1, length, to) != length) {
+            return 0;
+        }
+    }
+    return !ferror(from);
+}
+
+/* Open a file written by write_disk_tree with a pool of num_frames blocks,
+    returning NULL if it cannot be read or was written with another number
+    of axes */
+disk_tree_t
+*open_disk_tree(const char *path, int num_frames) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening file '%s'\n", path);
+        return NULL;
+    }
+
+    disk_header_t header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, DISK_MAGIC, sizeof(header.magic)) != 0 ||
+        header.dimension != DIMENSION || header.block_size != DISK_BLOCK) {
+        fprintf(stderr, "File '%s' is not a disk tree of %d axes\n", path,
+                DIMENSION);
+        close(fd);
+        return NULL;
+    }
+
+    disk_tree_t *disk = (disk_tree_t *) malloc(sizeof(*disk));
+    assert(disk != NULL);
+    disk->header = header;
+    init_pool(&disk->pool, fd, num_frames < MIN_FRAMES ? MIN_FRAMES :
+                               num_frames);
+    disk->records = NULL;
+    disk->dists = NULL;
+    disk->num_records = disk->max_records = 0;
+    disk->buffer = NULL;
+    disk->size = 0;
+
+    return disk;
+}
+
+/* Set up a pool of empty frames, linked from the newest to the oldest in
+    the order they are numbered */
+static void
+init_pool(pool_t *pool, int fd, int num_frames) {
+    pool->fd = fd;
+    pool->num_frames = num_frames;
+    pool->data = (char *) malloc((size_t) num_frames * DISK_BLOCK);
+    pool->blocks = (int64_t *) malloc(sizeof(int64_t) * num_frames);
+    pool->newer = (int *) malloc(sizeof(int) * num_frames);
+    pool->older = (int *) malloc(sizeof(int) * num_frames);
+    pool->chain = (int *) malloc(sizeof(int) * num_frames);
+    assert(pool->data != NULL && pool->blocks != NULL &&
+           pool->newer != NULL && pool->older != NULL && pool->chain != NULL);
+
+    for (int f = 0; f < num_frames; f++) {
+        pool->blocks[f] = -1;
+        pool->newer[f] = f - 1;
+        pool->older[f] = (f + 1 < num_frames) ? f + 1 : -1;
+        pool->chain[f] = -1;
+    }
+    pool->newest = 0;
+    pool->oldest = num_frames - 1;
+
+    pool->num_buckets = 1;
+    while (pool->num_buckets < 2 * num_frames) {
+        pool->num_buckets *= 2;
+    }
+    pool->buckets = (int *) malloc(sizeof(int) * pool->num_buckets);
+    assert(pool->buckets != NULL);
+    for (int b = 0; b < pool->num_buckets; b++) {
+        pool->buckets[b] = -1;
+    }
+
+    pool->pages_read = pool->read_ahead = pool->hits = pool->misses = 0;
+}
+
+/* Return the bytes of a block, reading it into the pool if it is not held.
+    With read_ahead, a node block read from the file brings its sibling
+    along. The bytes stay valid until the next block is fetched */
+static char
+*fetch_block(pool_t *pool, int64_t block, int read_ahead) {
+    int frame = find_frame(pool, block);
+    if (frame >= 0) {
+        pool->hits++;
+        touch_frame(pool, frame);
+        return pool->data + (size_t) frame * DISK_BLOCK;
+    }
+
+    pool->misses++;
+    frame = take_frame(pool, block);
+    read_block(pool, frame, block);
+    char *data = pool->data + (size_t) frame * DISK_BLOCK;
+
+    if (read_ahead) {
+        int32_t sibling = ((block_header_t *) data)->sibling;
+        if (sibling >= 0 && find_frame(pool, sibling) < 0) {
+            /* The block just read is the newest, so it is not evicted */
+            read_block(pool, take_frame(pool, sibling), sibling);
+            pool->read_ahead++;
+            touch_frame(pool, frame);
+        }
+    }
+    return data;
+}
+
+/* Return the frame holding a block, or -1 if it is not held */
+static int
+find_frame(pool_t *pool, int64_t block) {
+    int frame = pool->buckets[block & (pool->num_buckets - 1)];
+    while (frame >= 0 && pool->blocks[frame] != block) {
+        frame = pool->chain[frame];
+    }
+    return frame;
+}
+
+/* Evict the oldest frame and give it to a block as the newest frame */
+static int
+take_frame(pool_t *pool, int64_t block) {
+    int frame = pool->oldest;
+
+    if (pool->blocks[frame] >= 0) {
+        int *link = &pool->buckets[pool->blocks[frame] &
+                                   (pool->num_buckets - 1)];
+        while (*link != frame) {
+            link = &pool->chain[*link];
+        }
+        *link = pool->chain[frame];
+    }
+
+    int bucket = (int) (block & (pool->num_buckets - 1));
+    pool->blocks[frame] = block;
+    pool->chain[frame] = pool->buckets[bucket];
+    pool->buckets[bucket] = frame;
+    touch_frame(pool, frame);
+
+    return frame;
+}
+
+/* Make a frame the newest */
+static void
+touch_frame(pool_t *pool, int frame) {
+    if (pool->newest == frame) {
+        return;
+    }
+    unlink_frame(pool, frame);
+    pool->older[frame] = pool->newest;
+    pool->newer[frame] = -1;
+    pool->newer[pool->newest] = frame;
+    pool->newest = frame;
+}
+
+static void
+unlink_frame(pool_t *pool, int frame) {
+    if (pool->newer[frame] >= 0) {
+        pool->older[pool->newer[frame]] = pool->older[frame];
+    } else {
+        pool->newest = pool->older[frame];
+    }
+    if (pool->older[frame] >= 0) {
+        pool->newer[pool->older[frame]] = pool->newer[frame];
+    } else {
+        pool->oldest = pool->newer[frame];
+    }
+}
+
+/* Read a block of the file into a frame. The last block of the file may
+    be short, so the rest of the frame is emptied */
+static void
+read_block(pool_t *pool, int frame, int64_t block) {
+    char *data = pool->data + (size_t) frame * DISK_BLOCK;
+    ssize_t num_read = pread(pool->fd, data, DISK_BLOCK,
+                             (off_t) block * DISK_BLOCK);
+    if (num_read < 0) {
+        fprintf(stderr, "Error reading block %lld of the disk tree\n",
+                (long long) block);
+        exit(EXIT_FAILURE);
+    }
+    memset(data + num_read, 0, DISK_BLOCK - num_read);
+    pool->pages_read++;
+}
+
+static void
+free_pool(pool_t *pool) {
+    close(pool->fd);
+    free(pool->data);
+    free(pool->blocks);
+    free(pool->newer);
+    free(pool->older);
+    free(pool->chain);
+    free(pool->buckets);
+}
+
+/* Copy a node out of its block, so that it outlives the block in the
+    pool */
+static void
+get_node(disk_tree_t *disk, int64_t ref, disk_node_t *node) {
+    char *data = fetch_block(&disk->pool, ref / NODES_PER_BLOCK, 1);
+    memcpy(node, data + sizeof(block_header_t) +
+                 sizeof(disk_node_t) * (ref % NODES_PER_BLOCK),
+           sizeof(*node));
+}
+
+/* Find every record at the nearest point to the key, returning the number
+    of records found. The search is the one of nearest_search, so it makes
+    the same comparisons and finds the same point */
+int
+disk_nearest(disk_tree_t *disk, query_t *query, result_set_t *set) {
+    double nearest_dist = INFINITY;
+    disk_node_t nearest_node;
+    int found = 0;
+
+    forget_records(disk);
+    clear_result_set(set);
+    recursive_disk_nearest(disk, disk->header.root, query, &nearest_dist,
+                           &nearest_node, &found, &set->num_cmp, 0);
+    if (found) {
+        load_records(disk, &nearest_node, nearest_dist);
+    }
+    hand_out(disk, set);
+    return set->num_matches;
+}
+
+static void
+recursive_disk_nearest(disk_tree_t *disk, int64_t ref, query_t *query,
+                       double *nearest_dist, disk_node_t *nearest_node,
+                       int *found, int *num_cmp, unsigned depth) {
+    if (ref < 0) {
+        return;
+    }
+    disk_node_t node;
+    get_node(disk, ref, &node);
+    *num_cmp += 1;
+
+    double eud_dist = calc_dist(node.coordinates, query->coordinates);
+    unsigned level = depth % DIMENSION;
+
+    if (eud_dist <= *nearest_dist && in_range(node.coordinates, query)) {
+        *nearest_dist = eud_dist;
+        *nearest_node = node;
+        *found = 1;
+    }
+
+    if (DIMENSION > METRIC_DIMENSION && level >= METRIC_DIMENSION) {
+        /* On an attribute axis only search the children that can hold
+            values inside the range */
+        if (node.coordinates[level] > query->lo[level]) {
+            recursive_disk_nearest(disk, node.child[0], query, nearest_dist,
+                                   nearest_node, found, num_cmp, depth + 1);
+        }
+        if (node.coordinates[level] <= query->hi[level]) {
+            recursive_disk_nearest(disk, node.child[1], query, nearest_dist,
+                                   nearest_node, found, num_cmp, depth + 1);
+        }
+        return;
+    }
+
+    double dim_dist = node.coordinates[level] - query->coordinates[level];
+    int64_t near = (dim_dist > 0) ? node.child[0] : node.child[1];
+    int64_t far = (dim_dist > 0) ? node.child[1] : node.child[0];
+
+    recursive_disk_nearest(disk, near, query, nearest_dist, nearest_node,
+                           found, num_cmp, depth + 1);
+    if (fabs(dim_dist) < *nearest_dist) {
+        recursive_disk_nearest(disk, far, query, nearest_dist, nearest_node,
+                               found, num_cmp, depth + 1);
+    }
+}
+
+/* Find every record within the radius of the key, returning the number of
+    records found. The search is the one of recursive_radius_search */
+int
+disk_radius(disk_tree_t *disk, query_t *query, double radius,
+            result_set_t *set) {
+    forget_records(disk);
+    clear_result_set(set);
+    set->num_cmp = recursive_disk_radius(disk, disk->header.root, query,
+                                         radius, 0);
+    hand_out(disk, set);
+    return set->num_matches;
+}
+
+static int
+recursive_disk_radius(disk_tree_t *disk, int64_t ref, query_t *query,
+                      double radius, unsigned depth) {
+    if (ref < 0) {
+        return 0;
+    }
+    disk_node_t node;
+    get_node(disk, ref, &node);
+
+    double eud_dist = calc_dist(node.coordinates, query->coordinates);
+    unsigned level = depth % DIMENSION;
+
+    if (eud_dist <= radius && in_range(node.coordinates, query)) {
+        load_records(disk, &node, eud_dist);
+    }
+
+    int num_cmp = 1;
+    if (DIMENSION > METRIC_DIMENSION && level >= METRIC_DIMENSION) {
+        if (node.coordinates[level] > query->lo[level]) {
+            num_cmp += recursive_disk_radius(disk, node.child[0], query,
+                                             radius, depth + 1);
+        }
+        if (node.coordinates[level] <= query->hi[level]) {
+            num_cmp += recursive_disk_radius(disk, node.child[1], query,
+                                             radius, depth + 1);
+        }
+        return num_cmp;
+    }
+
+    double dim_dist = node.coordinates[level] - query->coordinates[level];
+    if (dim_dist > 0 || fabs(dim_dist) <= radius) {
+        num_cmp += recursive_disk_radius(disk, node.child[0], query, radius,
+                                         depth + 1);
+    }
+    if (dim_dist <= 0 || fabs(dim_dist) <= radius) {
+        num_cmp += recursive_disk_radius(disk, node.child[1], query, radius,
+                                         depth + 1);
+    }
+    return num_cmp;
+}
+
+/* Read the records of a node from the file into the records of the
+    search */
+static void
+load_records(disk_tree_t *disk, disk_node_t *node, double dist) {
+    if (node->length > disk->size) {
+        disk->size = node->length;
+        disk->buffer = (char *) realloc(disk->buffer, disk->size);
+        assert(disk->buffer != NULL);
+    }
+    int64_t offset = disk->header.records_offset + node->records;
+    for (int done = 0; done < node->length; ) {
+        int64_t block = (offset + done) / DISK_BLOCK;
+        int start = (int) ((offset + done) % DISK_BLOCK);
+        int length = DISK_BLOCK - start;
+        if (length > node->length - done) {
+            length = node->length - done;
+        }
+        memcpy(disk->buffer + done, fetch_block(&disk->pool, block, 0) + start,
+               length);
+        done += length;
+    }
+
+    if (disk->num_records + node->num_records > disk->max_records) {
+        disk->max_records = 2 * (disk->num_records + node->num_records);
+        disk->records = (record_t *) realloc(disk->records, sizeof(record_t) *
+                                             disk->max_records);
+        disk->dists = (double *) realloc(disk->dists, sizeof(double) *
+                                         disk->max_records);
+        assert(disk->records != NULL && disk->dists != NULL);
+    }
+
+    char *curr = disk->buffer;
+    for (int i = 0; i < node->num_records; i++) {
+        disk_record_t stored;
+        memcpy(&stored, curr, sizeof(stored));
+        curr += sizeof(stored);
+
+        record_t *record = &disk->records[disk->num_records];
+        disk->dists[disk->num_records++] = dist;
+        record->id = stored.id;
+        record->census_yr = stored.census_yr;
+        record->block_id = stored.block_id;
+        record->property_id = stored.property_id;
+        record->base_prop_id = stored.base_prop_id;
+        record->industry_code = stored.industry_code;
+        memcpy(record->coordinates, stored.coordinates,
+               sizeof(record->coordinates));
+        memcpy(record->degrees, stored.coordinates, sizeof(record->degrees));
+        char **strings[4] = {&record->trade_name, &record->location,
+                             &record->city_area_name, &record->industry_desc};
+        for (int s = 0; s < 4; s++) {
+            *strings[s] = (char *) malloc(stored.lengths[s]);
+            assert(*strings[s] != NULL);
+            memcpy(*strings[s], curr, stored.lengths[s]);
+            curr += stored.lengths[s];
+        }
+        record->rendered = NULL;
+    }
+}
+
+/* Add the records of the search to the result set once they have stopped
+    moving */
+static void
+hand_out(disk_tree_t *disk, result_set_t *set) {
+    for (int i = 0; i < disk->num_records; i++) {
+        if (set->num_results < set->capacity) {
+            set->results[set->num_results].record = &disk->records[i];
+            set->results[set->num_results].dist = disk->dists[i];
+            set->num_results++;
+        }
+    }
+    set->num_matches = disk->num_records;
+}
+
+/* Drop the records of the last search, along with what the output
+    rendered of them */
+static void
+forget_records(disk_tree_t *disk) {
+    for (int i = 0; i < disk->num_records; i++) {
+        free_fields(&disk->records[i]);
+    }
+    disk->num_records = 0;
+}
+
+/* Print the pages read and the hit rate of the pool */
+void
+print_pool_stats(disk_tree_t *disk, FILE *fp) {
+    pool_t *pool = &disk->pool;
+    long fetches = pool->hits + pool->misses;
+    fprintf(fp, "pool: %d frames of %d bytes, %ld pages read (%ld ahead), "
+                "hit rate %.1f%%\n", pool->num_frames, DISK_BLOCK,
+            pool->pages_read, pool->read_ahead,
+            fetches ? 100.0 * pool->hits / fetches : 0);
+}
+
+void
+close_disk_tree(disk_tree_t *disk) {
+    assert(disk != NULL);
+    forget_records(disk);
+    free(disk->records);
+    free(disk->dists);
+    free(disk->buffer);
+    free_pool(&disk->pool);
+    free(disk);
+}
@@ -0,0 +1,108 @@
+#ifndef disktree_h
+#define disktree_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include "kdtree.h"
+#include "csvparser.h"
+#include "search.h"
+#include "engine.h"
+
+#define DISK_MAGIC "KDDISK1"             /* start of every disk tree file */
+#define DISK_BLOCK 4096                  /* bytes of a block of the file */
+#define DISK_FRAMES 256                  /* default blocks in the pool */
+#define MIN_FRAMES 4
+
+/* First block of a disk tree file. References to nodes are block *
+    NODES_PER_BLOCK + slot, -1 for none. Node blocks follow from block 1,
+    and the records of every node from records_offset */
+typedef struct {
+    char magic[8];
+    int32_t dimension;
+    int32_t block_size;
+    int64_t root;
+    int64_t num_node_blocks;
+    int64_t records_offset;              /* bytes from the start of file */
+    int64_t num_records;
+} disk_header_t;
+
+/* Start of a node block. The sibling is the block holding the other child
+    of the parent of the root of this block, read along with it */
+typedef struct {
+    int32_t num_nodes;
+    int32_t sibling;                     /* block, -1 if there is none */
+} block_header_t;
+
+/* Node as stored in a node block */
+typedef struct {
+    double coordinates[DIMENSION];
+    int64_t child[2];                    /* left and right references */
+    int64_t records;                     /* bytes from records_offset */
+    int32_t num_records;
+    int32_t length;                      /* bytes of the records */
+} disk_node_t;
+
+#define NODES_PER_BLOCK ((DISK_BLOCK - (int) sizeof(block_header_t)) / \
+                         (int) sizeof(disk_node_t))
+
+/* Record as stored in the file, followed by its strings in the order of
+    lengths */
+typedef struct {
+    int32_t id, census_yr, block_id, property_id, base_prop_id, industry_code;
+    double coordinates[DIMENSION];
+    int32_t lengths[4];                  /* trade name, location, city area
+                                            and industry, each with its
+                                            null byte */
+} disk_record_t;
+
+/* Bounded pool of blocks of a file, evicting the least recently used
+    block. Frames are linked from the newest to the oldest, and found from
+    their block through chained hash buckets */
+typedef struct {
+    int fd;
+    int num_frames;
+    char *data;                          /* DISK_BLOCK bytes per frame */
+    int64_t *blocks;                     /* held by each frame, -1 if none */
+    int *newer;
+    int *older;
+    int newest;
+    int oldest;
+    int *buckets;                        /* first frame of each bucket */
+    int *chain;                          /* next frame in the bucket */
+    int num_buckets;                     /* a power of two */
+    long pages_read;                     /* blocks read from the file */
+    long read_ahead;                     /* of which read as siblings */
+    long hits;
+    long misses;
+} pool_t;
+
+/* KD tree searched from its file through a buffer pool. The records of
+    the last search are kept until the next one, as the result set points
+    into them */
+typedef struct {
+    disk_header_t header;
+    pool_t pool;
+    record_t *records;                   /* records of the last search */
+    double *dists;                       /* and their distances */
+    int num_records;
+    int max_records;
+    char *buffer;                        /* records of a node as read */
+    int size;
+} disk_tree_t;
+
+/* prototypes for the functions in this library */
+disk_tree_t *prepare_disk_tree(const char *filename, const char *path,
+                               int num_frames, const engine_opts_t *opts);
+int write_disk_tree(tree_t *tree, const char *path);
+disk_tree_t *open_disk_tree(const char *path, int num_frames);
+int disk_nearest(disk_tree_t *disk, query_t *query, result_set_t *set);
+int disk_radius(disk_tree_t *disk, query_t *query, double radius,
+                result_set_t *set);
+void print_pool_stats(disk_tree_t *disk, FILE *fp);
+void close_disk_tree(disk_tree_t *disk);
+
+#endif /* disktree_h */
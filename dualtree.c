@@ -0,0 +1,407 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is an all-points nearest neighbour join between two datasets (or a    *
+* dataset and itself) using a dual-tree traversal over bucket KD trees       *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <pthread.h>
+#include "dualtree.h"
+
+/* State shared by the workers of a join */
+typedef struct {
+    jtree_t *query;
+    jtree_t *ref;
+    join_opts_t *opts;
+    double *best_dist;                   /* squared distance per query point */
+    int *best;                           /* reference point per query point */
+    jnode_t **tasks;                     /* query subtrees to be joined */
+    int num_tasks;
+    int next_task;                       /* next task to be claimed */
+    long num_dist;
+    pthread_mutex_t lock;
+} join_t;
+
+static void collect_points(node_t *root, jpoint_t *points, int *num_points);
+static int count_records(node_t *root);
+static jnode_t *build_join_node(jpoint_t *points, int start, int end);
+static void select_point(jpoint_t *points, int start, int end, int nth,
+                         int dim);
+static double box_dist(jnode_t *a, jnode_t *b);
+static void dual_search(join_t *join, jnode_t *q, jnode_t *r, long *num_dist);
+static void base_case(join_t *join, jnode_t *q, jnode_t *r, long *num_dist);
+static void collect_tasks(jnode_t *root, jnode_t **tasks, int *num_tasks,
+                          unsigned depth);
+static void *join_worker(void *arg);
+static void free_join_node(jnode_t *root);
+static int pair_cmp(const void *a, const void *b);
+
+/* Build a bucket KD tree over every record stored in the KD tree */
+jtree_t
+*make_join_tree(tree_t *tree) {
+    assert(tree != NULL);
+    jtree_t *jtree = (jtree_t *) malloc(sizeof(*jtree));
+    assert(jtree != NULL);
+
+    int num_records = count_records(tree->root);
+    jtree->points = (jpoint_t *) malloc(sizeof(jpoint_t) *
+                                        (num_records ? num_records : 1));
+    assert(jtree->points != NULL);
+    jtree->num_points = 0;
+    collect_points(tree->root, jtree->points, &jtree->num_points);
+
+    jtree->root = NULL;
+    if (jtree->num_points > 0) {
+        jtree->root = build_join_node(jtree->points, 0, jtree->num_points);
+    }
+
+    return jtree;
+}
+
+/* Count the records stored in the subtree including duplicates */
+static int
+count_records(node_t *root) {
+    if (root == NULL) {
+        return 0;
+    }
+
+    return root->group.num_records + count_records(root->left) +
+           count_records(root->rght);
+}
+
+/* Copy every record of the subtree into the point array */
+static void
+collect_points(node_t *root, jpoint_t *points, int *num_points) {
+    if (root == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < root->group.num_records; i++) {
+        record_t *record = &root->group.records[i];
+        jpoint_t *point = &points[(*num_points)++];
+        memcpy(point->coordinates, record->coordinates,
+               sizeof(point->coordinates));
+        point->record = record;
+    }
+    collect_points(root->left, points, num_points);
+    collect_points(root->rght, points, num_points);
+}
+
+/* Recursively split the points around the median of their widest
+    dimension until each leaf holds at most LEAF_SIZE points */
+static jnode_t
+*build_join_node(jpoint_t *points, int start, int end) {
+    jnode_t *node = (jnode_t *) malloc(sizeof(*node));
+    assert(node != NULL);
+    node->start = start;
+    node->end = end;
+    node->bound = INFINITY;
+    node->left = node->rght = NULL;
+
+    /* Find the bounding box of the points */
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        node->lo[d] = node->hi[d] = points[start].coordinates[d];
+    }
+    for (int i = start + 1; i < end; i++) {
+        for (int d = 0; d < METRIC_DIMENSION; d++) {
+            double value = points[i].coordinates[d];
+            if (value < node->lo[d]) {
+                node->lo[d] = value;
+            } else if (value > node->hi[d]) {
+                node->hi[d] = value;
+            }
+        }
+    }
+
+    if (end - start <= LEAF_SIZE) {
+        return node;
+    }
+
+    int dim = 0;
+    for (int d = 1; d < METRIC_DIMENSION; d++) {
+        if (node->hi[d] - node->lo[d] > node->hi[dim] - node->lo[dim]) {
+            dim = d;
+        }
+    }
+
+    int mid = start + (end - start) / 2;
+    select_point(points, start, end, mid, dim);
+    node->left = build_join_node(points, start, mid);
+    node->rght = build_join_node(points, mid, end);
+
+    return node;
+}
+
+/* Partially order the points so that the nth point is in its sorted
+    position along the given dimension (quickselect) */
+static void
+select_point(jpoint_t *points, int start, int end, int nth, int dim) {
+    int lo = start, hi = end - 1;
+
+    while (lo < hi) {
+        double pivot = points[lo + (hi - lo) / 2].coordinates[dim];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (points[i].coordinates[dim] < pivot) {
+                i++;
+            }
+            while (points[j].coordinates[dim] > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                jpoint_t tmp = points[i];
+                points[i++] = points[j];
+                points[j--] = tmp;
+            }
+        }
+
+        /* Continue only with the side holding the nth point */
+        if (nth <= j) {
+            hi = j;
+        } else if (nth >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+}
+
+/* Squared distance between the closest points of two bounding boxes */
+static double
+box_dist(jnode_t *a, jnode_t *b) {
+    double dist = 0;
+
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        double gap = 0;
+        if (a->hi[d] < b->lo[d]) {
+            gap = b->lo[d] - a->hi[d];
+        } else if (b->hi[d] < a->lo[d]) {
+            gap = a->lo[d] - b->hi[d];
+        }
+        dist += gap * gap;
+    }
+
+    return dist;
+}
+
+/* Find the nearest reference point of every query point, returning one
+    pair per query record ordered by query record id. User is responsible
+    to free the returned array */
+pair_t
+*nearest_join(jtree_t *query, jtree_t *ref, join_opts_t *opts,
+              int *num_pairs) {
+    assert(query != NULL && ref != NULL && opts != NULL);
+    join_t join;
+    join.query = query;
+    join.ref = ref;
+    join.opts = opts;
+    join.num_dist = 0;
+    join.next_task = 0;
+    pthread_mutex_init(&join.lock, NULL);
+
+    int num_points = query->num_points;
+    join.best_dist = (double *) malloc(sizeof(double) * (num_points + 1));
+    join.best = (int *) malloc(sizeof(int) * (num_points + 1));
+    assert(join.best_dist != NULL && join.best != NULL);
+    for (int i = 0; i < num_points; i++) {
+        join.best_dist[i] = INFINITY;
+        join.best[i] = -1;
+    }
+
+    /* The query subtrees at a fixed depth are joined independently, so
+        the result does not depend on the number of threads */
+    join.tasks = (jnode_t **) malloc(sizeof(jnode_t *) << TASK_DEPTH);
+    assert(join.tasks != NULL);
+    join.num_tasks = 0;
+    if (query->root != NULL && ref->root != NULL) {
+        collect_tasks(query->root, join.tasks, &join.num_tasks, 0);
+    }
+
+    int num_threads = opts->num_threads > 0 ? opts->num_threads : 1;
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) *
+                                              num_threads);
+    assert(threads != NULL);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, join_worker, &join) != 0) {
+            fprintf(stderr, "Error creating join worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(join.tasks);
+    pthread_mutex_destroy(&join.lock);
+
+    /* Record the nearest pair of each query point */
+    pair_t *pairs = (pair_t *) malloc(sizeof(pair_t) * (num_points + 1));
+    assert(pairs != NULL);
+    for (int i = 0; i < num_points; i++) {
+        pairs[i].query_id = query->points[i].record->id;
+        if (join.best[i] >= 0) {
+            pairs[i].ref_id = ref->points[join.best[i]].record->id;
+            pairs[i].dist = sqrt(join.best_dist[i]);
+        } else {
+            pairs[i].ref_id = -1;
+            pairs[i].dist = INFINITY;
+        }
+    }
+    qsort(pairs, num_points, sizeof(pair_t), pair_cmp);
+
+    opts->num_dist = join.num_dist;
+    free(join.best_dist);
+    free(join.best);
+    *num_pairs = num_points;
+
+    return pairs;
+}
+
+/* Gather the query subtrees at TASK_DEPTH (or leaves above it) */
+static void
+collect_tasks(jnode_t *root, jnode_t **tasks, int *num_tasks,
+              unsigned depth) {
+    if (depth == TASK_DEPTH || root->left == NULL) {
+        tasks[(*num_tasks)++] = root;
+        return;
+    }
+    collect_tasks(root->left, tasks, num_tasks, depth + 1);
+    collect_tasks(root->rght, tasks, num_tasks, depth + 1);
+}
+
+/* Claim query subtrees one at a time and join each against the whole
+    reference tree */
+static void
+*join_worker(void *arg) {
+    join_t *join = arg;
+    long num_dist = 0;
+
+    while (1) {
+        pthread_mutex_lock(&join->lock);
+        int task = join->next_task++;
+        pthread_mutex_unlock(&join->lock);
+
+        if (task >= join->num_tasks) {
+            break;
+        }
+        dual_search(join, join->tasks[task], join->ref->root, &num_dist);
+    }
+
+    pthread_mutex_lock(&join->lock);
+    join->num_dist += num_dist;
+    pthread_mutex_unlock(&join->lock);
+
+    return NULL;
+}
+
+/* Recursively join a query node with a reference node, pruning the pair
+    when no reference point can be nearer than the query node bound */
+static void
+dual_search(join_t *join, jnode_t *q, jnode_t *r, long *num_dist) {
+    if (box_dist(q, r) > q->bound) {
+        return;
+    }
+
+    if (q->left == NULL && r->left == NULL) {
+        base_case(join, q, r, num_dist);
+
+    } else if (r->left == NULL ||
+               (q->left != NULL && q->end - q->start >= r->end - r->start)) {
+        /* Split the larger node, here the query node */
+        dual_search(join, q->left, r, num_dist);
+        dual_search(join, q->rght, r, num_dist);
+        q->bound = fmax(q->left->bound, q->rght->bound);
+
+    } else {
+        /* Split the reference node, visiting the closer child first so
+            the bound tightens early */
+        jnode_t *near = r->left, *far = r->rght;
+        if (box_dist(q, far) < box_dist(q, near)) {
+            near = r->rght;
+            far = r->left;
+        }
+        dual_search(join, q, near, num_dist);
+        dual_search(join, q, far, num_dist);
+    }
+}
+
+/* Compare every query point of a leaf against every reference point of
+    a leaf */
+static void
+base_case(join_t *join, jnode_t *q, jnode_t *r, long *num_dist) {
+    jpoint_t *qpoints = join->query->points;
+    jpoint_t *rpoints = join->ref->points;
+    double bound = 0;
+
+    for (int i = q->start; i < q->end; i++) {
+        record_t *qrecord = qpoints[i].record;
+
+        for (int j = r->start; j < r->end; j++) {
+            record_t *rrecord = rpoints[j].record;
+
+            /* A record is never its own nearest neighbour */
+            if (rrecord == qrecord) {
+                continue;
+            }
+            if (join->opts->match == MATCH_SAME_INDUSTRY &&
+                rrecord->industry_code != qrecord->industry_code) {
+                continue;
+            }
+            if (join->opts->match == MATCH_OTHER_INDUSTRY &&
+                rrecord->industry_code == qrecord->industry_code) {
+                continue;
+            }
+
+            double dist = 0;
+            for (int d = 0; d < METRIC_DIMENSION; d++) {
+                double diff = qpoints[i].coordinates[d] -
+                              rpoints[j].coordinates[d];
+                dist += diff * diff;
+            }
+            *num_dist += 1;
+
+            if (join->opts->exclude_colocated &&
+                dist < EPSILON * EPSILON) {
+                continue;
+            }
+
+            /* Ties go to the lowest record id to keep results stable */
+            if (dist < join->best_dist[i] ||
+                (dist == join->best_dist[i] &&
+                 rrecord->id < rpoints[join->best[i]].record->id)) {
+                join->best_dist[i] = dist;
+                join->best[i] = j;
+            }
+        }
+
+        if (join->best_dist[i] > bound) {
+            bound = join->best_dist[i];
+        }
+    }
+
+    q->bound = bound;
+}
+
+/* Order pairs by query record id */
+static int
+pair_cmp(const void *a, const void *b) {
+    const pair_t *pa = a, *pb = b;
+    return (pa->query_id > pb->query_id) - (pa->query_id < pb->query_id);
+}
+
+/* Release the join tree and its points, the records are not freed */
+void
+free_join_tree(jtree_t *jtree) {
+    assert(jtree != NULL);
+    free_join_node(jtree->root);
+    free(jtree->points);
+    free(jtree);
+}
+
+static void
+free_join_node(jnode_t *root) {
+    if (root) {
+        free_join_node(root->left);
+        free_join_node(root->rght);
+        free(root);
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef dualtree_h
+#define dualtree_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "kdtree.h"
+#include "csvparser.h"
+
+#define LEAF_SIZE 16                     /* max points held by a leaf */
+#define TASK_DEPTH 6                     /* query subtrees at this depth are
+                                            the units of parallel work */
+
+#define MATCH_ANY 0                      /* any reference point */
+#define MATCH_SAME_INDUSTRY 1            /* same industry code only */
+#define MATCH_OTHER_INDUSTRY 2           /* different industry code only */
+
+/* Point of a join tree, one per record */
+typedef struct {
+    double coordinates[METRIC_DIMENSION];
+    record_t *record;
+} jpoint_t;
+
+typedef struct jnode jnode_t;            /* node of a join tree */
+
+struct jnode {
+    double lo[METRIC_DIMENSION];         /* bounding box of the points */
+    double hi[METRIC_DIMENSION];
+    int start, end;                      /* range of points in the node */
+    double bound;                        /* largest squared nearest distance
+                                            of any query point in the node */
+    jnode_t *left;
+    jnode_t *rght;
+};
+
+/* Bucket KD tree over every record of a dataset */
+typedef struct {
+    jpoint_t *points;
+    int num_points;
+    jnode_t *root;
+} jtree_t;
+
+/* Nearest reference record of a query record */
+typedef struct {
+    int query_id;                        /* record ids, -1 if no match */
+    int ref_id;
+    double dist;
+} pair_t;
+
+/* Settings of a nearest neighbour join */
+typedef struct {
+    int match;                           /* one of MATCH_* */
+    int exclude_colocated;               /* skip points at the same
+                                            location as the query */
+    int num_threads;
+    long num_dist;                       /* distance computations made */
+} join_opts_t;
+
+/* prototypes for the functions in this library */
+jtree_t *make_join_tree(tree_t *tree);
+pair_t *nearest_join(jtree_t *query, jtree_t *ref, join_opts_t *opts,
+                     int *num_pairs);
+void free_join_tree(jtree_t *jtree);
+
+#endif /* dualtree_h */
@@ -0,0 +1,303 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the search engine that programs embed to search the CLUE dataset   *
+* in process. Searches fill result sets provided by the caller with the      *
+* records found, and never touch files or any state shared between calls     *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "engine.h"
+
+static void *make_planner_aux(tree_t *tree, void *threshold);
+static void free_planner_aux(void *planner);
+static void collect_results(node_t *node, double dist, void *arg);
+static query_t *metric_query(dataset_t *data, query_t *query,
+                             query_t *projected);
+
+/* Load the dataset along with its index (and planner, if any), exiting if
+    it cannot be read */
+engine_t
+*open_engine(const char *filename, const engine_opts_t *opts) {
+    engine_t *engine = (engine_t *) malloc(sizeof(*engine));
+    assert(engine != NULL);
+
+    engine->opts = *opts;
+    if (engine->opts.backend == NULL) {
+        engine->opts.backend = &kd_backend;
+    }
+    if (engine->opts.threshold >= 0) {
+        engine->reloader = make_reloader(filename, engine->opts.backend,
+                                         engine->opts.build_threads,
+                                         engine->opts.region,
+                                         engine->opts.metric,
+                                         engine->opts.budget,
+                                         make_planner_aux, free_planner_aux,
+                                         &engine->opts.threshold);
+    } else {
+        engine->reloader = make_reloader(filename, engine->opts.backend,
+                                         engine->opts.build_threads,
+                                         engine->opts.region,
+                                         engine->opts.metric,
+                                         engine->opts.budget, NULL, NULL,
+                                         NULL);
+    }
+
+    return engine;
+}
+
+/* Rebuild the dataset whenever the process receives SIGHUP */
+void
+watch_engine(engine_t *engine) {
+    start_watching(engine->reloader);
+}
+
+/* Start searching as the given reader, which no other thread may be using.
+    The dataset returned and every record found in it stay valid until
+    engine_exit is called */
+dataset_t
+*engine_enter(engine_t *engine, int reader) {
+    return reader_enter(engine->reloader, reader);
+}
+
+void
+engine_exit(engine_t *engine, int reader) {
+    reader_exit(engine->reloader, reader);
+}
+
+/* Set up an empty result set over a buffer of capacity results */
+void
+init_result_set(result_set_t *set, result_t *buffer, int capacity) {
+    set->results = buffer;
+    set->capacity = capacity;
+    clear_result_set(set);
+}
+
+/* Enlarge the buffer of a result set, which must have come from malloc,
+    to hold every match of the last search so that it can be repeated */
+void
+grow_result_set(result_set_t *set) {
+    if (set->num_matches > set->capacity) {
+        set->capacity = set->num_matches;
+        set->results = (result_t *) realloc(set->results, sizeof(result_t) *
+                                            set->capacity);
+        assert(set->results != NULL);
+    }
+}
+
+/* Find every record at the nearest point to the key, returning the number
+    of records found */
+int
+search_nearest(engine_t *engine, dataset_t *data, query_t *query,
+               result_set_t *set) {
+    const backend_t *backend = engine->opts.backend;
+    node_t *nearest_node;
+    query_t projected;
+
+    clear_result_set(set);
+    query = metric_query(data, query, &projected);
+    if (backend != &kd_backend) {
+        nearest_node = backend->nearest(data->index, query, &set->num_cmp);
+    } else if (engine->opts.approx_mode) {
+        /* The outcome of the approximation is kept per search */
+        approx_t approx = engine->opts.approx;
+        nearest_node = nearest_search(data->tree, query, &set->num_cmp,
+                                      &approx);
+        set->exact = approx.exact;
+    } else {
+        nearest_node = nearest_search(data->tree, query, &set->num_cmp,
+                                      NULL);
+    }
+
+    if (nearest_node != NULL) {
+        double *coordinates = nearest_node->group.records->coordinates;
+        collect_results(nearest_node,
+                        calc_dist(coordinates, query->coordinates), set);
+    }
+    return set->num_matches;
+}
+
+/* Find every record within the radius of the key, returning the number of
+    records found */
+int
+search_radius(engine_t *engine, dataset_t *data, query_t *query,
+              double radius, result_set_t *set) {
+    planner_t *planner = data->aux;
+    query_t projected;
+
+    clear_result_set(set);
+    query = metric_query(data, query, &projected);
+    if (planner != NULL) {
+        set->plan = plan_radius_search(planner, query, radius,
+                                       &set->estimate);
+    }
+    if (set->plan == PLAN_SCAN) {
+        set->num_cmp = scan_radius(planner, query, radius, collect_results,
+                                   set);
+    } else {
+        set->num_cmp = engine->opts.backend->radius(data->index, query,
+                                                    radius, collect_results,
+                                                    set);
+    }
+    return set->num_matches;
+}
+
+/* Find a page of the records within the radius of the key in order of
+    distance: limit records past the cursor, or after skipping offset
+    records if the cursor has not started, which then moves to the end of the page. Returns the number of records
+    on the page. The search is best first over the subtree summaries of
+    the KD tree, whatever the index */
+int
+search_radius_page(engine_t *engine, dataset_t *data, query_t *query,
+                   double radius, int offset, int limit, cursor_t *cursor,
+                   result_set_t *set) {
+    query_t projected;
+
+    clear_result_set(set);
+    query = metric_query(data, query, &projected);
+    set->num_cmp = ordered_radius_search(data->tree, query, radius, offset,
+                                         limit, cursor, set);
+    return set->num_matches;
+}
+
+/* Find every record inside the rectangle [lo, hi] (and the attribute ranges
+    of the query), returning the number of records found */
+int
+search_range(engine_t *engine, dataset_t *data, query_t *query, double *lo,
+             double *hi, result_set_t *set) {
+    query_t projected;
+    double corners[2][METRIC_DIMENSION];
+
+    clear_result_set(set);
+    query = metric_query(data, query, &projected);
+    if (data->projected) {
+        /* The projection keeps the order on each axis */
+        memcpy(corners[0], lo, sizeof(corners[0]));
+        memcpy(corners[1], hi, sizeof(corners[1]));
+        project_point(&data->projection, corners[0]);
+        project_point(&data->projection, corners[1]);
+        lo = corners[0];
+        hi = corners[1];
+    }
+    set->num_cmp = engine->opts.backend->range(data->index, query, lo, hi,
+                                               collect_results, set);
+    return set->num_matches;
+}
+
+/* Find every record inside the polygon (and the attribute ranges of the
+    query), returning the number of records found. Like density searches it
+    relies on the subtree summaries of the KD tree whatever the index */
+int
+search_polygon(engine_t *engine, dataset_t *data, query_t *query,
+               polygon_t *polygon, result_set_t *set) {
+    query_t projected;
+
+    clear_result_set(set);
+    query = metric_query(data, query, &projected);
+    if (!data->projected) {
+        set->num_cmp = polygon_search(data->tree, query, polygon,
+                                      collect_results, set);
+        return set->num_matches;
+    }
+
+    /* Projecting scales each axis, so the inside of the polygon stays the
+        inside of its projection */
+    polygon_t metres = *polygon;
+    metres.vertices = (double *) malloc(sizeof(double) * METRIC_DIMENSION *
+                                        polygon->num_vertices);
+    assert(metres.vertices != NULL);
+    memcpy(metres.vertices, polygon->vertices, sizeof(double) *
+           METRIC_DIMENSION * polygon->num_vertices);
+    for (int i = 0; i < polygon->num_vertices; i++) {
+        project_point(&data->projection,
+                      &metres.vertices[METRIC_DIMENSION * i]);
+    }
+    project_point(&data->projection, metres.lo);
+    project_point(&data->projection, metres.hi);
+    set->num_cmp = polygon_search(data->tree, query, &metres,
+                                  collect_results, set);
+    free(metres.vertices);
+    return set->num_matches;
+}
+
+/* Count the records in each cell of the grid of the density, returning
+    the number of nodes visited. Subtree summaries only exist in the KD
+    tree, which every index is built over, so it is searched whatever the
+    index */
+int
+search_density(engine_t *engine, dataset_t *data, query_t *query,
+               density_t *density) {
+    query_t projected;
+    query = metric_query(data, query, &projected);
+    if (!data->projected) {
+        return density_search(data->tree, query, density);
+    }
+
+    /* The grid is laid over the projected box, whose cells hold the same
+        locations */
+    double lo[METRIC_DIMENSION], hi[METRIC_DIMENSION];
+    memcpy(lo, density->lo, sizeof(lo));
+    memcpy(hi, density->hi, sizeof(hi));
+    project_point(&data->projection, density->lo);
+    project_point(&data->projection, density->hi);
+    int num_cmp = density_search(data->tree, query, density);
+    memcpy(density->lo, lo, sizeof(lo));
+    memcpy(density->hi, hi, sizeof(hi));
+    return num_cmp;
+}
+
+/* Stop watching for reloads and release the dataset */
+void
+close_engine(engine_t *engine) {
+    assert(engine != NULL);
+    free_reloader(engine->reloader);
+    free(engine);
+}
+
+/* Empty a result set before a search, keeping its buffer */
+void
+clear_result_set(result_set_t *set) {
+    set->num_results = 0;
+    set->num_matches = 0;
+    set->num_cmp = 0;
+    set->exact = 1;
+    set->plan = PLAN_TREE;
+    set->estimate = 0;
+}
+
+/* Add every record at a point found to the result set, counting those
+    that do not fit */
+static void
+collect_results(node_t *node, double dist, void *arg) {
+    result_set_t *set = arg;
+    for (int i = 0; i < node->group.num_records; i++) {
+        if (set->num_results < set->capacity) {
+            set->results[set->num_results].record = &node->group.records[i];
+            set->results[set->num_results].dist = dist;
+            set->num_results++;
+        }
+    }
+    set->num_matches += node->group.num_records;
+}
+
+/* Return the query in the units of the dataset: the query itself, or a
+    copy in projected with its key point projected into metres */
+static query_t
+*metric_query(dataset_t *data, query_t *query, query_t *projected) {
+    if (!data->projected) {
+        return query;
+    }
+    *projected = *query;
+    project_point(&data->projection, projected->coordinates);
+    return projected;
+}
+
+/* Build the query planner of a newly loaded tree */
+static void
+*make_planner_aux(tree_t *tree, void *threshold) {
+    return make_planner(tree, *(double *) threshold);
+}
+
+/* Release the query planner of a replaced tree */
+static void
+free_planner_aux(void *planner) {
+    free_planner(planner);
+}
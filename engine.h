@@ -0,0 +1,68 @@
+#ifndef engine_h
+#define engine_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "kdtree.h"
+#include "csvparser.h"
+#include "search.h"
+#include "planner.h"
+#include "reload.h"
+#include "backend.h"
+#include "density.h"
+
+/* How the dataset of an engine is built and searched */
+typedef struct {
+    const backend_t *backend;            /* spatial index, NULL for kd */
+    int build_threads;                   /* workers building a balanced
+                                            tree, 0 to insert in order */
+    double threshold;                    /* planner threshold of radius
+                                            searches, negative to always
+                                            search the index */
+    approx_t approx;                     /* epsilon and node budget of */
+    int approx_mode;                     /* nearest searches, if set */
+    const region_t *region;              /* part of the dataset loaded, or
+                                            NULL for all of it */
+    int metric;                          /* set to search in metres: keys
+                                            stay in degrees and radii are
+                                            in metres */
+    size_t budget;                       /* bytes the dataset may hold,
+                                            reported after loading, or 0
+                                            to load it as usual */
+} engine_opts_t;
+
+/* Search engine over a dataset. Searches only read the engine and write
+    into the result set they are given, so any number of threads may
+    search at once, each through its own reader slot */
+typedef struct {
+    reloader_t *reloader;
+    engine_opts_t opts;
+} engine_t;
+
+/* prototypes for the functions in this library */
+engine_t *open_engine(const char *filename, const engine_opts_t *opts);
+void watch_engine(engine_t *engine);
+dataset_t *engine_enter(engine_t *engine, int reader);
+void engine_exit(engine_t *engine, int reader);
+void init_result_set(result_set_t *set, result_t *buffer, int capacity);
+void clear_result_set(result_set_t *set);
+void grow_result_set(result_set_t *set);
+int search_nearest(engine_t *engine, dataset_t *data, query_t *query,
+                   result_set_t *set);
+int search_radius(engine_t *engine, dataset_t *data, query_t *query,
+                  double radius, result_set_t *set);
+int search_radius_page(engine_t *engine, dataset_t *data, query_t *query,
+                       double radius, int offset, int limit,
+                       cursor_t *cursor, result_set_t *set);
+int search_range(engine_t *engine, dataset_t *data, query_t *query,
+                 double *lo, double *hi, result_set_t *set);
+int search_polygon(engine_t *engine, dataset_t *data, query_t *query,
+                   polygon_t *polygon, result_set_t *set);
+int search_density(engine_t *engine, dataset_t *data, query_t *query,
+                   density_t *density);
+void close_engine(engine_t *engine);
+
+#endif /* engine_h */
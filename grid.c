@@ -0,0 +1,315 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the uniform grid backend. The cell size adapts to the density of   *
+* the dataset so that a cell holds a few locations on average, and the       *
+* locations of each cell are stored contiguously                             *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "backend.h"
+
+#define MAX_GRID_CELLS (1 << 22)         /* cap on the cells of a grid */
+
+/* Locations bucketed into cells of a uniform grid */
+typedef struct {
+    entry_t *entries;                    /* locations ordered by cell */
+    int num_entries;
+    int *start;                          /* first entry of each cell, with
+                                            start[num_cells] = num_entries */
+    int cols, rows;
+    double lo[METRIC_DIMENSION];         /* corner of the grid */
+    double cell;                         /* side of a (square) cell */
+} grid_t;
+
+static void *grid_build(tree_t *tree);
+static node_t *grid_nearest(void *index, query_t *query, int *num_cmp);
+static int grid_radius(void *index, query_t *query, double radius,
+                       report_t report, void *arg);
+static int grid_range(void *index, query_t *query, double *lo, double *hi,
+                      report_t report, void *arg);
+static size_t grid_memory(void *index);
+static size_t grid_estimate(int num_locations, const double *lo,
+                            const double *hi);
+static void grid_shape(int num_entries, const double *lo, const double *hi,
+                       double *cell, int *cols, int *rows);
+static void grid_free(void *index);
+static int grid_col(grid_t *grid, double x);
+static int grid_row(grid_t *grid, double y);
+static int cell_of(grid_t *grid, entry_t *entry);
+static double box_dist(const double *key, double x0, double x1, double y0,
+                       double y1);
+
+const backend_t grid_backend = {
+    "grid", grid_build, grid_nearest, grid_radius, grid_range, grid_memory,
+    grid_estimate, grid_free
+};
+
+/* Bucket the locations of the tree into grid cells */
+static void
+*grid_build(tree_t *tree) {
+    grid_t *grid = (grid_t *) malloc(sizeof(*grid));
+    assert(grid != NULL);
+
+    int num_entries;
+    entry_t *entries = collect_entries(tree, &num_entries);
+    grid->num_entries = num_entries;
+
+    /* Find the bounding box of the locations */
+    double hi[METRIC_DIMENSION] = {0, 0};
+    grid->lo[0] = grid->lo[1] = 0;
+    for (int i = 0; i < num_entries; i++) {
+        for (int d = 0; d < METRIC_DIMENSION; d++) {
+            double value = entries[i].coordinates[d];
+            if (i == 0 || value < grid->lo[d]) {
+                grid->lo[d] = value;
+            }
+            if (i == 0 || value > hi[d]) {
+                hi[d] = value;
+            }
+        }
+    }
+
+    grid_shape(num_entries, grid->lo, hi, &grid->cell, &grid->cols,
+               &grid->rows);
+
+    /* Count the locations of each cell, then order them by cell */
+    size_t cells = (size_t) grid->cols * grid->rows;
+    grid->start = (int *) calloc(cells + 1, sizeof(int));
+    grid->entries = (entry_t *) malloc(sizeof(entry_t) * (num_entries + 1));
+    assert(grid->start != NULL && grid->entries != NULL);
+    for (int i = 0; i < num_entries; i++) {
+        grid->start[cell_of(grid, &entries[i]) + 1]++;
+    }
+    for (size_t c = 0; c < cells; c++) {
+        grid->start[c + 1] += grid->start[c];
+    }
+    int *fill = (int *) malloc(sizeof(int) * (cells + 1));
+    assert(fill != NULL);
+    memcpy(fill, grid->start, sizeof(int) * (cells + 1));
+    for (int i = 0; i < num_entries; i++) {
+        grid->entries[fill[cell_of(grid, &entries[i])]++] = entries[i];
+    }
+
+    free(fill);
+    free(entries);
+    return grid;
+}
+
+/* Size the cells so that each holds GRID_POINTS_PER_CELL locations if
+    the locations within [lo, hi] were spread evenly, with no more than
+    MAX_GRID_CELLS cells in all */
+static void
+grid_shape(int num_entries, const double *lo, const double *hi,
+           double *cell, int *cols, int *rows) {
+    double width = fmax(hi[0] - lo[0], EPSILON);
+    double height = fmax(hi[1] - lo[1], EPSILON);
+    double num_cells = fmax(1.0, (double) num_entries / GRID_POINTS_PER_CELL);
+    if (num_cells > MAX_GRID_CELLS) {
+        num_cells = MAX_GRID_CELLS;
+    }
+    *cell = sqrt(width * height / num_cells);
+
+    /* Locations along a line leave one side of the box at EPSILON, so
+        the cells must also be wide enough to keep the long side in check */
+    *cell = fmax(*cell, fmax(width, height) / MAX_GRID_CELLS);
+    while (1) {
+        *cols = (int) (width / *cell) + 1;
+        *rows = (int) (height / *cell) + 1;
+        size_t cells = (size_t) *cols * *rows;
+        if (cells <= MAX_GRID_CELLS) {
+            break;
+        }
+        *cell *= sqrt((double) cells / MAX_GRID_CELLS);
+    }
+}
+
+/* Return the column holding x, clamped to the grid */
+static int
+grid_col(grid_t *grid, double x) {
+    double col = floor((x - grid->lo[0]) / grid->cell);
+    if (col < 0) {
+        return 0;
+    }
+    return (col >= grid->cols) ? grid->cols - 1 : (int) col;
+}
+
+/* Return the row holding y, clamped to the grid */
+static int
+grid_row(grid_t *grid, double y) {
+    double row = floor((y - grid->lo[1]) / grid->cell);
+    if (row < 0) {
+        return 0;
+    }
+    return (row >= grid->rows) ? grid->rows - 1 : (int) row;
+}
+
+static int
+cell_of(grid_t *grid, entry_t *entry) {
+    return grid_row(grid, entry->coordinates[1]) * grid->cols +
+           grid_col(grid, entry->coordinates[0]);
+}
+
+/* Return the distance from the key to the closest point of the box
+    [x0, x1] x [y0, y1], 0 if it lies inside */
+static double
+box_dist(const double *key, double x0, double x1, double y0, double y1) {
+    double dx = fmax(fmax(x0 - key[0], key[0] - x1), 0);
+    double dy = fmax(fmax(y0 - key[1], key[1] - y1), 0);
+    return sqrt(dx * dx + dy * dy);
+}
+
+/* Search rings of cells around the key, stopping once the next ring lies
+    further away than the nearest location found */
+static node_t
+*grid_nearest(void *index, query_t *query, int *num_cmp) {
+    grid_t *grid = index;
+    double *key = query->coordinates;
+    int col = grid_col(grid, key[0]);
+    int row = grid_row(grid, key[1]);
+    double nearest_dist = INFINITY;
+    node_t *nearest_node = NULL;
+    int max_ring = (grid->cols > grid->rows) ? grid->cols : grid->rows;
+
+    *num_cmp = 0;
+    for (int ring = 0; ring <= max_ring; ring++) {
+        /* Only visit the cells of the ring inside the grid, which is all
+            of its first and last rows but only the ends of the others */
+        int r0 = (row - ring > 0) ? row - ring : 0;
+        int r1 = (row + ring < grid->rows) ? row + ring : grid->rows - 1;
+        int c0 = (col - ring > 0) ? col - ring : 0;
+        int c1 = (col + ring < grid->cols) ? col + ring : grid->cols - 1;
+        for (int r = r0; r <= r1; r++) {
+            int whole = (r == row - ring || r == row + ring);
+            for (int c = c0; c <= c1; c++) {
+                if (!whole && c != col - ring && c != col + ring) {
+                    /* Jump to the end of the ring */
+                    if (col + ring > c1) {
+                        break;
+                    }
+                    c = col + ring;
+                }
+                int cell = r * grid->cols + c;
+                for (int i = grid->start[cell]; i < grid->start[cell + 1];
+                     i++) {
+                    entry_t *entry = &grid->entries[i];
+                    double dist;
+                    *num_cmp += 1;
+                    if (entry_matches(entry, query, nearest_dist, &dist)) {
+                        nearest_dist = dist;
+                        nearest_node = entry->node;
+                    }
+                }
+            }
+        }
+
+        /* Every location not yet searched lies in the strip of the grid
+            beyond an edge of the square that is still inside the grid, so
+            it is at least as far as the nearest such strip. A key outside
+            the grid is measured to the strips themselves, not to the line
+            of their edge */
+        double left = grid->lo[0] + (col - ring) * grid->cell;
+        double right = grid->lo[0] + (col + ring + 1) * grid->cell;
+        double bottom = grid->lo[1] + (row - ring) * grid->cell;
+        double top = grid->lo[1] + (row + ring + 1) * grid->cell;
+        double x_end = grid->lo[0] + grid->cols * grid->cell;
+        double y_end = grid->lo[1] + grid->rows * grid->cell;
+        double edge = INFINITY;
+        if (col - ring > 0) {
+            edge = fmin(edge, box_dist(key, grid->lo[0], left, grid->lo[1],
+                                       y_end));
+        }
+        if (col + ring + 1 < grid->cols) {
+            edge = fmin(edge, box_dist(key, right, x_end, grid->lo[1],
+                                       y_end));
+        }
+        if (row - ring > 0) {
+            edge = fmin(edge, box_dist(key, grid->lo[0], x_end, grid->lo[1],
+                                       bottom));
+        }
+        if (row + ring + 1 < grid->rows) {
+            edge = fmin(edge, box_dist(key, grid->lo[0], x_end, top, y_end));
+        }
+        if (nearest_node != NULL && edge >= nearest_dist) {
+            break;
+        }
+    }
+
+    return nearest_node;
+}
+
+/* Check every location of the cells overlapping the bounding square of
+    the circle */
+static int
+grid_radius(void *index, query_t *query, double radius, report_t report,
+            void *arg) {
+    grid_t *grid = index;
+    double *key = query->coordinates;
+    int num_cmp = 0;
+
+    for (int r = grid_row(grid, key[1] - radius);
+         r <= grid_row(grid, key[1] + radius); r++) {
+        for (int c = grid_col(grid, key[0] - radius);
+             c <= grid_col(grid, key[0] + radius); c++) {
+            int cell = r * grid->cols + c;
+            for (int i = grid->start[cell]; i < grid->start[cell + 1]; i++) {
+                double dist;
+                num_cmp++;
+                if (entry_matches(&grid->entries[i], query, radius, &dist)) {
+                    report(grid->entries[i].node, dist, arg);
+                }
+            }
+        }
+    }
+
+    return num_cmp;
+}
+
+/* Check every location of the cells overlapping the rectangle */
+static int
+grid_range(void *index, query_t *query, double *lo, double *hi,
+           report_t report, void *arg) {
+    grid_t *grid = index;
+    int num_cmp = 0;
+
+    for (int r = grid_row(grid, lo[1]); r <= grid_row(grid, hi[1]); r++) {
+        for (int c = grid_col(grid, lo[0]); c <= grid_col(grid, hi[0]); c++) {
+            int cell = r * grid->cols + c;
+            for (int i = grid->start[cell]; i < grid->start[cell + 1]; i++) {
+                entry_t *entry = &grid->entries[i];
+                double *point = entry->coordinates;
+                double dist;
+                num_cmp++;
+                if (point[0] >= lo[0] && point[0] <= hi[0] &&
+                    point[1] >= lo[1] && point[1] <= hi[1] &&
+                    entry_matches(entry, query, INFINITY, &dist)) {
+                    report(entry->node, dist, arg);
+                }
+            }
+        }
+    }
+
+    return num_cmp;
+}
+
+static size_t
+grid_memory(void *index) {
+    grid_t *grid = index;
+    return sizeof(grid_t) + sizeof(entry_t) * grid->num_entries +
+           sizeof(int) * ((size_t) grid->cols * grid->rows + 1);
+}
+
+static size_t
+grid_estimate(int num_locations, const double *lo, const double *hi) {
+    double cell;
+    int cols, rows;
+    grid_shape(num_locations, lo, hi, &cell, &cols, &rows);
+    return sizeof(grid_t) + sizeof(entry_t) * num_locations +
+           sizeof(int) * ((size_t) cols * rows + 1);
+}
+
+static void
+grid_free(void *index) {
+    grid_t *grid = index;
+    free(grid->entries);
+    free(grid->start);
+    free(grid);
+}
@@ -17,78 +17,260 @@ tree_t
     
 	/* Initialize tree to empty */
 	tree->root = NULL;
+    tree->strings = NULL;
     
 	return tree;
 }
 
-static node_t *recursive_insert(node_t *root, node_t *new, unsigned depth);
+static node_t *recursive_insert(node_t *root, record_t *record,
+                                unsigned depth);
+static void push_record(group_t *group, record_t *record);
+static void recursive_order_groups(node_t *root);
+static void extend_summary(summary_t *summary, const double *coordinates,
+                           int num_records);
 
-/* Recursively insert node to the left or right child of the current node */
+/* Recursively insert record to the left or right child of the current
+    node */
 static node_t
-*recursive_insert(node_t *root, node_t *new, unsigned depth) {
-	/* If position is empty insert here */
+*recursive_insert(node_t *root, record_t *record, unsigned depth) {
+	/* If position is empty make a new node for the location here */
     if (root == NULL) {
+        node_t *new = malloc(sizeof(*new));
+        assert(new != NULL);
+        new->group.records = NULL;
+        new->group.num_records = new->group.capacity = 0;
+        new->left = new->rght = NULL;
+        push_record(&new->group, record);
+        summarise_node(new);
 		return new;
 	}
     
-    record_t *root_data = (root->data)->data;
-    record_t *new_data = (new->data)->data;
+    /* The record ends up somewhere in this subtree */
+    extend_summary(&root->summary, record->coordinates, 1);
+
+    record_t *root_data = root->group.records;
     /* Level indicates the dimension to compare based on the current
         depth of the node */
     unsigned level = depth % DIMENSION;
     /* Compares the position of the coordinates and the key coordinates
         based on the level of the node in the tree */
-    double dim_dist = (new_data->coordinates)[level] - 
+    double dim_dist = (record->coordinates)[level] - 
                         (root_data->coordinates)[level];
     
     if (dim_dist < 0) {
         /* Current node is less than root node based on the current level 
             so insert to left child of root node */
-        root->left = recursive_insert(root->left, new, depth + 1);
+        root->left = recursive_insert(root->left, record, depth + 1);
         
     } else if (dim_dist > 0) {
         /* Otherwise insert to right child of root node */
-        root->rght = recursive_insert(root->rght, new, depth + 1);
+        root->rght = recursive_insert(root->rght, record, depth + 1);
     
+    } else if (same_point(record->coordinates, root_data->coordinates)) {
+        /* If every other coordinate is the same as well, it is a 
+            duplicate coordinate. Add it to the records of the node */
+        push_record(&root->group, record);
+
     } else {
-        /* If the other coordinate is the same, it is a duplicate 
-            coordinate */
-        if (((new_data->coordinates)[1 - level] - 
-              (root_data->coordinates)[1 - level]) < EPSILON) {
-            
-            /* Insert duplicate coordinate as linkedlist (as stack) */
-            linknode_t *tmp = root->data;
-            (new->data)->next = tmp;
-            root->data = new->data;
-            /* The new KD node created is no longer needed since the new 
-                node is being inserted as linked list node, so free it */
-            free(new);
-
-        } else {
-            /* Otherwise by convention insert to the right child of 
-                root node */
-            root->rght = recursive_insert(root->rght, new, depth + 1);
-        }
+        /* Otherwise by convention insert to the right child of 
+            root node */
+        root->rght = recursive_insert(root->rght, record, depth + 1);
     }
     
 	return root;
 }
 
-/* Returns a pointer to an altered tree that now includes
-   the object "value" in its correct location. */
+/* Copy the record to the end of the group. Records stay in the order
+    they were inserted until order_groups puts the latest first */
+static void
+push_record(group_t *group, record_t *record) {
+    if (group->num_records == group->capacity) {
+        group->capacity = group->capacity ? 2 * group->capacity : 1;
+        group->records = realloc(group->records,
+                                 sizeof(record_t) * group->capacity);
+        assert(group->records != NULL);
+    }
+    group->records[group->num_records++] = *record;
+}
+
+/* Compute the summary of a node from its own records and the summaries of
+    its children */
+void
+summarise_node(node_t *node) {
+    double *coordinates = node->group.records->coordinates;
+    node->summary.num_records = node->group.num_records;
+    memcpy(node->summary.lo, coordinates, sizeof(node->summary.lo));
+    memcpy(node->summary.hi, coordinates, sizeof(node->summary.hi));
+
+    node_t *children[2] = {node->left, node->rght};
+    for (int c = 0; c < 2; c++) {
+        if (children[c] != NULL) {
+            extend_summary(&node->summary, children[c]->summary.lo, 0);
+            extend_summary(&node->summary, children[c]->summary.hi,
+                           children[c]->summary.num_records);
+        }
+    }
+}
+
+/* Grow the box of a summary to cover the point, adding its records */
+static void
+extend_summary(summary_t *summary, const double *coordinates,
+               int num_records) {
+    for (int d = 0; d < DIMENSION; d++) {
+        if (coordinates[d] < summary->lo[d]) {
+            summary->lo[d] = coordinates[d];
+        }
+        if (coordinates[d] > summary->hi[d]) {
+            summary->hi[d] = coordinates[d];
+        }
+    }
+    summary->num_records += num_records;
+}
+
+/* Returns a pointer to an altered tree that now includes a copy of the
+   record in its correct location. The strings of the record are owned by
+   the tree from then on. Once every record is inserted, order_groups must
+   be called before the tree is searched */
 tree_t
-*insert_in_order(tree_t *tree, linknode_t *value) {
-	node_t *new;
-	/* make the new node */
-	new = malloc(sizeof(*new));
-	assert(tree != NULL && new != NULL);
-    
-    /* Record information into the node */
-	new->data = value;
-	new->left = new->rght = NULL;
+*insert_in_order(tree_t *tree, record_t *record) {
+	assert(tree != NULL);
     
-	/* and insert it into the tree */
-	tree->root = recursive_insert(tree->root, new, 0);
+	/* Insert it into the tree */
+	tree->root = recursive_insert(tree->root, record, 0);
     
 	return tree;
 }
+
+
+static void recursive_compact_tree(node_t *root);
+
+/* Reverse the records of every group, so that the latest record inserted
+    at a location comes first as in the stack of duplicates read before
+    it. Inserting at the front instead would move the whole group for every
+    record of a busy location */
+void
+order_groups(tree_t *tree) {
+    assert(tree != NULL);
+    recursive_order_groups(tree->root);
+}
+
+static void
+recursive_order_groups(node_t *root) {
+    if (root) {
+        recursive_order_groups(root->left);
+        recursive_order_groups(root->rght);
+        record_t *records = root->group.records;
+        for (int i = 0, j = root->group.num_records - 1; i < j; i++, j--) {
+            record_t record = records[i];
+            records[i] = records[j];
+            records[j] = record;
+        }
+    }
+}
+static void recursive_measure_tree(node_t *root, int shared,
+                                   memory_t *memory);
+
+/* Shrink the records of every group to the number it holds, and stop
+    looking up shared strings, since nothing is added once the tree is
+    loaded */
+void
+compact_tree(tree_t *tree) {
+    assert(tree != NULL);
+    recursive_compact_tree(tree->root);
+    if (tree->strings != NULL) {
+        seal_strings(tree->strings);
+    }
+}
+
+static void
+recursive_compact_tree(node_t *root) {
+    if (root) {
+        recursive_compact_tree(root->left);
+        recursive_compact_tree(root->rght);
+        if (root->group.capacity > root->group.num_records) {
+            root->group.records = realloc(root->group.records,
+                                          sizeof(record_t) *
+                                          root->group.num_records);
+            assert(root->group.records != NULL);
+            root->group.capacity = root->group.num_records;
+        }
+    }
+}
+
+/* Count the bytes held by the tree and every record stored in it. Shared
+    strings are counted once from their table */
+void
+measure_tree(tree_t *tree, memory_t *memory) {
+    assert(tree != NULL);
+    memset(memory, 0, sizeof(*memory));
+    memory->nodes = sizeof(tree_t);
+    recursive_measure_tree(tree->root, tree->strings != NULL, memory);
+    if (tree->strings != NULL) {
+        measure_strings(tree->strings, memory);
+    }
+}
+
+static void
+recursive_measure_tree(node_t *root, int shared, memory_t *memory) {
+    if (root) {
+        recursive_measure_tree(root->left, shared, memory);
+        recursive_measure_tree(root->rght, shared, memory);
+
+        group_t *group = &root->group;
+        memory->nodes += sizeof(node_t);
+        memory->num_nodes++;
+        memory->records += sizeof(record_t) * group->num_records;
+        memory->slack += sizeof(record_t) *
+                         (group->capacity - group->num_records);
+        memory->num_records += group->num_records;
+        if (!shared) {
+            for (int i = 0; i < group->num_records; i++) {
+                measure_fields(&group->records[i], memory);
+            }
+        }
+    }
+}
+
+/* Bytes held by every component together */
+size_t
+memory_total(const memory_t *memory) {
+    return memory->nodes + memory->records + memory->slack +
+           memory->strings + memory->string_table + memory->index;
+}
+
+static void recursive_free_tree(node_t *root, int shared);
+
+/* Recursively free all allocated memory along with each node in 
+    the KD Tree */
+static void
+recursive_free_tree(node_t *root, int shared) {
+	if (root) {
+		recursive_free_tree(root->left, shared);
+		recursive_free_tree(root->rght, shared);
+        
+        /* Free allocated memory used for each record at the location,
+            then the records themselves. Shared strings belong to the
+            table of the tree */
+        for (int i = 0; i < root->group.num_records; i++) {
+            if (shared) {
+                free(root->group.records[i].rendered);
+            } else {
+                free_fields(&root->group.records[i]);
+            }
+        }
+        free(root->group.records);
+        
+        free(root);
+	}
+}
+
+/* Release the tree along with every node and record stored in it */
+void
+free_tree(tree_t *tree) {
+	assert(tree != NULL);
+	recursive_free_tree(tree->root, tree->strings != NULL);
+    if (tree->strings != NULL) {
+        free_strings(tree->strings);
+    }
+	free(tree);
+}
@@ -8,31 +8,105 @@
 #include <string.h>
 
 #define EPSILON 0.0000001
+
+/* Number of axes of the tree, fixed at compile time (make DIMENSION=3).
+    The first METRIC_DIMENSION axes are the x and y coordinates used for
+    distances, any further axes are attributes searched by range */
+#ifndef DIMENSION
 #define DIMENSION 2
+#endif
+#define METRIC_DIMENSION 2
+#define YEAR_AXIS 2                   /* census year when DIMENSION >= 3 */
 
-typedef struct lnode linknode_t;  /* node of linkedlist */
+#if DIMENSION < METRIC_DIMENSION
+#error "DIMENSION must be at least 2"
+#endif
 
-struct lnode {
-    void* data;                   /* ptr to the record data */
-    linknode_t *next;             /* ptr to the next node in the linked
-                                     list */
-};
+typedef struct record record_t;   /* record of the dataset, defined by
+                                     the csv parser */
+typedef struct strings strings_t; /* table of shared strings, defined by
+                                     the csv parser */
+
+/* Layouts of a loaded tree, from the fastest to build to the smallest */
+#define LAYOUT_PLAIN 0            /* every record owns its strings */
+#define LAYOUT_COMPACT 1          /* records share equal strings and the
+                                     record arrays are trimmed to size */
+#define NUM_LAYOUTS 2
+
+/* Records sharing every coordinate, stored contiguously with the latest
+    record first so that emitting a location is a linear scan */
+typedef struct {
+    record_t *records;            /* array of num_records records */
+    int num_records;
+    int capacity;                 /* records the array has room for */
+} group_t;
+
+/* Records of a subtree and the box bounding their locations on every
+    axis, so that a search can take or skip the subtree as a whole */
+typedef struct {
+    int num_records;
+    double lo[DIMENSION];
+    double hi[DIMENSION];
+} summary_t;
 
 typedef struct node node_t;       /* node of kdtree */
 
 struct node {
-    linknode_t *data;             /* ptr to stored structure */
+    group_t group;                /* records at the location of the node */
+    summary_t summary;            /* of the subtree rooted at the node */
 	node_t *left;                 /* left subtree of node */
 	node_t *rght;                 /* right subtree of node */
 };
 
 typedef struct {
 	node_t *root;                 /* root node of the tree */
+    strings_t *strings;           /* strings shared by the records, or NULL
+                                     if every record owns its own */
 } tree_t;
 
+/* Bytes held by a tree, by component, as requested from malloc */
+typedef struct {
+    size_t nodes;                 /* the tree and its nodes */
+    size_t records;               /* records stored in the groups */
+    size_t slack;                 /* room left unused in the groups */
+    size_t strings;               /* text of the fields */
+    size_t string_table;          /* table of the shared strings */
+    size_t index;                 /* spatial index built beside the tree */
+    long num_nodes;
+    long num_records;
+    long num_strings;             /* separate strings held */
+} memory_t;
+
+/* Check if two points share every coordinate. Equality is exact, as the
+    tree splits on exact comparisons: a tolerance would only merge the
+    points that happen to meet on the way down, so the same records could
+    group differently depending on the order and the way they are built.
+    Every build (and the memory survey) groups records by this rule */
+static inline int
+same_point(const double *a, const double *b) {
+#if DIMENSION == 2
+    return a[0] == b[0] && a[1] == b[1];
+#elif DIMENSION == 3
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+#else
+    for (int d = 0; d < DIMENSION; d++) {
+        if (a[d] != b[d]) {
+            return 0;
+        }
+    }
+    return 1;
+#endif
+}
+
 /* prototypes for the functions in this library */
 tree_t *make_empty_tree(void);
-tree_t *insert_in_order(tree_t *tree, linknode_t *value);
+tree_t *insert_in_order(tree_t *tree, record_t *record);
+void order_groups(tree_t *tree);
 void traverse_tree(tree_t *tree, void action(void*));
+void summarise_node(node_t *node);
+void compact_tree(tree_t *tree);
+void measure_tree(tree_t *tree, memory_t *memory);
+size_t memory_total(const memory_t *memory);
+void free_tree(tree_t *tree);
 
 #endif /* kdtree_h */
\ No newline at end of file
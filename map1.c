@@ -6,31 +6,73 @@
 *    Date: 18 September 2020                                                 *
 ******************************************************************************/
 
+#include <unistd.h>
 #include "csvparser.h"
 #include "kdtree.h"
 #include "search.h"
+#include "reload.h"
+#include "engine.h"
+#include "pipeline.h"
+#include "shard.h"
+#include "disktree.h"
 
 /* Function prototypes */
-void free_all(tree_t *tree, char *buffer);
-void recursive_free_tree(node_t *root);
+void describe(char *detail, result_set_t *set, int approx_mode);
+void pipeline_nearest(dataset_t *data, slot_t *slot, void *engine);
 
 /* Create a dictionary based on KD tree to store information read from
  * the csv file and print the information based on the key input by the user
  * into an output file specified by the user.
  *
  * To run the program type:
- * ./map1 <csv_filename> <output_filename> < <keyfile_name> 
+ * ./map1 <csv_filename> <output_filename> [options] < <keyfile_name> 
  * 
  *      <csv_filename> arg     - Dataset file
  *      <output_filename> arg  - Output file to record search results
  *      <keyfile_name> arg     - File of keys to be searched (one 
  *                               coordinates key per line) 
+ *
+ *      Options:
+ *      -e <epsilon>           - Accept a point within (1 + epsilon) of the
+ *                               true nearest distance
+ *      -b <budget>            - Visit at most <budget> nodes per search
+ *      -f <format>            - Output format: text (default), csv,
+ *                               jsonl or binary
+ *      -B [threads]           - Build a balanced tree from the medians
+ *                               of the locations, using <threads>
+ *                               workers (default: every core)
+ *      -i <index>             - Spatial index: kd (default), grid or
+ *                               rtree
+ *      -M                     - Measure distances in metres, projecting
+ *                               the locations around the centroid of the
+ *                               dataset once when it is loaded
+ *      -m [budget]            - Report the bytes held by the dataset
+ *                               and its index once loaded. With a
+ *                               budget, load it in its most compact
+ *                               layout, failing before building either
+ *                               if that takes more than <budget> bytes
+ *                               (which may end in K, M or G)
+ *      -D <index> [frames]    - Search the tree from the file <index>
+ *                               through a pool of <frames> blocks,
+ *                               writing it from <csv_filename> first if
+ *                               it is missing or older
+ *      -S <shards>            - Split the dataset into <shards> regions,
+ *                               each served by its own process, and
+ *                               route every key to the shards that can
+ *                               answer it
+ *      -p [workers]           - Stream the keys through a reader, <workers>
+ *                               search workers (default: every core) and
+ *                               a writer running at once
+ *      -w                     - Rebuild the dataset from <csv_filename>
+ *                               whenever the process receives SIGHUP,
+ *                               without stopping the search
  */
 int main(int argc, const char * argv[]) {
     const char *filename = NULL;
     const char *outputfile = NULL;
-    tree_t *tree;
-    char *buffer;
+    engine_t *engine = NULL;
+    cluster_t *cluster = NULL;
+    disk_tree_t *disk = NULL;
     
     /* Checks if filenames are given */
     if (!argv[1]) {
@@ -46,78 +88,203 @@ int main(int argc, const char * argv[]) {
     filename = argv[1];
     outputfile = argv[2];
     
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        fprintf(stderr, "Error opening file '%s'\n", filename);
+    /* Approximate search is only used if requested */
+    engine_opts_t opts = {NULL, 0, -1, {0}, 0, NULL};
+    int format = FORMAT_TEXT;
+    int watch = 0;
+    /* Search workers of the pipeline, or 0 to search keys one by one */
+    int num_workers = 0;
+    /* Shard processes, or 0 to search the dataset in this process */
+    int num_shards = 0;
+    /* File of the disk tree, or NULL to search the tree in memory */
+    const char *disk_file = NULL;
+    int num_frames = DISK_FRAMES;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0) {
+            watch = 1;
+        } else if (strcmp(argv[i], "-B") == 0) {
+            opts.build_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                opts.build_threads = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-p") == 0) {
+            num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                num_workers = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-M") == 0) {
+            opts.metric = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            opts.budget = UNLIMITED;
+            if (i + 1 < argc && argv[i + 1][0] != '-' &&
+                (opts.budget = parse_budget(argv[++i])) == 0) {
+                fprintf(stderr, "Invalid memory budget '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+            disk_file = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                num_frames = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            num_shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            if ((opts.backend = find_backend(argv[++i])) == NULL) {
+                fprintf(stderr, "Unknown index '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            opts.approx.epsilon = atof(argv[++i]);
+            opts.approx_mode = 1;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            opts.approx.node_budget = atoi(argv[++i]);
+            opts.approx_mode = 1;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            if ((format = parse_format(argv[++i])) < 0) {
+                fprintf(stderr, "Unknown output format '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if (opts.approx_mode && opts.backend != NULL &&
+        opts.backend != &kd_backend) {
+        fprintf(stderr, "Approximate search needs the kd index\n");
         return EXIT_FAILURE;
     }
     
-    tree = make_empty_tree();
-    assert(tree != NULL);
+    if (num_shards > 0 && (num_workers > 0 || watch)) {
+        fprintf(stderr, "Shards cannot be combined with -p or -w\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.metric && (num_shards > 0 || disk_file != NULL)) {
+        fprintf(stderr, "Metres cannot be combined with -S or -D\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.budget > 0 && (num_shards > 0 || disk_file != NULL)) {
+        fprintf(stderr, "The memory budget cannot be combined with -S or "
+                        "-D\n");
+        return EXIT_FAILURE;
+    }
+    if (disk_file != NULL && (opts.backend != NULL || opts.approx_mode ||
+                              num_shards > 0 || num_workers > 0 || watch)) {
+        fprintf(stderr, "The disk tree cannot be combined with -i, -e, -b, "
+                        "-S, -p or -w\n");
+        return EXIT_FAILURE;
+    }
+    
+    /* Read and store information into the KD Tree, into the trees of the
+        shards or into the file of the disk tree */
+    if (disk_file != NULL) {
+        disk = prepare_disk_tree(filename, disk_file, num_frames, &opts);
+    } else if (num_shards > 0) {
+        cluster = start_cluster(filename, num_shards, &opts);
+    } else {
+        engine = open_engine(filename, &opts);
+    }
+    if (watch) {
+        watch_engine(engine);
+    }
+    
+    output_t *out = open_output(outputfile, format);
     
-    /* Read and store information into the KD Tree */
-    buffer = read_and_parse(fp, tree);
+    if (num_workers > 0) {
+        pipeline_t *pipeline = make_pipeline(engine->reloader, out,
+                                             num_workers, 0,
+                                             pipeline_nearest, engine);
+        run_pipeline(pipeline, STDIN_FILENO);
+        print_pipeline_stats(pipeline, stderr);
+        free_pipeline(pipeline);
+        
+        close_output(out);
+        close_engine(engine);
+        return 0;
+    }
     
     /* Search the nearest point to the input coordinate from the 
         dictionary and print them into the outputfile */
     char *key = NULL;
-    int num_cmp;
-    while ((num_cmp = search_coordinate(tree, outputfile, &key)) != 0) {
-        /* Print the number of comparison required for each search */
-        printf("%s --> %d\n", key, num_cmp);
+    char detail[DETAIL_CHARS];
+    query_t *query;
+    result_set_t set;
+    init_result_set(&set, NULL, 0);
+    while ((query = get_coordinate(&key)) != NULL) {
+        /* Pages read from the file of the disk tree for the key */
+        long num_pages = 0;
+        if (disk != NULL) {
+            num_pages = disk->pool.pages_read;
+            while (disk_nearest(disk, query, &set) > set.capacity) {
+                grow_result_set(&set);
+            }
+            append_results(out, key, &set);
+            num_pages = disk->pool.pages_read - num_pages;
+        } else if (cluster != NULL) {
+            while (cluster_nearest(cluster, query, &set) > set.capacity) {
+                grow_result_set(&set);
+            }
+            append_results(out, key, &set);
+        } else {
+            /* The dataset may be replaced between keys but never during a
+                search */
+            dataset_t *data = engine_enter(engine, 0);
+            while (search_nearest(engine, data, query, &set) >
+                   set.capacity) {
+                grow_result_set(&set);
+            }
+            append_results(out, key, &set);
+            engine_exit(engine, 0);
+        }
+        end_query(out);
+        
+        describe(detail, &set, opts.approx_mode);
+        if (disk != NULL) {
+            printf("%s --> %s (%ld pages read)\n", key, detail, num_pages);
+        } else {
+            printf("%s --> %s\n", key, detail);
+        }
+        free(query);
         free(key);
     }
     
-    
-    free_all(tree, buffer);
-    fclose(fp);
+    free(set.results);
+    close_output(out);
+    if (disk != NULL) {
+        print_pool_stats(disk, stderr);
+        close_disk_tree(disk);
+    } else if (cluster != NULL) {
+        stop_cluster(cluster);
+    } else {
+        close_engine(engine);
+    }
     
     return 0;
 }
 
-/* Recursively free all allocated memory along with each node in 
-    the KD Tree */
+/* Describe the number of comparison required for a search, and whether
+    the answer is exact when approximating */
 void
-recursive_free_tree(node_t *root) {
-	if (root) {
-		recursive_free_tree(root->left);
-		recursive_free_tree(root->rght);
-        
-       /* Traverse the linked list in each node and free each linked list
-           node along with its data */
-		linknode_t *curr = root->data;
-        linknode_t *prev;
-        while (curr != NULL) {
-            prev = curr;
-            curr = curr->next;
-            
-            /* Free allocated memory used for records in the data */
-            char *trade_name = ((record_t*)prev->data)->trade_name;
-            free(trade_name);
-            char *city_area_name = ((record_t*)prev->data)->city_area_name;
-            free(city_area_name);
-            char *location = ((record_t*)prev->data)->location;
-            free(location);
-            char *industry_desc = ((record_t*)prev->data)->industry_desc;
-            free(industry_desc);
-       
-            free(prev->data);
-            free(prev);
-        }
-        
-        free(root);
-	}
-
+describe(char *detail, result_set_t *set, int approx_mode) {
+    if (approx_mode) {
+        snprintf(detail, DETAIL_CHARS, "%d (%s)", set->num_cmp,
+                 set->exact ? "exact" : "approximate");
+    } else {
+        snprintf(detail, DETAIL_CHARS, "%d", set->num_cmp);
+    }
 }
 
-/* Release all memory allocated in the tree structure and the
-    buffer */
+/* Find the nearest point to the key of a pipeline slot */
 void
-free_all(tree_t *tree, char *buffer) {
-	assert(tree != NULL);
-    
-	recursive_free_tree(tree->root);
-	free(tree);
-	free(buffer);
+pipeline_nearest(dataset_t *data, slot_t *slot, void *engine) {
+    engine_t *nearest_engine = engine;
+    char detail[DETAIL_CHARS];
     
+    while (search_nearest(nearest_engine, data, &slot->query,
+                          &slot->results) > slot->results.capacity) {
+        grow_result_set(&slot->results);
+    }
+    describe(detail, &slot->results, nearest_engine->opts.approx_mode);
+    snprintf(slot->summary, SUMMARY_CHARS, "%s --> %s\n", slot->key, detail);
 }
@@ -6,32 +6,95 @@
 *    Date: 18 September 2020                                                 *
 ******************************************************************************/
 
+#include <unistd.h>
 #include "csvparser.h"
 #include "kdtree.h"
 #include "search.h"
+#include "planner.h"
+#include "reload.h"
+#include "engine.h"
+#include "pipeline.h"
+#include "shard.h"
+#include "disktree.h"
 
 /* Function prototypes */
-void free_all(tree_t *tree, char *buffer);
-void recursive_free_tree(node_t *root);
+void describe(char *detail, result_set_t *set, int planning);
+void pipeline_radius(dataset_t *data, slot_t *slot, void *engine);
+void search_densities(engine_t *engine, output_t *out, int by_industry);
+void search_polygons(engine_t *engine, output_t *out);
+void search_pages(engine_t *engine, output_t *out, int offset, int limit);
 
 /* Create a dictionary based on KD tree to store information read from
  * the csv file and print the information based on the key input by the user
  * into an output file specified by the user.
  *
  * To run the program type:
- * ./map2 <csv_filename> <output_filename> < <keyfile_name> 
+ * ./map2 <csv_filename> <output_filename> [options] < <keyfile_name> 
  * 
  *      <csv_filename> arg     - Dataset file
  *      <output_filename> arg  - Output file to record search results
  *      <keyfile_name> arg     - File of keys to be searched (one 
  *                               coordinates-radius key separated by <space> 
  *                               per line) 
+ *
+ *      Options:
+ *      -f <format>            - Output format: text (default), csv,
+ *                               jsonl or binary
+ *      -a [threshold]         - Choose between the tree and a linear scan
+ *                               for each key, scanning when the key is
+ *                               expected to reach at least <threshold> of
+ *                               all locations
+ *      -B [threads]           - Build a balanced tree from the medians
+ *                               of the locations, using <threads>
+ *                               workers (default: every core)
+ *      -i <index>             - Spatial index: kd (default), grid or
+ *                               rtree
+ *      -g [industry]          - Read density keys instead: the corners of
+ *                               a box and the columns and rows of a grid
+ *                               over it, writing the number of records in
+ *                               each cell (and of each industry if
+ *                               "industry" is given)
+ *      -P                     - Read polygon keys instead: the x and y
+ *                               of each vertex in order, writing every
+ *                               record inside the polygon
+ *      -l <limit> [offset]    - Write the records of each key in order
+ *                               of distance, <limit> at a time after
+ *                               skipping <offset> of them. A key may end
+ *                               with "@ <dist> <id>" to continue after
+ *                               the cursor printed for the page before,
+ *                               where no records are skipped
+ *      -M                     - Measure distances in metres, projecting
+ *                               the locations around the centroid of the
+ *                               dataset once when it is loaded. Keys
+ *                               stay in degrees but radii are read in
+ *                               metres
+ *      -m [budget]            - Report the bytes held by the dataset
+ *                               and its index once loaded. With a
+ *                               budget, load it in its most compact
+ *                               layout, failing before building either
+ *                               if that takes more than <budget> bytes
+ *                               (which may end in K, M or G)
+ *      -D <index> [frames]    - Search the tree from the file <index>
+ *                               through a pool of <frames> blocks,
+ *                               writing it from <csv_filename> first if
+ *                               it is missing or older
+ *      -S <shards>            - Split the dataset into <shards> regions,
+ *                               each served by its own process, and
+ *                               route every key to the shards that can
+ *                               answer it
+ *      -p [workers]           - Stream the keys through a reader, <workers>
+ *                               search workers (default: every core) and
+ *                               a writer running at once
+ *      -w                     - Rebuild the dataset from <csv_filename>
+ *                               whenever the process receives SIGHUP,
+ *                               without stopping the search
  */
 int main(int argc, const char * argv[]) {
     const char *filename = NULL;
     const char *outputfile = NULL;
-    tree_t *tree;
-    char *buffer;
+    engine_t *engine = NULL;
+    cluster_t *cluster = NULL;
+    disk_tree_t *disk = NULL;
     
     /* Checks if filenames are given */
     if (!argv[1]) {
@@ -47,76 +110,352 @@ int main(int argc, const char * argv[]) {
     filename = argv[1];
     outputfile = argv[2];
     
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        fprintf(stderr, "Error opening file '%s'\n", filename);
+    /* The query planner is only used if requested */
+    engine_opts_t opts = {NULL, 0, -1, {0}, 0, NULL};
+    int format = FORMAT_TEXT;
+    int watch = 0;
+    /* Search workers of the pipeline, or 0 to search keys one by one */
+    int num_workers = 0;
+    /* Shard processes, or 0 to search the dataset in this process */
+    int num_shards = 0;
+    /* File of the disk tree, or NULL to search the tree in memory */
+    const char *disk_file = NULL;
+    int num_frames = DISK_FRAMES;
+    /* Set for density keys, 2 to count each industry as well */
+    int density_mode = 0;
+    /* Set for polygon keys */
+    int polygon_mode = 0;
+    /* Records per page of distance-ordered results, or 0 for every record
+        in tree order */
+    int page_limit = 0, page_offset = 0;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0) {
+            watch = 1;
+        } else if (strcmp(argv[i], "-B") == 0) {
+            opts.build_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                opts.build_threads = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-p") == 0) {
+            num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                num_workers = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-g") == 0) {
+            density_mode = 1;
+            if (i + 1 < argc && strcmp(argv[i + 1], "industry") == 0) {
+                density_mode = 2;
+                i++;
+            }
+        } else if (strcmp(argv[i], "-P") == 0) {
+            polygon_mode = 1;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            page_limit = atoi(argv[++i]);
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                page_offset = atoi(argv[++i]);
+            }
+            if (page_limit < 1 || page_offset < 0) {
+                fprintf(stderr, "Invalid page limit or offset\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-M") == 0) {
+            opts.metric = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            opts.budget = UNLIMITED;
+            if (i + 1 < argc && argv[i + 1][0] != '-' &&
+                (opts.budget = parse_budget(argv[++i])) == 0) {
+                fprintf(stderr, "Invalid memory budget '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+            disk_file = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                num_frames = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            num_shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            if ((opts.backend = find_backend(argv[++i])) == NULL) {
+                fprintf(stderr, "Unknown index '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-a") == 0) {
+            opts.threshold = SCAN_THRESHOLD;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                opts.threshold = atof(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            if ((format = parse_format(argv[++i])) < 0) {
+                fprintf(stderr, "Unknown output format '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if (num_shards > 0 && (num_workers > 0 || watch)) {
+        fprintf(stderr, "Shards cannot be combined with -p or -w\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.metric && (num_shards > 0 || disk_file != NULL)) {
+        fprintf(stderr, "Metres cannot be combined with -S or -D\n");
+        return EXIT_FAILURE;
+    }
+    if (opts.budget > 0 && (num_shards > 0 || disk_file != NULL)) {
+        fprintf(stderr, "The memory budget cannot be combined with -S or "
+                        "-D\n");
+        return EXIT_FAILURE;
+    }
+    if (disk_file != NULL && (opts.backend != NULL || opts.threshold >= 0 ||
+                              density_mode || polygon_mode ||
+                              page_limit > 0 || num_shards > 0 ||
+                              num_workers > 0 || watch)) {
+        fprintf(stderr, "The disk tree cannot be combined with -i, -a, -g, "
+                        "-P, -l, -S, -p or -w\n");
+        return EXIT_FAILURE;
+    }
+    if (density_mode && (num_workers > 0 || num_shards > 0)) {
+        fprintf(stderr, "Density keys cannot be combined with -p or -S\n");
+        return EXIT_FAILURE;
+    }
+    if (polygon_mode && (density_mode || num_workers > 0 || num_shards > 0)) {
+        fprintf(stderr, "Polygon keys cannot be combined with -g, -p or "
+                        "-S\n");
+        return EXIT_FAILURE;
+    }
+    if (page_limit > 0 && (density_mode || polygon_mode || num_workers > 0 ||
+                           num_shards > 0)) {
+        fprintf(stderr, "Pages cannot be combined with -g, -P, -p or -S\n");
         return EXIT_FAILURE;
     }
     
-    tree = make_empty_tree();
-    assert(tree != NULL);
+    /* Read and store information into the KD Tree (or into the trees of
+        the shards, or into the file of the disk tree), along with the
+        query planner if requested */
+    if (disk_file != NULL) {
+        disk = prepare_disk_tree(filename, disk_file, num_frames, &opts);
+    } else if (num_shards > 0) {
+        cluster = start_cluster(filename, num_shards, &opts);
+    } else {
+        engine = open_engine(filename, &opts);
+    }
+    if (watch) {
+        watch_engine(engine);
+    }
+    
+    output_t *out = open_output(outputfile, format);
+    
+    if (density_mode) {
+        search_densities(engine, out, density_mode == 2);
+        
+        close_output(out);
+        close_engine(engine);
+        return 0;
+    }
+    
+    if (polygon_mode) {
+        search_polygons(engine, out);
+        
+        close_output(out);
+        close_engine(engine);
+        return 0;
+    }
     
-    /* Read and store information into the KD Tree */
-    buffer = read_and_parse(fp, tree);
+    if (page_limit > 0) {
+        search_pages(engine, out, page_offset, page_limit);
+        
+        close_output(out);
+        close_engine(engine);
+        return 0;
+    }
+    
+    if (num_workers > 0) {
+        pipeline_t *pipeline = make_pipeline(engine->reloader, out,
+                                             num_workers, 1,
+                                             pipeline_radius, engine);
+        run_pipeline(pipeline, STDIN_FILENO);
+        print_pipeline_stats(pipeline, stderr);
+        free_pipeline(pipeline);
+        
+        close_output(out);
+        close_engine(engine);
+        return 0;
+    }
     
     /* Search all points within the input radius of the input coordinates in
         the dictionary and print them into the outputfile */
     char *key = NULL;
-    int num_cmp;
-    while ((num_cmp = search_coordinate_radius(tree, outputfile, &key)) != 0) {
-        /* Print the number of comparison required for each search */
-        printf("%s --> %d\n", key, num_cmp);
+    char detail[DETAIL_CHARS];
+    query_t *query;
+    double radius;
+    result_set_t set;
+    init_result_set(&set, NULL, 0);
+    while ((query = get_coordinate_radius(&radius, &key)) != NULL) {
+        /* Pages read from the file of the disk tree for the key */
+        long num_pages = 0;
+        if (disk != NULL) {
+            num_pages = disk->pool.pages_read;
+            while (disk_radius(disk, query, radius, &set) > set.capacity) {
+                grow_result_set(&set);
+            }
+            append_results(out, key, &set);
+            num_pages = disk->pool.pages_read - num_pages;
+        } else if (cluster != NULL) {
+            while (cluster_radius(cluster, query, radius, &set) >
+                   set.capacity) {
+                grow_result_set(&set);
+            }
+            append_results(out, key, &set);
+        } else {
+            /* The dataset may be replaced between keys but never during a
+                search */
+            dataset_t *data = engine_enter(engine, 0);
+            while (search_radius(engine, data, query, radius, &set) >
+                   set.capacity) {
+                grow_result_set(&set);
+            }
+            append_results(out, key, &set);
+            engine_exit(engine, 0);
+        }
+        end_query(out);
+        
+        describe(detail, &set, opts.threshold >= 0);
+        if (disk != NULL) {
+            printf("%s --> %s (%ld pages read)\n", key, detail, num_pages);
+        } else {
+            printf("%s --> %s\n", key, detail);
+        }
+        free(query);
         free(key);
     }
 
-    free_all(tree, buffer);
-    fclose(fp);
+    free(set.results);
+    close_output(out);
+    if (disk != NULL) {
+        print_pool_stats(disk, stderr);
+        close_disk_tree(disk);
+    } else if (cluster != NULL) {
+        stop_cluster(cluster);
+    } else {
+        close_engine(engine);
+    }
     
     return 0;
 }
 
+/* Count the records in the grid of each density key, printing the number
+    of nodes visited for each key */
+void
+search_densities(engine_t *engine, output_t *out, int by_industry) {
+    char *key = NULL;
+    query_t *query;
+    density_t density;
+    init_density(&density, by_industry);
+    
+    while ((query = get_density_key(&density, &key)) != NULL) {
+        dataset_t *data = engine_enter(engine, 0);
+        int num_cmp = search_density(engine, data, query, &density);
+        engine_exit(engine, 0);
+        write_density(out, key, &density);
+        end_query(out);
+        
+        printf("%s --> %d\n", key, num_cmp);
+        free(query);
+        free(key);
+    }
+    
+    free_density(&density);
+}
+
+/* Find the records inside the polygon of each polygon key, printing the
+    number of nodes tested for each key */
+void
+search_polygons(engine_t *engine, output_t *out) {
+    char *key = NULL;
+    query_t *query;
+    polygon_t polygon;
+    init_polygon(&polygon);
+    result_set_t set;
+    init_result_set(&set, NULL, 0);
+    
+    while ((query = get_polygon(&polygon, &key)) != NULL) {
+        dataset_t *data = engine_enter(engine, 0);
+        while (search_polygon(engine, data, query, &polygon, &set) >
+               set.capacity) {
+            grow_result_set(&set);
+        }
+        append_results(out, key, &set);
+        engine_exit(engine, 0);
+        end_query(out);
+        
+        printf("%s --> %d\n", key, set.num_cmp);
+        free(query);
+        free(key);
+    }
+    
+    free(set.results);
+    free_polygon(&polygon);
+}
 
-/* Recursively free all allocated memory along with each node in 
-    the KD Tree */
+/* Write a page of the records within the radius of each key in order of
+    distance, printing the number of nodes visited for each key and the
+    cursor to continue from if records remain */
 void
-recursive_free_tree(node_t *root) {
-	if (root) {
-		recursive_free_tree(root->left);
-		recursive_free_tree(root->rght);
-		
-        /* Traverse the linked list in each node and free each linked list
-           node along with its data */
-        linknode_t *curr = root->data;
-        linknode_t *prev;
-        while (curr != NULL) {
-            prev = curr;
-            curr = curr->next;
-            
-            /* Free allocated memory used for records in the data */
-            char *trade_name = ((record_t*)prev->data)->trade_name;
-            free(trade_name);
-            char *city_area_name = ((record_t*)prev->data)->city_area_name;
-            free(city_area_name);
-            char *location = ((record_t*)prev->data)->location;
-            free(location);
-            char *industry_desc = ((record_t*)prev->data)->industry_desc;
-            free(industry_desc);
-       
-            free(prev->data);
-            free(prev);
+search_pages(engine_t *engine, output_t *out, int offset, int limit) {
+    char *key = NULL;
+    query_t *query;
+    double radius;
+    cursor_t cursor;
+    result_set_t set;
+    init_result_set(&set, NULL, 0);
+    
+    while ((query = get_page_key(&radius, &cursor, &key)) != NULL) {
+        dataset_t *data = engine_enter(engine, 0);
+        while (search_radius_page(engine, data, query, radius, offset, limit,
+                                  &cursor, &set) > set.capacity) {
+            grow_result_set(&set);
         }
+        append_results(out, key, &set);
+        engine_exit(engine, 0);
+        end_query(out);
         
-        free(root);
-	}
+        if (cursor.more) {
+            printf("%s --> %d, next @ %.17g %d\n", key, set.num_cmp,
+                   cursor.dist, cursor.id);
+        } else {
+            printf("%s --> %d\n", key, set.num_cmp);
+        }
+        free(query);
+        free(key);
+    }
+    
+    free(set.results);
+}
 
+/* Describe the number of comparison required for a search, and the plan
+    chosen when planning */
+void
+describe(char *detail, result_set_t *set, int planning) {
+    if (planning) {
+        snprintf(detail, DETAIL_CHARS, "%d (%s, estimate %d)", set->num_cmp,
+                 set->plan == PLAN_SCAN ? "scan" : "tree", set->estimate);
+    } else {
+        snprintf(detail, DETAIL_CHARS, "%d", set->num_cmp);
+    }
 }
 
-/* Release all memory allocated in the tree structure and the
-    buffer */
+/* Find the points within the radius of the key of a pipeline slot */
 void
-free_all(tree_t *tree, char *buffer) {
-	assert(tree != NULL);
-	recursive_free_tree(tree->root);
-    free(tree);
-    free(buffer);
+pipeline_radius(dataset_t *data, slot_t *slot, void *engine) {
+    engine_t *radius_engine = engine;
+    char detail[DETAIL_CHARS];
+    
+    while (search_radius(radius_engine, data, &slot->query, slot->radius,
+                         &slot->results) > slot->results.capacity) {
+        grow_result_set(&slot->results);
+    }
+    describe(detail, &slot->results, radius_engine->opts.threshold >= 0);
+    snprintf(slot->summary, SUMMARY_CHARS, "%s --> %s\n", slot->key, detail);
 }
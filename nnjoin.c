@@ -0,0 +1,131 @@
+/*****************************************************************************
+*    Melbourne Census Dataset Information Retrieval using a KD Tree          *
+*    (Find the nearest business of every business in one pass)               *
+*    Developed by: Oliver Ming Hui Tan                                       *
+******************************************************************************/
+
+#include <unistd.h>
+#include "csvparser.h"
+#include "kdtree.h"
+#include "dualtree.h"
+
+/* Function prototypes */
+tree_t *load_tree(const char *filename, char **buffer);
+
+/* Pair every record of the query dataset with its nearest record of the
+ * reference dataset (or of the query dataset itself) and write the pairs
+ * into an output file specified by the user.
+ *
+ * To run the program type:
+ * ./nnjoin <csv_filename> <output_filename> [options]
+ *
+ *      <csv_filename> arg     - Query dataset file
+ *      <output_filename> arg  - Output file to record the pairs
+ *
+ *      Options:
+ *      -r <csv_filename>      - Reference dataset (default: the query
+ *                               dataset, excluding each record itself)
+ *      -s                     - Only pair records of the same industry
+ *      -d                     - Only pair records of different industries
+ *      -x                     - Exclude records at the same location
+ *      -t <threads>           - Number of worker threads
+ *
+ * Each line of the output holds "<query id> <reference id> <distance>",
+ * where ids are record row numbers and -1 marks a record with no match.
+ */
+int main(int argc, const char * argv[]) {
+    const char *filename = NULL;
+    const char *outputfile = NULL;
+    const char *ref_filename = NULL;
+
+    /* Checks if filenames are given */
+    if (argc < 2) {
+        fprintf(stderr, "No file read.");
+        return EXIT_FAILURE;
+    }
+
+    if (argc < 3) {
+        fprintf(stderr, "Output file name not found.");
+        return EXIT_FAILURE;
+    }
+
+    filename = argv[1];
+    outputfile = argv[2];
+
+    join_opts_t opts = {0};
+    opts.match = MATCH_ANY;
+    opts.num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            ref_filename = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0) {
+            opts.match = MATCH_SAME_INDUSTRY;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            opts.match = MATCH_OTHER_INDUSTRY;
+        } else if (strcmp(argv[i], "-x") == 0) {
+            opts.exclude_colocated = 1;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            opts.num_threads = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Read the datasets and build a join tree over each of them */
+    char *buffer, *ref_buffer = NULL;
+    tree_t *tree = load_tree(filename, &buffer);
+    tree_t *ref_tree = NULL;
+    jtree_t *query = make_join_tree(tree);
+    jtree_t *ref = query;
+    if (ref_filename != NULL) {
+        ref_tree = load_tree(ref_filename, &ref_buffer);
+        ref = make_join_tree(ref_tree);
+    }
+
+    int num_pairs;
+    pair_t *pairs = nearest_join(query, ref, &opts, &num_pairs);
+
+    FILE *fp = fopen(outputfile, "w");
+    if (!fp) {
+        fprintf(stderr, "Error writing to file '%s'\n", outputfile);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_pairs; i++) {
+        fprintf(fp, "%d %d %.10lf\n", pairs[i].query_id, pairs[i].ref_id,
+                pairs[i].ref_id >= 0 ? pairs[i].dist : 0.0);
+    }
+    fclose(fp);
+
+    /* Print the amount of work required for the join */
+    printf("%d pairs --> %ld\n", num_pairs, opts.num_dist);
+
+    free(pairs);
+    if (ref != query) {
+        free_join_tree(ref);
+        free_tree(ref_tree);
+        free(ref_buffer);
+    }
+    free_join_tree(query);
+    free_tree(tree);
+    free(buffer);
+
+    return 0;
+}
+
+/* Read a dataset into a new KD tree */
+tree_t
+*load_tree(const char *filename, char **buffer) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening file '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    tree_t *tree = make_empty_tree();
+    assert(tree != NULL);
+    *buffer = read_and_parse(fp, tree);
+    fclose(fp);
+
+    return tree;
+}
@@ -0,0 +1,185 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the program that writes search results into the output file in    *
+* the format selected by the user. Each record is rendered once and the      *
+* rendered text is reused every time the record is found again              *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "output.h"
+
+static const char *format_names[NUM_FORMATS] = {
+    "text", "csv", "jsonl", "binary"
+};
+
+/* Open the output file for appending results in the given format */
+output_t
+*open_output(const char *outputfile, int format) {
+    output_t *out = (output_t *) malloc(sizeof(*out));
+    assert(out != NULL);
+
+    out->fp = fopen(outputfile, format == FORMAT_BINARY ? "ab" : "a");
+    if (!out->fp) {
+        fprintf(stderr, "Error appending to file '%s'\n", outputfile);
+        exit(EXIT_FAILURE);
+    }
+    out->format = format;
+    out->query_index = 0;
+
+    return out;
+}
+
+/* Flush and close the output file */
+void
+close_output(output_t *out) {
+    assert(out != NULL);
+    fclose(out->fp);
+    free(out);
+}
+
+/* Return the format with the given name, or -1 if there is none */
+int
+parse_format(const char *name) {
+    for (int i = 0; i < NUM_FORMATS; i++) {
+        if (strcmp(name, format_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Write a record found for the key into the output file */
+void
+write_record(output_t *out, const char *key, record_t *record) {
+    int len;
+
+    if (out->format == FORMAT_BINARY) {
+        write_int32(out, out->query_index);
+        write_int32(out, record->id);
+        return;
+    }
+
+    const char *rendered = render_record(record, out->format, &len);
+    if (out->format == FORMAT_JSONL) {
+        fputs("{\"key\":", out->fp);
+        write_json_string(out->fp, key);
+    } else {
+        fputs(key, out->fp);
+        fputs(out->format == FORMAT_CSV ? "," : " --> ", out->fp);
+    }
+    fwrite(rendered, 1, len, out->fp);
+}
+
+/* Write a search that found nothing into the output file */
+void
+write_notfound(output_t *out, const char *key) {
+    if (out->format == FORMAT_BINARY) {
+        write_int32(out, out->query_index);
+        write_int32(out, NOTFOUND_ID);
+
+    } else if (out->format == FORMAT_JSONL) {
+        fputs("{\"key\":", out->fp);
+        write_json_string(out->fp, key);
+        fputs(",\"found\":false}\n", out->fp);
+
+    } else if (out->format == FORMAT_CSV) {
+        fprintf(out->fp, "%s,%d\n", key, NOTFOUND_ID);
+
+    } else {
+        fprintf(out->fp, "%s --> NOTFOUND\n", key);
+    }
+}
+
+/* Write a value of the binary format, which is little-endian whatever
+    the byte order of the host */
+void
+write_int32(output_t *out, int32_t value) {
+    uint32_t bits = (uint32_t) value;
+    unsigned char bytes[4] = {bits & 0xff, (bits >> 8) & 0xff,
+                              (bits >> 16) & 0xff, (bits >> 24) & 0xff};
+    fwrite(bytes, sizeof(bytes), 1, out->fp);
+}
+
+/* Finish the results of a key, the text format separates keys with an
+    empty line */
+void
+end_query(output_t *out) {
+    if (out->format == FORMAT_TEXT) {
+        fputc('\n', out->fp);
+    }
+    out->query_index++;
+}
+
+/* Return the text of the record that follows the key in the given format,
+    rendering it the first time it is needed */
+const char
+*render_record(record_t *record, int format, int *len) {
+    if (record->rendered != NULL && record->rendered_format == format) {
+        *len = record->rendered_len;
+        return record->rendered;
+    }
+    free(record->rendered);
+
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&buffer, &size);
+    assert(fp != NULL);
+
+    if (format == FORMAT_CSV) {
+        fprintf(fp, "%d\n", record->id);
+
+    } else if (format == FORMAT_JSONL) {
+        fprintf(fp, ",\"id\":%d,\"census_yr\":%d,\"block_id\":%d,"
+                    "\"property_id\":%d,\"base_prop_id\":%d,"
+                    "\"city_area_name\":",
+                record->id, record->census_yr, record->block_id,
+                record->property_id, record->base_prop_id);
+        write_json_string(fp, record->city_area_name);
+        fputs(",\"trade_name\":", fp);
+        write_json_string(fp, record->trade_name);
+        fprintf(fp, ",\"industry_code\":%d,\"industry_desc\":",
+                record->industry_code);
+        write_json_string(fp, record->industry_desc);
+        fprintf(fp, ",\"x\":%.8lf,\"y\":%.8lf,\"location\":",
+                record->degrees[0], record->degrees[1]);
+        write_json_string(fp, record->location);
+        fputs("}\n", fp);
+
+    } else {
+        fprintf(fp, "Census year: %d || Block ID: %d || Property ID: %d "
+                    "|| Base property ID: %d || CLUE small area: %s || "
+                    "Trading Name: %s || Industry (ANZSIC4) code: %d || "
+                    "Industry (ANZSIC4) description: %s || "
+                    "x coordinate: %.4lf || y coordinate: %.4lf || "
+                    "Location: %s || \n",
+                record->census_yr, record->block_id, record->property_id,
+                record->base_prop_id, record->city_area_name,
+                record->trade_name, record->industry_code,
+                record->industry_desc, record->degrees[0],
+                record->degrees[1], record->location);
+    }
+    fclose(fp);
+
+    record->rendered = buffer;
+    record->rendered_len = (int) size;
+    record->rendered_format = format;
+    *len = record->rendered_len;
+
+    return record->rendered;
+}
+
+/* Write a string as a quoted JSON string */
+void
+write_json_string(FILE *fp, const char *string) {
+    fputc('"', fp);
+    for (const char *c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', fp);
+            fputc(*c, fp);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(fp, "\\u%04x", *c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
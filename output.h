@@ -0,0 +1,38 @@
+#ifndef output_h
+#define output_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include "csvparser.h"
+
+#define FORMAT_TEXT 0                    /* "<key> --> Census year: ..." */
+#define FORMAT_CSV 1                     /* "<key>,<record id>" */
+#define FORMAT_JSONL 2                   /* one JSON object per record */
+#define FORMAT_BINARY 3                  /* pairs of little-endian int32
+                                            query index and record id */
+#define NUM_FORMATS 4
+
+#define NOTFOUND_ID -1                   /* record id of a failed search */
+
+/* Output file that search results are written to */
+typedef struct {
+    FILE *fp;
+    int format;                          /* one of FORMAT_* */
+    int32_t query_index;                 /* number of keys finished */
+} output_t;
+
+/* prototypes for the functions in this library */
+output_t *open_output(const char *outputfile, int format);
+void close_output(output_t *out);
+int parse_format(const char *name);
+void write_record(output_t *out, const char *key, record_t *record);
+void write_notfound(output_t *out, const char *key);
+void write_int32(output_t *out, int32_t value);
+void end_query(output_t *out);
+const char *render_record(record_t *record, int format, int *len);
+void write_json_string(FILE *fp, const char *string);
+
+#endif /* output_h */
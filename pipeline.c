@@ -0,0 +1,362 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the streaming mode of the search. A reader parses keys from large  *
+* blocks of the input, search workers answer them and a writer outputs the  *
+* results in the order of the keys, all connected by bounded queues so that  *
+* reading, searching and writing overlap in constant memory                  *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <unistd.h>
+#include <sched.h>
+#include "pipeline.h"
+
+static void read_keys(pipeline_t *pipeline, int fd);
+static void hand_over(pipeline_t *pipeline, unsigned long num_keys,
+                      char *line, int length);
+static void *search_worker(void *arg);
+static void *write_results(void *arg);
+
+/* Checks whether the stage waiting for the given turn of a ring can go
+    on */
+typedef int (*ready_t)(pipeline_t *pipeline, ring_t *ring,
+                       unsigned long turn);
+
+static int slot_free(pipeline_t *pipeline, ring_t *ring, unsigned long turn);
+static int key_filled(pipeline_t *pipeline, ring_t *ring,
+                      unsigned long turn);
+static int key_searched(pipeline_t *pipeline, ring_t *ring,
+                        unsigned long turn);
+static void wait_ring(pipeline_t *pipeline, ring_t *ring, unsigned long turn,
+                      ready_t ready);
+static void wake_ring(ring_t *ring);
+
+/* Worker thread and the pipeline it belongs to */
+typedef struct {
+    pipeline_t *pipeline;
+    int worker;
+} worker_arg_t;
+
+/* Set up a pipeline of num_workers search workers. Each slot in flight
+    holds its dataset as a reader of the reloader, so there can be no more
+    slots than readers */
+pipeline_t
+*make_pipeline(reloader_t *reloader, output_t *out, int num_workers,
+               int with_radius, slot_search_t search, void *arg) {
+    pipeline_t *pipeline = (pipeline_t *) malloc(sizeof(*pipeline));
+    assert(pipeline != NULL);
+
+    if (num_workers < 1) {
+        num_workers = 1;
+    }
+    if (num_workers * PIPELINE_DEPTH > MAX_READERS) {
+        num_workers = MAX_READERS / PIPELINE_DEPTH;
+    }
+    pipeline->num_workers = num_workers;
+    pipeline->reloader = reloader;
+    pipeline->out = out;
+    pipeline->with_radius = with_radius;
+    pipeline->search = search;
+    pipeline->arg = arg;
+    atomic_init(&pipeline->finished, 0);
+    memset(&pipeline->stats, 0, sizeof(pipeline->stats));
+
+    pipeline->rings = (ring_t *) aligned_alloc(CACHE_LINE, sizeof(ring_t) *
+                                               num_workers);
+    assert(pipeline->rings != NULL);
+    for (int w = 0; w < num_workers; w++) {
+        ring_t *ring = &pipeline->rings[w];
+        atomic_init(&ring->filled, 0);
+        atomic_init(&ring->searched, 0);
+        atomic_init(&ring->written, 0);
+        atomic_init(&ring->sleepers, 0);
+        pthread_mutex_init(&ring->lock, NULL);
+        pthread_cond_init(&ring->wake, NULL);
+        ring->stalls = 0;
+        ring->slots = (slot_t *) calloc(PIPELINE_DEPTH, sizeof(slot_t));
+        assert(ring->slots != NULL);
+    }
+
+    return pipeline;
+}
+
+/* Search every key read from fd, returning once all the results are
+    written. Keys are read on the calling thread */
+void
+run_pipeline(pipeline_t *pipeline, int fd) {
+    worker_arg_t *args = (worker_arg_t *) malloc(sizeof(worker_arg_t) *
+                                                 pipeline->num_workers);
+    assert(args != NULL);
+
+    for (int w = 0; w < pipeline->num_workers; w++) {
+        args[w].pipeline = pipeline;
+        args[w].worker = w;
+        if (pthread_create(&pipeline->rings[w].worker, NULL, search_worker,
+                           &args[w]) != 0) {
+            fprintf(stderr, "Error creating search worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pthread_create(&pipeline->writer, NULL, write_results,
+                       pipeline) != 0) {
+        fprintf(stderr, "Error creating writer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    read_keys(pipeline, fd);
+    atomic_store_explicit(&pipeline->finished, 1, memory_order_release);
+    for (int w = 0; w < pipeline->num_workers; w++) {
+        wake_ring(&pipeline->rings[w]);
+    }
+
+    for (int w = 0; w < pipeline->num_workers; w++) {
+        pthread_join(pipeline->rings[w].worker, NULL);
+        pipeline->stats.worker_stalls += pipeline->rings[w].stalls;
+    }
+    pthread_join(pipeline->writer, NULL);
+    free(args);
+}
+
+/* Split the input into lines in place, one key per line as with getline.
+    The block only grows when a single line does not fit in it */
+static void
+read_keys(pipeline_t *pipeline, int fd) {
+    int size = READ_BLOCK;
+    char *block = (char *) malloc(size + 1);
+    assert(block != NULL);
+    int length = 0;
+    unsigned long num_keys = 0;
+    ssize_t num_read;
+
+    while ((num_read = read(fd, block + length, size - length)) > 0) {
+        length += (int) num_read;
+
+        int start = 0;
+        char *newline;
+        while ((newline = memchr(block + start, '\n', length - start))
+               != NULL) {
+            int end = (int) (newline - block);
+            hand_over(pipeline, num_keys++, block + start, end - start);
+            start = end + 1;
+        }
+
+        /* Keep the unfinished line at the front of the block */
+        memmove(block, block + start, length - start);
+        length -= start;
+        if (length == size) {
+            size *= 2;
+            block = (char *) realloc(block, size + 1);
+            assert(block != NULL);
+        }
+    }
+
+    /* The last line may not end with a newline */
+    if (length > 0) {
+        hand_over(pipeline, num_keys++, block, length);
+    }
+    pipeline->stats.num_keys = (long) num_keys;
+    free(block);
+}
+
+/* Parse a line into the next slot of its worker, waiting for the writer
+    to free the slot if the worker is PIPELINE_DEPTH keys behind */
+static void
+hand_over(pipeline_t *pipeline, unsigned long num_keys, char *line,
+          int length) {
+    ring_t *ring = &pipeline->rings[num_keys % pipeline->num_workers];
+    unsigned long turn = num_keys / pipeline->num_workers;
+
+    if (!slot_free(pipeline, ring, turn)) {
+        pipeline->stats.reader_stalls++;
+        wait_ring(pipeline, ring, turn, slot_free);
+    }
+    unsigned long written = atomic_load_explicit(&ring->written,
+                                                 memory_order_acquire);
+    int depth = (int) (turn - written);
+    pipeline->stats.depth_sum += depth;
+    if (depth > pipeline->stats.max_depth) {
+        pipeline->stats.max_depth = depth;
+    }
+
+    slot_t *slot = &ring->slots[turn % PIPELINE_DEPTH];
+    line[length] = '\0';
+
+    /* Keep the key up to the end of the line for printing, as
+        duplicate_string does */
+    int key_length = (int) strcspn(line, "\r");
+    if (key_length >= KEY_CHARS) {
+        key_length = KEY_CHARS - 1;
+    }
+    memcpy(slot->key, line, key_length);
+    slot->key[key_length] = '\0';
+
+    double values[KEY_LENGTH + 1];
+    if (pipeline->with_radius) {
+        int num_values = parse_key(line, values, KEY_LENGTH + 1);
+        slot->radius = values[METRIC_DIMENSION];
+        fill_query(&slot->query, values, num_values, 1);
+    } else {
+        int num_values = parse_key(line, values, KEY_LENGTH);
+        fill_query(&slot->query, values, num_values, 0);
+    }
+
+    atomic_store_explicit(&ring->filled, turn + 1, memory_order_release);
+    wake_ring(ring);
+}
+
+/* Search the keys of one worker in turn. The dataset of a key is held
+    until the writer has written its results */
+static void
+*search_worker(void *arg) {
+    worker_arg_t *worker_arg = arg;
+    pipeline_t *pipeline = worker_arg->pipeline;
+    int w = worker_arg->worker;
+    ring_t *ring = &pipeline->rings[w];
+
+    for (unsigned long turn = 0; ; turn++) {
+        if (!key_filled(pipeline, ring, turn)) {
+            ring->stalls++;
+            wait_ring(pipeline, ring, turn, key_filled);
+        }
+        /* Every key is read once finished is set, so a key that has not
+            arrived by then never will */
+        if (atomic_load_explicit(&ring->filled, memory_order_acquire) <=
+            turn) {
+            return NULL;
+        }
+
+        int position = (int) (turn % PIPELINE_DEPTH);
+        slot_t *slot = &ring->slots[position];
+        dataset_t *data = reader_enter(pipeline->reloader,
+                                       w * PIPELINE_DEPTH + position);
+        pipeline->search(data, slot, pipeline->arg);
+
+        atomic_store_explicit(&ring->searched, turn + 1,
+                              memory_order_release);
+        wake_ring(ring);
+    }
+}
+
+/* Write the results of every key in the order the keys were read */
+static void
+*write_results(void *arg) {
+    pipeline_t *pipeline = arg;
+    int num_workers = pipeline->num_workers;
+
+    for (unsigned long num_keys = 0; ; num_keys++) {
+        int w = (int) (num_keys % num_workers);
+        unsigned long turn = num_keys / num_workers;
+        ring_t *ring = &pipeline->rings[w];
+
+        if (!key_searched(pipeline, ring, turn)) {
+            pipeline->stats.writer_stalls++;
+            wait_ring(pipeline, ring, turn, key_searched);
+        }
+        /* Workers stop after the last key, so once reading is finished a
+            key that was never filled is past the end */
+        if (atomic_load_explicit(&ring->searched, memory_order_acquire) <=
+            turn) {
+            fflush(stdout);
+            return NULL;
+        }
+
+        int position = (int) (turn % PIPELINE_DEPTH);
+        slot_t *slot = &ring->slots[position];
+        append_results(pipeline->out, slot->key, &slot->results);
+        end_query(pipeline->out);
+        fputs(slot->summary, stdout);
+
+        reader_exit(pipeline->reloader, w * PIPELINE_DEPTH + position);
+        atomic_store_explicit(&ring->written, turn + 1, memory_order_release);
+        wake_ring(ring);
+    }
+}
+
+/* The reader can fill the slot of its turn once the writer is less than
+    PIPELINE_DEPTH keys behind */
+static int
+slot_free(pipeline_t *pipeline, ring_t *ring, unsigned long turn) {
+    return turn - atomic_load_explicit(&ring->written,
+                                       memory_order_acquire) <
+           PIPELINE_DEPTH;
+}
+
+/* A worker can go on once its key is filled, or reading has finished */
+static int
+key_filled(pipeline_t *pipeline, ring_t *ring, unsigned long turn) {
+    return atomic_load_explicit(&ring->filled, memory_order_acquire) > turn ||
+           atomic_load_explicit(&pipeline->finished, memory_order_acquire);
+}
+
+/* The writer can go on once the key is searched, or reading has finished
+    without filling it */
+static int
+key_searched(pipeline_t *pipeline, ring_t *ring, unsigned long turn) {
+    return atomic_load_explicit(&ring->searched,
+                                memory_order_acquire) > turn ||
+           (atomic_load_explicit(&pipeline->finished, memory_order_acquire) &&
+            atomic_load_explicit(&ring->filled, memory_order_acquire) <=
+            turn);
+}
+
+/* Wait until the stage can go on, yielding for a while in case the stage
+    before it is about to move, then sleeping until woken by a count of
+    the ring moving so that an idle stream costs no CPU */
+static void
+wait_ring(pipeline_t *pipeline, ring_t *ring, unsigned long turn,
+          ready_t ready) {
+    for (int spin = 0; spin < PIPELINE_SPINS; spin++) {
+        if (ready(pipeline, ring, turn)) {
+            return;
+        }
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->sleepers, 1);
+    /* Pairs with the fence of wake_ring: either the stage moving its count
+        sees this sleeper, or the check below sees the count */
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!ready(pipeline, ring, turn)) {
+        pthread_cond_wait(&ring->wake, &ring->lock);
+    }
+    atomic_fetch_sub(&ring->sleepers, 1);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Wake the stages sleeping on the ring after a count of it has moved */
+static void
+wake_ring(ring_t *ring) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->sleepers, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->wake);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+/* Print the queue depth and stall counters of a finished run */
+void
+print_pipeline_stats(pipeline_t *pipeline, FILE *fp) {
+    pipeline_stats_t *stats = &pipeline->stats;
+    fprintf(fp, "pipeline: %ld keys, %d workers, depth mean %.2f max %d of "
+                "%d, stalls reader %ld workers %ld writer %ld\n",
+            stats->num_keys, pipeline->num_workers,
+            stats->num_keys ? (double) stats->depth_sum / stats->num_keys : 0,
+            stats->max_depth, PIPELINE_DEPTH, stats->reader_stalls,
+            stats->worker_stalls, stats->writer_stalls);
+}
+
+void
+free_pipeline(pipeline_t *pipeline) {
+    assert(pipeline != NULL);
+    for (int w = 0; w < pipeline->num_workers; w++) {
+        for (int i = 0; i < PIPELINE_DEPTH; i++) {
+            free(pipeline->rings[w].slots[i].results.results);
+        }
+        free(pipeline->rings[w].slots);
+        pthread_mutex_destroy(&pipeline->rings[w].lock);
+        pthread_cond_destroy(&pipeline->rings[w].wake);
+    }
+    free(pipeline->rings);
+    free(pipeline);
+}
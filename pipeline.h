@@ -0,0 +1,94 @@
+#ifndef pipeline_h
+#define pipeline_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "kdtree.h"
+#include "search.h"
+#include "output.h"
+#include "reload.h"
+
+#define READ_BLOCK 65536                 /* bytes of keys read at once */
+#define KEY_CHARS 128                    /* longest key kept for printing */
+#define DETAIL_CHARS 48                  /* comparisons and plan of a key */
+#define SUMMARY_CHARS (KEY_CHARS + DETAIL_CHARS + 8)
+                                         /* line printed for each key */
+#define PIPELINE_DEPTH 16                /* keys in flight per worker */
+#define PIPELINE_SPINS 256               /* checks of a stage that waits
+                                            before it sleeps */
+#define CACHE_LINE 64
+
+/* Key travelling through the pipeline, along with its results. Slots are
+    reused, so nothing is allocated per key once the result arrays have
+    grown to the largest result */
+typedef struct {
+    char key[KEY_CHARS];
+    query_t query;
+    double radius;
+    result_set_t results;                /* buffer grows to fit */
+    char summary[SUMMARY_CHARS];         /* printed once the key is written */
+} slot_t;
+
+/* Slots of one worker. The reader fills them, the worker searches them and
+    the writer writes them, each in turn and each advancing its own count
+    only, so the two queues (reader to worker, worker to writer) need no
+    lock. A count never passes the one of the stage before it, and the
+    reader stays less than PIPELINE_DEPTH keys ahead of the writer. A stage
+    that is still waiting after PIPELINE_SPINS checks sleeps on the ring,
+    and a stage advancing its count only takes the lock to wake it if
+    some stage is asleep */
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ulong filled;
+    _Alignas(CACHE_LINE) atomic_ulong searched;
+    _Alignas(CACHE_LINE) atomic_ulong written;
+    _Alignas(CACHE_LINE) atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                 /* broadcast when a count moves */
+    _Alignas(CACHE_LINE) slot_t *slots;
+    long stalls;                         /* waits of the worker for a key */
+    pthread_t worker;
+} ring_t;
+
+/* Counters of a pipeline run. A stall is a wait of a stage on the stage
+    before it (or, for the reader, on the writer to free a slot) */
+typedef struct {
+    long num_keys;
+    long reader_stalls;
+    long worker_stalls;
+    long writer_stalls;
+    long depth_sum;                      /* keys in flight in the worker of
+                                            each key when it was read */
+    int max_depth;
+} pipeline_stats_t;
+
+/* Searches the key of a slot into its result set and fills in the
+    summary */
+typedef void (*slot_search_t)(dataset_t *data, slot_t *slot, void *arg);
+
+/* Reader, search workers and ordered writer of a stream of keys */
+typedef struct {
+    ring_t *rings;
+    int num_workers;
+    reloader_t *reloader;
+    output_t *out;
+    int with_radius;                     /* keys hold a radius */
+    slot_search_t search;
+    void *arg;                           /* passed on to search */
+    atomic_int finished;                 /* set once every key is read */
+    pthread_t writer;
+    pipeline_stats_t stats;
+} pipeline_t;
+
+/* prototypes for the functions in this library */
+pipeline_t *make_pipeline(reloader_t *reloader, output_t *out,
+                          int num_workers, int with_radius,
+                          slot_search_t search, void *arg);
+void run_pipeline(pipeline_t *pipeline, int fd);
+void print_pipeline_stats(pipeline_t *pipeline, FILE *fp);
+void free_pipeline(pipeline_t *pipeline);
+
+#endif /* pipeline_h */
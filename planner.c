@@ -0,0 +1,201 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the query planner that estimates how many locations a radius       *
+* search reaches from a coarse grid histogram, and answers searches that     *
+* cover much of the city with a vectorised scan instead of the KD tree       *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "planner.h"
+
+static int count_nodes(node_t *root);
+static void collect_nodes(node_t *root, planner_t *planner);
+static int grid_cell(planner_t *planner, double value, int axis);
+static void report_match(planner_t *planner, int i, query_t *query,
+                         report_t report, void *arg);
+
+/* Lay out the locations of the tree contiguously and build the histogram
+    used to estimate the reach of each search */
+planner_t
+*make_planner(tree_t *tree, double threshold) {
+    assert(tree != NULL);
+    planner_t *planner = (planner_t *) malloc(sizeof(*planner));
+    assert(planner != NULL);
+
+    int num_nodes = count_nodes(tree->root);
+    planner->nodes = (node_t **) malloc(sizeof(node_t *) * (num_nodes + 1));
+    planner->xs = (double *) malloc(sizeof(double) * (num_nodes + 1));
+    planner->ys = (double *) malloc(sizeof(double) * (num_nodes + 1));
+    planner->counts = (int *) calloc((GRID_SIZE + 1) * (GRID_SIZE + 1),
+                                     sizeof(int));
+    assert(planner->nodes != NULL && planner->xs != NULL &&
+           planner->ys != NULL && planner->counts != NULL);
+    planner->num_points = 0;
+    planner->threshold = threshold;
+
+    /* Locations are stored in pre-order, the order in which the tree
+        search reports them, so both plans give the same output */
+    collect_nodes(tree->root, planner);
+
+    /* Find the bounding box of the locations */
+    double hi[METRIC_DIMENSION];
+    planner->lo[0] = hi[0] = num_nodes ? planner->xs[0] : 0;
+    planner->lo[1] = hi[1] = num_nodes ? planner->ys[0] : 0;
+    for (int i = 1; i < num_nodes; i++) {
+        planner->lo[0] = fmin(planner->lo[0], planner->xs[i]);
+        planner->lo[1] = fmin(planner->lo[1], planner->ys[i]);
+        hi[0] = fmax(hi[0], planner->xs[i]);
+        hi[1] = fmax(hi[1], planner->ys[i]);
+    }
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        planner->cell[d] = (hi[d] - planner->lo[d]) / GRID_SIZE;
+        if (planner->cell[d] <= 0) {
+            planner->cell[d] = 1;
+        }
+    }
+
+    /* Count the locations of each cell, then accumulate the counts so
+        that counts[(i + 1) * (GRID_SIZE + 1) + j + 1] holds the number of
+        locations in cells [0, i] x [0, j] */
+    int width = GRID_SIZE + 1;
+    for (int i = 0; i < num_nodes; i++) {
+        int cx = grid_cell(planner, planner->xs[i], 0);
+        int cy = grid_cell(planner, planner->ys[i], 1);
+        planner->counts[(cx + 1) * width + cy + 1]++;
+    }
+    for (int i = 1; i < width; i++) {
+        for (int j = 1; j < width; j++) {
+            planner->counts[i * width + j] +=
+                planner->counts[(i - 1) * width + j] +
+                planner->counts[i * width + j - 1] -
+                planner->counts[(i - 1) * width + j - 1];
+        }
+    }
+
+    return planner;
+}
+
+/* Count the locations (nodes) of the subtree */
+static int
+count_nodes(node_t *root) {
+    if (root == NULL) {
+        return 0;
+    }
+    return 1 + count_nodes(root->left) + count_nodes(root->rght);
+}
+
+/* Record the locations of the subtree in pre-order */
+static void
+collect_nodes(node_t *root, planner_t *planner) {
+    if (root == NULL) {
+        return;
+    }
+
+    double *coordinates = root->group.records->coordinates;
+    planner->nodes[planner->num_points] = root;
+    planner->xs[planner->num_points] = coordinates[0];
+    planner->ys[planner->num_points] = coordinates[1];
+    planner->num_points++;
+
+    collect_nodes(root->left, planner);
+    collect_nodes(root->rght, planner);
+}
+
+/* Return the histogram cell holding the value on the given axis, clamped
+    to the grid */
+static int
+grid_cell(planner_t *planner, double value, int axis) {
+    double cell = floor((value - planner->lo[axis]) / planner->cell[axis]);
+    if (cell < 0) {
+        return 0;
+    }
+    if (cell >= GRID_SIZE) {
+        return GRID_SIZE - 1;
+    }
+    return (int) cell;
+}
+
+/* Estimate how many locations the search reaches from the histogram cells
+    overlapping its bounding square, and pick the cheaper plan */
+int
+plan_radius_search(planner_t *planner, query_t *query, double radius,
+                   int *estimate) {
+    double *key = query->coordinates;
+    int width = GRID_SIZE + 1;
+    int x0 = grid_cell(planner, key[0] - radius, 0);
+    int x1 = grid_cell(planner, key[0] + radius, 0) + 1;
+    int y0 = grid_cell(planner, key[1] - radius, 1);
+    int y1 = grid_cell(planner, key[1] + radius, 1) + 1;
+
+    *estimate = planner->counts[x1 * width + y1] -
+                planner->counts[x0 * width + y1] -
+                planner->counts[x1 * width + y0] +
+                planner->counts[x0 * width + y0];
+
+    return (*estimate >= planner->threshold * planner->num_points) ?
+           PLAN_SCAN : PLAN_TREE;
+}
+
+/* Compare every location with the key and report those within the radius,
+    returning the number of comparisons made */
+int
+scan_radius(planner_t *planner, query_t *query, double radius,
+            report_t report, void *arg) {
+    double *coordinates = query->coordinates;
+    int i = 0;
+
+#ifdef __SSE2__
+    /* Compare two locations at a time */
+    __m128d key_x = _mm_set1_pd(coordinates[0]);
+    __m128d key_y = _mm_set1_pd(coordinates[1]);
+    __m128d limit = _mm_set1_pd(radius);
+    for (; i + 1 < planner->num_points; i += 2) {
+        __m128d dx = _mm_sub_pd(_mm_loadu_pd(&planner->xs[i]), key_x);
+        __m128d dy = _mm_sub_pd(_mm_loadu_pd(&planner->ys[i]), key_y);
+        __m128d dist = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(dx, dx),
+                                              _mm_mul_pd(dy, dy)));
+        int mask = _mm_movemask_pd(_mm_cmple_pd(dist, limit));
+
+        if (mask & 1) {
+            report_match(planner, i, query, report, arg);
+        }
+        if (mask & 2) {
+            report_match(planner, i + 1, query, report, arg);
+        }
+    }
+#endif
+    for (; i < planner->num_points; i++) {
+        double point[METRIC_DIMENSION] = {planner->xs[i], planner->ys[i]};
+        if (calc_dist(point, coordinates) <= radius) {
+            report_match(planner, i, query, report, arg);
+        }
+    }
+
+    return planner->num_points;
+}
+
+/* Report a location within the radius if it also lies inside the attribute
+    ranges of the query */
+static void
+report_match(planner_t *planner, int i, query_t *query, report_t report,
+             void *arg) {
+    node_t *node = planner->nodes[i];
+    double *coordinates = node->group.records->coordinates;
+
+    if (in_range(coordinates, query)) {
+        report(node, calc_dist(coordinates, query->coordinates), arg);
+    }
+}
+
+/* Release the planner, the tree is not freed */
+void
+free_planner(planner_t *planner) {
+    assert(planner != NULL);
+    free(planner->nodes);
+    free(planner->xs);
+    free(planner->ys);
+    free(planner->counts);
+    free(planner);
+}
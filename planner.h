@@ -0,0 +1,43 @@
+#ifndef planner_h
+#define planner_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "kdtree.h"
+#include "csvparser.h"
+#include "search.h"
+
+#define GRID_SIZE 64                     /* cells per axis of the histogram */
+#define SCAN_THRESHOLD 0.15              /* default fraction of locations a
+                                            search must be expected to reach
+                                            before scanning is preferred */
+
+#define PLAN_TREE 0                      /* traverse the KD tree */
+#define PLAN_SCAN 1                      /* scan every location */
+
+/* Chooses between the KD tree and a linear scan for each radius search */
+typedef struct {
+    node_t **nodes;                      /* every location in the order the
+                                            tree search visits them */
+    double *xs;                          /* contiguous coordinates of the */
+    double *ys;                          /* locations */
+    int num_points;
+    double lo[METRIC_DIMENSION];         /* bounding box of the locations */
+    double cell[METRIC_DIMENSION];       /* size of a histogram cell */
+    int *counts;                         /* summed-area table of locations
+                                            per histogram cell */
+    double threshold;
+} planner_t;
+
+/* prototypes for the functions in this library */
+planner_t *make_planner(tree_t *tree, double threshold);
+int plan_radius_search(planner_t *planner, query_t *query, double radius,
+                       int *estimate);
+int scan_radius(planner_t *planner, query_t *query, double radius,
+                report_t report, void *arg);
+void free_planner(planner_t *planner);
+
+#endif /* planner_h */
@@ -0,0 +1,318 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the program that rebuilds the dataset from the CSV file in the     *
+* background while searches keep running, then hands the new tree over to    *
+* the readers and frees the old tree once no reader still references it      *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <signal.h>
+#include <sched.h>
+#include "reload.h"
+
+#define RELOAD_SIGNAL SIGHUP             /* rebuild the dataset */
+#define STOP_SIGNAL SIGUSR2              /* stop watching for reloads */
+
+static dataset_t *load_dataset(reloader_t *reloader,
+                               unsigned long generation);
+static void free_dataset(reloader_t *reloader, dataset_t *data);
+static int choose_layout(reloader_t *reloader, FILE *fp,
+                         const projection_t *projection);
+static int account_dataset(reloader_t *reloader, dataset_t *data,
+                           int layout);
+static void print_memory(FILE *fp, int layout, const memory_t *memory);
+static void *watch_signals(void *arg);
+
+static const char *layout_names[NUM_LAYOUTS] = {"plain", "compact"};
+
+/* Load the dataset for the first time, exiting if it cannot be read */
+reloader_t
+*make_reloader(const char *filename, const backend_t *backend,
+               int build_threads, const region_t *region, int metric,
+               size_t budget, void *(*make_aux)(tree_t *, void *),
+               void (*free_aux)(void *), void *aux_arg) {
+    reloader_t *reloader = (reloader_t *) malloc(sizeof(*reloader));
+    assert(reloader != NULL);
+
+    reloader->filename = filename;
+    reloader->backend = backend;
+    reloader->build_threads = build_threads;
+    reloader->region = region;
+    reloader->metric = metric;
+    reloader->budget = budget;
+    reloader->make_aux = make_aux;
+    reloader->free_aux = free_aux;
+    reloader->aux_arg = aux_arg;
+    reloader->watching = 0;
+    /* Epochs start at 1 so that 0 marks an idle reader */
+    atomic_init(&reloader->epoch, 1);
+    for (int i = 0; i < MAX_READERS; i++) {
+        atomic_init(&reloader->reader_epoch[i], 0);
+    }
+
+    dataset_t *data = load_dataset(reloader, 0);
+    if (data == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&reloader->current, data);
+
+    return reloader;
+}
+
+/* Read the CSV file into a new dataset, returning NULL if it cannot be
+    opened or does not fit the budget */
+static dataset_t
+*load_dataset(reloader_t *reloader, unsigned long generation) {
+    FILE *fp = fopen(reloader->filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening file '%s'\n", reloader->filename);
+        return NULL;
+    }
+
+    /* The origin follows the centroid of the file as it is now */
+    projection_t projection;
+    if (reloader->metric) {
+        centre_projection(fp, &projection);
+    }
+
+    /* With a budget, the layout is chosen before anything is built. The
+        memory is only reported without one */
+    int layout = LAYOUT_PLAIN;
+    if (reloader->budget > 0 && reloader->budget != UNLIMITED &&
+        (layout = choose_layout(reloader, fp, reloader->metric ?
+                                &projection : NULL)) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    dataset_t *data = (dataset_t *) malloc(sizeof(*data));
+    assert(data != NULL);
+    data->tree = make_empty_tree();
+    if (layout == LAYOUT_COMPACT) {
+        data->tree->strings = make_strings();
+    }
+    data->projected = reloader->metric;
+    if (reloader->metric) {
+        data->projection = projection;
+        data->buffer = read_and_parse_region(fp, data->tree,
+                                             reloader->build_threads,
+                                             reloader->region,
+                                             &data->projection);
+    } else if (reloader->region != NULL) {
+        data->buffer = read_and_parse_region(fp, data->tree,
+                                             reloader->build_threads,
+                                             reloader->region, NULL);
+    } else if (reloader->build_threads > 0) {
+        data->buffer = read_and_parse_balanced(fp, data->tree,
+                                               reloader->build_threads);
+    } else {
+        data->buffer = read_and_parse(fp, data->tree);
+    }
+    if (layout == LAYOUT_COMPACT) {
+        compact_tree(data->tree);
+    }
+    data->index = reloader->backend->build(data->tree);
+    data->aux = reloader->make_aux ? reloader->make_aux(data->tree,
+                                                    reloader->aux_arg) : NULL;
+    data->generation = generation;
+    fclose(fp);
+
+    if (reloader->budget > 0 && !account_dataset(reloader, data, layout)) {
+        free_dataset(reloader, data);
+        return NULL;
+    }
+    return data;
+}
+
+/* Survey the CSV file and pick the most compact layout, the one that
+    would hold the fewest bytes along with the index the backend would
+    build. If it does not fit the budget, every layout is reported and -1
+    returned */
+static int
+choose_layout(reloader_t *reloader, FILE *fp,
+              const projection_t *projection) {
+    memory_t layouts[NUM_LAYOUTS];
+    double lo[METRIC_DIMENSION], hi[METRIC_DIMENSION];
+    survey_csv(fp, reloader->build_threads > 0, projection, layouts, lo, hi);
+    int best = LAYOUT_PLAIN;
+    for (int l = 0; l < NUM_LAYOUTS; l++) {
+        layouts[l].index = reloader->backend->estimate(layouts[l].num_nodes,
+                                                       lo, hi);
+        if (memory_total(&layouts[l]) < memory_total(&layouts[best])) {
+            best = l;
+        }
+    }
+    if (memory_total(&layouts[best]) <= reloader->budget) {
+        return best;
+    }
+
+    fprintf(stderr, "memory: no layout of '%s' fits the budget of %zu "
+                    "bytes\n", reloader->filename, reloader->budget);
+    for (int l = 0; l < NUM_LAYOUTS; l++) {
+        print_memory(stderr, l, &layouts[l]);
+    }
+    return -1;
+}
+
+/* Report the bytes held by a loaded dataset, returning 0 if they exceed
+    the budget after all, should the survey have fallen short. The KD tree
+    is its own index */
+static int
+account_dataset(reloader_t *reloader, dataset_t *data, int layout) {
+    memory_t memory;
+    measure_tree(data->tree, &memory);
+    if (reloader->backend != &kd_backend) {
+        memory.index = reloader->backend->memory(data->index);
+    }
+    print_memory(stderr, layout, &memory);
+
+    if (memory_total(&memory) > reloader->budget) {
+        fprintf(stderr, "memory: '%s' exceeds the budget of %zu bytes with "
+                        "its index\n", reloader->filename, reloader->budget);
+        return 0;
+    }
+    return 1;
+}
+
+/* Print the bytes of each component of a dataset in one layout, and how
+    many nodes, records and strings they hold */
+static void
+print_memory(FILE *fp, int layout, const memory_t *memory) {
+    fprintf(fp, "memory: %s layout, nodes %zu (%ld), records %zu (%ld), "
+                "slack %zu, strings %zu (%ld), string table %zu, index %zu, "
+                "total %zu bytes\n", layout_names[layout], memory->nodes,
+            memory->num_nodes, memory->records, memory->num_records,
+            memory->slack, memory->strings, memory->num_strings,
+            memory->string_table, memory->index, memory_total(memory));
+}
+
+/* Read a budget of bytes, which may end in K, M or G, returning 0 if it
+    is not a positive size */
+size_t
+parse_budget(const char *text) {
+    char *end;
+    double bytes = strtod(text, &end);
+    if (*end == 'K' || *end == 'k') {
+        bytes *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        bytes *= 1024 * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        bytes *= 1024 * 1024 * 1024;
+        end++;
+    }
+    if (end == text || *end != '\0' || !(bytes >= 1) ||
+        bytes >= (double) UNLIMITED) {
+        return 0;
+    }
+    return (size_t) bytes;
+}
+
+/* Release a dataset along with its tree, records, index and aux
+    structure */
+static void
+free_dataset(reloader_t *reloader, dataset_t *data) {
+    if (data->aux != NULL && reloader->free_aux != NULL) {
+        reloader->free_aux(data->aux);
+    }
+    reloader->backend->free(data->index);
+    free_tree(data->tree);
+    free(data->buffer);
+    free(data);
+}
+
+/* Start a search as the given reader and return the dataset to use until
+    reader_exit is called */
+dataset_t
+*reader_enter(reloader_t *reloader, int reader) {
+    assert(reader >= 0 && reader < MAX_READERS);
+    /* Announce the epoch before looking at the dataset, so a writer that
+        replaced it afterwards is bound to see this reader */
+    atomic_store(&reloader->reader_epoch[reader],
+                 atomic_load(&reloader->epoch));
+    return atomic_load(&reloader->current);
+}
+
+/* Finish a search, the dataset must no longer be used */
+void
+reader_exit(reloader_t *reloader, int reader) {
+    atomic_store_explicit(&reloader->reader_epoch[reader], 0,
+                          memory_order_release);
+}
+
+/* Build a new dataset from the CSV file, publish it to the readers and
+    free the old one once every reader has moved past it */
+void
+reload_dataset(reloader_t *reloader) {
+    dataset_t *old = atomic_load(&reloader->current);
+    dataset_t *data = load_dataset(reloader, old->generation + 1);
+    if (data == NULL) {
+        /* Keep serving the current dataset */
+        return;
+    }
+
+    old = atomic_exchange(&reloader->current, data);
+    unsigned long epoch = atomic_fetch_add(&reloader->epoch, 1) + 1;
+
+    /* Wait until no reader that started before the new epoch is still
+        running */
+    for (int i = 0; i < MAX_READERS; i++) {
+        unsigned long seen;
+        while ((seen = atomic_load(&reloader->reader_epoch[i])) != 0 &&
+               seen < epoch) {
+            sched_yield();
+        }
+    }
+
+    free_dataset(reloader, old);
+    fprintf(stderr, "Reloaded '%s' (generation %lu)\n", reloader->filename,
+            data->generation);
+}
+
+/* Rebuild the dataset in the background each time the process receives
+    SIGHUP. Must be called before any other thread is created */
+void
+start_watching(reloader_t *reloader) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, RELOAD_SIGNAL);
+    sigaddset(&set, STOP_SIGNAL);
+    /* The signals are only taken by the watcher thread */
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (pthread_create(&reloader->watcher, NULL, watch_signals,
+                       reloader) != 0) {
+        fprintf(stderr, "Error creating reload thread\n");
+        exit(EXIT_FAILURE);
+    }
+    reloader->watching = 1;
+}
+
+/* Wait for reload requests until told to stop */
+static void
+*watch_signals(void *arg) {
+    reloader_t *reloader = arg;
+    sigset_t set;
+    int sig;
+    sigemptyset(&set);
+    sigaddset(&set, RELOAD_SIGNAL);
+    sigaddset(&set, STOP_SIGNAL);
+
+    while (sigwait(&set, &sig) == 0 && sig != STOP_SIGNAL) {
+        reload_dataset(reloader);
+    }
+
+    return NULL;
+}
+
+/* Stop watching for reloads and release the current dataset */
+void
+free_reloader(reloader_t *reloader) {
+    assert(reloader != NULL);
+    if (reloader->watching) {
+        pthread_kill(reloader->watcher, STOP_SIGNAL);
+        pthread_join(reloader->watcher, NULL);
+    }
+    free_dataset(reloader, atomic_load(&reloader->current));
+    free(reloader);
+}
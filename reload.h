@@ -0,0 +1,71 @@
+#ifndef reload_h
+#define reload_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "kdtree.h"
+#include "csvparser.h"
+#include "backend.h"
+
+#define MAX_READERS 256                  /* searches that may run at once */
+#define UNLIMITED SIZE_MAX               /* budget that only reports the
+                                            memory of the dataset */
+
+/* Dataset that searches run against, along with the index and any other
+    structure built over its tree (eg. the query planner) */
+typedef struct {
+    tree_t *tree;
+    char *buffer;                        /* buffer left by read_and_parse */
+    void *index;                         /* built by the reloader backend */
+    void *aux;
+    unsigned long generation;            /* number of reloads before it */
+    int projected;                       /* set if the locations are in
+                                            metres, keys then needing */
+    projection_t projection;             /* the same projection */
+} dataset_t;
+
+/* Publishes datasets to readers and reclaims replaced ones once no reader
+    can still be using them. Readers announce the epoch they started in and
+    never take a lock; a replaced dataset is freed once every reader is
+    either idle or started after it was replaced */
+typedef struct {
+    _Atomic(dataset_t *) current;
+    atomic_ulong epoch;
+    atomic_ulong reader_epoch[MAX_READERS]; /* 0 while a reader is idle */
+    const char *filename;
+    const backend_t *backend;
+    int build_threads;                   /* workers building a balanced
+                                            tree, 0 to insert in order */
+    const region_t *region;              /* part of the dataset loaded, or
+                                            NULL for all of it */
+    int metric;                          /* set to project the locations
+                                            into metres on every load */
+    size_t budget;                       /* bytes a dataset may hold, 0 to
+                                            load it without accounting */
+    void *(*make_aux)(tree_t *tree, void *arg);
+                                         /* builds the aux structure */
+    void (*free_aux)(void *aux);
+    void *aux_arg;                       /* passed on to make_aux */
+    pthread_t watcher;
+    int watching;
+} reloader_t;
+
+/* prototypes for the functions in this library */
+reloader_t *make_reloader(const char *filename, const backend_t *backend,
+                          int build_threads, const region_t *region,
+                          int metric, size_t budget,
+                          void *(*make_aux)(tree_t *, void *),
+                          void (*free_aux)(void *), void *aux_arg);
+void start_watching(reloader_t *reloader);
+dataset_t *reader_enter(reloader_t *reloader, int reader);
+void reader_exit(reloader_t *reloader, int reader);
+void reload_dataset(reloader_t *reloader);
+void free_reloader(reloader_t *reloader);
+size_t parse_budget(const char *text);
+
+#endif /* reload_h */
@@ -0,0 +1,358 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the R-tree backend, bulk loaded with Sort-Tile-Recursive (STR)     *
+* packing so every node except the last of each level is full                *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "backend.h"
+
+/* Node of a packed R-tree. The children of a node are stored next to each
+    other, either in the level below or (for leaves) in the entry array */
+typedef struct {
+    double lo[METRIC_DIMENSION];         /* bounding box of the children */
+    double hi[METRIC_DIMENSION];
+    int first, count;                    /* range of the children */
+} rnode_t;
+
+/* R-tree with its levels stored bottom up, the root being the only node
+    of the top level */
+typedef struct {
+    entry_t *entries;
+    int num_entries;
+    rnode_t **levels;                    /* levels[0] are the leaves */
+    int *level_size;
+    int num_levels;
+} rtree_t;
+
+/* Item being packed into the nodes of a level */
+typedef struct {
+    double centre[METRIC_DIMENSION];
+    int index;                           /* entry or node of the level below */
+} pack_t;
+
+static void *rtree_build(tree_t *tree);
+static node_t *rtree_nearest(void *index, query_t *query, int *num_cmp);
+static int rtree_radius(void *index, query_t *query, double radius,
+                        report_t report, void *arg);
+static int rtree_range(void *index, query_t *query, double *lo, double *hi,
+                       report_t report, void *arg);
+static size_t rtree_memory(void *index);
+static size_t rtree_estimate(int num_locations, const double *lo,
+                             const double *hi);
+static void rtree_free(void *index);
+static void str_sort(pack_t *items, int num_items);
+static int cmp_x(const void *a, const void *b);
+static int cmp_y(const void *a, const void *b);
+static double box_dist(rnode_t *node, double *key);
+static void nearest_node(rtree_t *rtree, int level, int i, query_t *query,
+                         double *nearest_dist, node_t **nearest,
+                         int *num_cmp);
+static int radius_node(rtree_t *rtree, int level, int i, query_t *query,
+                       double radius, report_t report, void *arg);
+static int range_node(rtree_t *rtree, int level, int i, query_t *query,
+                      double *lo, double *hi, report_t report, void *arg);
+
+const backend_t rtree_backend = {
+    "rtree", rtree_build, rtree_nearest, rtree_radius, rtree_range,
+    rtree_memory, rtree_estimate, rtree_free
+};
+
+/* Pack the locations of the tree into leaves, then pack each level into
+    the level above until a single root remains */
+static void
+*rtree_build(tree_t *tree) {
+    rtree_t *rtree = (rtree_t *) malloc(sizeof(*rtree));
+    assert(rtree != NULL);
+    int num_entries;
+    entry_t *entries = collect_entries(tree, &num_entries);
+
+    /* Order the entries in STR order so each leaf covers a tile */
+    pack_t *items = (pack_t *) malloc(sizeof(pack_t) * (num_entries + 1));
+    assert(items != NULL);
+    for (int i = 0; i < num_entries; i++) {
+        items[i].centre[0] = entries[i].coordinates[0];
+        items[i].centre[1] = entries[i].coordinates[1];
+        items[i].index = i;
+    }
+    str_sort(items, num_entries);
+    rtree->entries = (entry_t *) malloc(sizeof(entry_t) * (num_entries + 1));
+    assert(rtree->entries != NULL);
+    for (int i = 0; i < num_entries; i++) {
+        rtree->entries[i] = entries[items[i].index];
+    }
+    rtree->num_entries = num_entries;
+    free(entries);
+
+    rtree->levels = NULL;
+    rtree->level_size = NULL;
+    rtree->num_levels = 0;
+    int num_items = num_entries;
+
+    while (num_items > 0) {
+        /* Group consecutive items into nodes of RTREE_FANOUT children */
+        int level = rtree->num_levels++;
+        int num_nodes = (num_items + RTREE_FANOUT - 1) / RTREE_FANOUT;
+        rtree->levels = realloc(rtree->levels,
+                                sizeof(rnode_t *) * rtree->num_levels);
+        rtree->level_size = realloc(rtree->level_size,
+                                    sizeof(int) * rtree->num_levels);
+        assert(rtree->levels != NULL && rtree->level_size != NULL);
+        rnode_t *nodes = (rnode_t *) malloc(sizeof(rnode_t) * num_nodes);
+        assert(nodes != NULL);
+        rtree->levels[level] = nodes;
+        rtree->level_size[level] = num_nodes;
+
+        for (int n = 0; n < num_nodes; n++) {
+            nodes[n].first = n * RTREE_FANOUT;
+            nodes[n].count = (num_items - nodes[n].first < RTREE_FANOUT) ?
+                             num_items - nodes[n].first : RTREE_FANOUT;
+            for (int c = 0; c < nodes[n].count; c++) {
+                int child = nodes[n].first + c;
+                double lo[METRIC_DIMENSION], hi[METRIC_DIMENSION];
+                for (int d = 0; d < METRIC_DIMENSION; d++) {
+                    if (level == 0) {
+                        lo[d] = hi[d] = rtree->entries[child].coordinates[d];
+                    } else {
+                        lo[d] = rtree->levels[level - 1][child].lo[d];
+                        hi[d] = rtree->levels[level - 1][child].hi[d];
+                    }
+                    if (c == 0 || lo[d] < nodes[n].lo[d]) {
+                        nodes[n].lo[d] = lo[d];
+                    }
+                    if (c == 0 || hi[d] > nodes[n].hi[d]) {
+                        nodes[n].hi[d] = hi[d];
+                    }
+                }
+            }
+        }
+        if (num_nodes == 1) {
+            break;
+        }
+
+        /* Order the nodes in STR order for packing the level above. The
+            children of each node must stay contiguous, so the nodes of this
+            level are moved along with their order */
+        for (int n = 0; n < num_nodes; n++) {
+            items[n].centre[0] = (nodes[n].lo[0] + nodes[n].hi[0]) / 2;
+            items[n].centre[1] = (nodes[n].lo[1] + nodes[n].hi[1]) / 2;
+            items[n].index = n;
+        }
+        str_sort(items, num_nodes);
+        rnode_t *sorted = (rnode_t *) malloc(sizeof(rnode_t) * num_nodes);
+        assert(sorted != NULL);
+        for (int n = 0; n < num_nodes; n++) {
+            sorted[n] = nodes[items[n].index];
+        }
+        free(nodes);
+        rtree->levels[level] = sorted;
+        num_items = num_nodes;
+    }
+
+    free(items);
+    return rtree;
+}
+
+/* Sort-Tile-Recursive order: sort by x, cut into vertical slices of
+    whole nodes, then sort each slice by y */
+static void
+str_sort(pack_t *items, int num_items) {
+    int num_nodes = (num_items + RTREE_FANOUT - 1) / RTREE_FANOUT;
+    int num_slices = (int) ceil(sqrt((double) num_nodes));
+    int slice = num_slices ? RTREE_FANOUT *
+                ((num_nodes + num_slices - 1) / num_slices) : num_items;
+
+    qsort(items, num_items, sizeof(pack_t), cmp_x);
+    for (int start = 0; start < num_items; start += slice) {
+        int count = (num_items - start < slice) ? num_items - start : slice;
+        qsort(items + start, count, sizeof(pack_t), cmp_y);
+    }
+}
+
+static int
+cmp_x(const void *a, const void *b) {
+    const pack_t *pa = a, *pb = b;
+    return (pa->centre[0] > pb->centre[0]) - (pa->centre[0] < pb->centre[0]);
+}
+
+static int
+cmp_y(const void *a, const void *b) {
+    const pack_t *pa = a, *pb = b;
+    return (pa->centre[1] > pb->centre[1]) - (pa->centre[1] < pb->centre[1]);
+}
+
+/* Distance from the key to the closest point of the bounding box */
+static double
+box_dist(rnode_t *node, double *key) {
+    double dx = fmax(fmax(node->lo[0] - key[0], key[0] - node->hi[0]), 0);
+    double dy = fmax(fmax(node->lo[1] - key[1], key[1] - node->hi[1]), 0);
+    return sqrt(dx * dx + dy * dy);
+}
+
+/* Search the children of the root in order of distance, skipping those
+    further away than the nearest location found */
+static node_t
+*rtree_nearest(void *index, query_t *query, int *num_cmp) {
+    rtree_t *rtree = index;
+    double nearest_dist = INFINITY;
+    node_t *nearest = NULL;
+
+    *num_cmp = 0;
+    if (rtree->num_levels > 0) {
+        nearest_node(rtree, rtree->num_levels - 1, 0, query, &nearest_dist,
+                     &nearest, num_cmp);
+    }
+    return nearest;
+}
+
+static void
+nearest_node(rtree_t *rtree, int level, int i, query_t *query,
+             double *nearest_dist, node_t **nearest, int *num_cmp) {
+    rnode_t *node = &rtree->levels[level][i];
+
+    if (level == 0) {
+        for (int c = node->first; c < node->first + node->count; c++) {
+            double dist;
+            *num_cmp += 1;
+            if (entry_matches(&rtree->entries[c], query, *nearest_dist,
+                              &dist)) {
+                *nearest_dist = dist;
+                *nearest = rtree->entries[c].node;
+            }
+        }
+        return;
+    }
+
+    /* Order the children by the distance to their bounding boxes */
+    int order[RTREE_FANOUT];
+    double dist[RTREE_FANOUT];
+    for (int c = 0; c < node->count; c++) {
+        int j = c;
+        double d = box_dist(&rtree->levels[level - 1][node->first + c],
+                            query->coordinates);
+        while (j > 0 && dist[j - 1] > d) {
+            dist[j] = dist[j - 1];
+            order[j] = order[j - 1];
+            j--;
+        }
+        dist[j] = d;
+        order[j] = node->first + c;
+    }
+    for (int c = 0; c < node->count && dist[c] <= *nearest_dist; c++) {
+        nearest_node(rtree, level - 1, order[c], query, nearest_dist,
+                     nearest, num_cmp);
+    }
+}
+
+static int
+rtree_radius(void *index, query_t *query, double radius, report_t report,
+             void *arg) {
+    rtree_t *rtree = index;
+    if (rtree->num_levels == 0) {
+        return 0;
+    }
+    return radius_node(rtree, rtree->num_levels - 1, 0, query, radius,
+                       report, arg);
+}
+
+/* Visit the children whose bounding boxes reach into the circle */
+static int
+radius_node(rtree_t *rtree, int level, int i, query_t *query, double radius,
+            report_t report, void *arg) {
+    rnode_t *node = &rtree->levels[level][i];
+    int num_cmp = 0;
+
+    for (int c = node->first; c < node->first + node->count; c++) {
+        num_cmp++;
+        if (level == 0) {
+            double dist;
+            if (entry_matches(&rtree->entries[c], query, radius, &dist)) {
+                report(rtree->entries[c].node, dist, arg);
+            }
+        } else if (box_dist(&rtree->levels[level - 1][c],
+                            query->coordinates) <= radius) {
+            num_cmp += radius_node(rtree, level - 1, c, query, radius,
+                                   report, arg);
+        }
+    }
+    return num_cmp;
+}
+
+static int
+rtree_range(void *index, query_t *query, double *lo, double *hi,
+            report_t report, void *arg) {
+    rtree_t *rtree = index;
+    if (rtree->num_levels == 0) {
+        return 0;
+    }
+    return range_node(rtree, rtree->num_levels - 1, 0, query, lo, hi,
+                      report, arg);
+}
+
+/* Visit the children whose bounding boxes overlap the rectangle */
+static int
+range_node(rtree_t *rtree, int level, int i, query_t *query, double *lo,
+           double *hi, report_t report, void *arg) {
+    rnode_t *node = &rtree->levels[level][i];
+    int num_cmp = 0;
+
+    for (int c = node->first; c < node->first + node->count; c++) {
+        num_cmp++;
+        if (level == 0) {
+            entry_t *entry = &rtree->entries[c];
+            double *point = entry->coordinates;
+            double dist;
+            if (point[0] >= lo[0] && point[0] <= hi[0] &&
+                point[1] >= lo[1] && point[1] <= hi[1] &&
+                entry_matches(entry, query, INFINITY, &dist)) {
+                report(entry->node, dist, arg);
+            }
+        } else {
+            rnode_t *child = &rtree->levels[level - 1][c];
+            if (child->lo[0] <= hi[0] && child->hi[0] >= lo[0] &&
+                child->lo[1] <= hi[1] && child->hi[1] >= lo[1]) {
+                num_cmp += range_node(rtree, level - 1, c, query, lo, hi,
+                                      report, arg);
+            }
+        }
+    }
+    return num_cmp;
+}
+
+static size_t
+rtree_memory(void *index) {
+    rtree_t *rtree = index;
+    size_t bytes = sizeof(rtree_t) + sizeof(entry_t) * rtree->num_entries +
+                   (sizeof(rnode_t *) + sizeof(int)) * rtree->num_levels;
+    for (int level = 0; level < rtree->num_levels; level++) {
+        bytes += sizeof(rnode_t) * rtree->level_size[level];
+    }
+    return bytes;
+}
+
+/* The shape of a packed R-tree depends only on its number of entries */
+static size_t
+rtree_estimate(int num_locations, const double *lo, const double *hi) {
+    size_t bytes = sizeof(rtree_t) + sizeof(entry_t) * num_locations;
+    int num_items = num_locations;
+    while (num_items > 0) {
+        int num_nodes = (num_items + RTREE_FANOUT - 1) / RTREE_FANOUT;
+        bytes += sizeof(rnode_t *) + sizeof(int) + sizeof(rnode_t) * num_nodes;
+        if (num_nodes == 1) {
+            break;
+        }
+        num_items = num_nodes;
+    }
+    return bytes;
+}
+
+static void
+rtree_free(void *index) {
+    rtree_t *rtree = index;
+    for (int level = 0; level < rtree->num_levels; level++) {
+        free(rtree->levels[level]);
+    }
+    free(rtree->levels);
+    free(rtree->level_size);
+    free(rtree->entries);
+    free(rtree);
+}
@@ -7,36 +7,46 @@
 
 #include "search.h"
 
-/* Search the dictionary based on the key coordinates given and output the 
-    results into the output file specified by the user */
-int
-search_coordinate(tree_t *tree, const char* outputfile, char **key) {
-    double *search_coordinates;
-    int num_cmp;
-    
-    if ((search_coordinates = get_coordinate(key)) != NULL) {
-        /* Traverse the KD tree to search for matching key strings */
-        num_cmp = traverse_search_tree(tree, *key, search_coordinates, 
-                    outputfile);
-        
-        /* Add a newline after searching a key */
-        FILE *fp = fopen(outputfile, "a");
-        if (!fp) {
-            fprintf(stderr, "Error appending to file '%s'\n", outputfile);
-            exit(EXIT_FAILURE);
-        }
-        fprintf(fp, "\n");
-        fclose(fp);
-        
-        free(search_coordinates);
-        return num_cmp;
-    }
-    
-    return 0;
-}
+#define BOX_OUTSIDE 0                    /* box and polygon are disjoint */
+#define BOX_INSIDE 1                     /* box lies inside the polygon */
+#define BOX_STRADDLING 2                 /* an edge meets the box */
+
+/* Subtree (record NULL) or record waiting in the queue of a
+    distance-ordered search, keyed by its distance, then its id */
+typedef struct {
+    double dist;                         /* closest a subtree can be */
+    int id;                              /* -1 for a subtree */
+    node_t *node;
+    record_t *record;
+} waiting_t;
+
+/* Queue of a distance-ordered search, as a binary heap */
+typedef struct {
+    waiting_t *entries;
+    int num_entries;
+    int max_entries;
+} queue_t;
+
+static void push_waiting(queue_t *queue, double dist, int id, node_t *node,
+                         record_t *record);
+static waiting_t pop_waiting(queue_t *queue);
+static int waits_less(const waiting_t *a, const waiting_t *b);
+static void push_subtree(queue_t *queue, node_t *node, query_t *query,
+                         double radius, cursor_t *cursor);
+static int after_cursor(const cursor_t *cursor, double dist, int id);
+static int recursive_polygon_search(node_t *root, query_t *query,
+                                    polygon_t *polygon, int within,
+                                    report_t report, void *arg);
+static void report_subtree(node_t *root, report_t report, void *arg);
+static int classify_box(const polygon_t *polygon, const double *lo,
+                        const double *hi);
+static int segment_meets_box(const double *a, const double *b,
+                             const double *lo, const double *hi);
 
-/* Obtain the key coordinates input by the user and clean them */
-double
+/* Obtain the key coordinates input by the user and clean them. The key
+    holds the coordinates on the metric axes, optionally followed by the
+    range of each attribute axis */
+query_t
 *get_coordinate(char **key) {
     char *search_key = NULL;
     size_t lineBufferLength = 0;
@@ -52,65 +62,21 @@ double
     /* Create a duplicate string of search key for output later */
     *key = duplicate_string(search_key);
     
-    double *search_coordinates = (double *) malloc(sizeof(double) * DIMENSION);
-    assert(search_coordinates != NULL);
+    query_t *query = (query_t *) malloc(sizeof(query_t));
+    assert(query != NULL);
     
-    int i = 0, j = 0;
-    char *tmp = search_key;
+    double values[KEY_LENGTH];
+    int num_values = parse_key(search_key, values, KEY_LENGTH);
+    fill_query(query, values, num_values, 0);
     
-    /* Tokenize the search coordinate using <space> as delimiter */
-    while ((search_key[j] != ' ')) {
-        j++;
-    }
-    search_key[j] = '\0';
-    /* Convert the coordinate read into float */
-    search_coordinates[0] = atof(search_key);
-    
-    /* Proceed to the next (aka the last) coordinate */
-    i = j + 1;
-    search_key += i;
-
-    while (search_key[j] != '\n' && search_key[j] != '\0' 
-            && search_key[j] != EOF) {
-        j++;
-    }
-    search_key[j] = '\0';
-    search_coordinates[1] = atof(search_key);
-    
-    free(tmp);
-    return search_coordinates;
-}
-
-/* Search the dictionary based on the coordinate and radius given and 
-   output the results into the output file specified by the user */
-int
-search_coordinate_radius(tree_t *tree, const char* outputfile, char **key) {
-    double *search_coordinate;
-    double radius;
-    int num_cmp;
-    
-    if ((search_coordinate = get_coordinate_radius(&radius, key)) != NULL) {
-        /* Traverse the KD Tree to search for matching key strings */
-        num_cmp = traverse_radius_search(tree, search_coordinate, *key, radius, 
-                                outputfile);
-        
-        /* Add a newline in the output file after searching a key */
-        FILE *fp = fopen(outputfile, "a");
-        if(!fp) {
-            fprintf(stderr, "Error appending to file '%s'\n", outputfile);
-            exit(EXIT_FAILURE);
-        }
-        fprintf(fp, "\n");
-        fclose(fp);
-        
-        free(search_coordinate);
-        return num_cmp;
-    }
-    return 0;
+    free(search_key);
+    return query;
 }
 
-/* Obtain the coordinates and radius input by the user and clean them */
-double
+/* Obtain the coordinates and radius input by the user and clean them. The
+    radius follows the coordinates on the metric axes and may be followed
+    by the range of each attribute axis */
+query_t
 *get_coordinate_radius(double *radius, char **key) {
     char *search_key = NULL;
     size_t lineBufferLength = 0;
@@ -126,281 +92,722 @@ double
     /* Create a duplicate string of search key for output later */
     *key = duplicate_string(search_key);
     
-    double *search_coordinates = (double *) malloc(sizeof(double) * DIMENSION);
-    assert(search_coordinates != NULL);
+    query_t *query = (query_t *) malloc(sizeof(query_t));
+    assert(query != NULL);
     
-    int i = 0, j = 0;
-    int coordinate_recorded = 0;
-    int curr_coordinate = 0;
-    /* Temporary pointer to the search key to be freed later */
-    char *tmp = search_key;
+    double values[KEY_LENGTH + 1];
+    int num_values = parse_key(search_key, values, KEY_LENGTH + 1);
     
-    /* Tokenize using <space> as delimiter and record the coordinates given
-        as float */
-    while (coordinate_recorded < DIMENSION) {
-        while (search_key[j] != ' ') {
-            j++;
+    /* Record the input after the coordinates as the radius */
+    *radius = values[METRIC_DIMENSION];
+    fill_query(query, values, num_values, 1);
+
+    free(search_key);
+    
+    return query;
+}
+
+/* Convert up to max_values numbers separated by <space> in the key into
+    floats, returning the number of values read */
+int
+parse_key(char *search_key, double *values, int max_values) {
+    int num_values = 0;
+    char *end;
+    
+    while (num_values < max_values) {
+        values[num_values] = strtod(search_key, &end);
+        if (end == search_key) {
+            break;
         }
-        search_key[j] = '\0';
-        search_coordinates[curr_coordinate++] = atof(search_key);
-        
-        i = j + 1;
-        search_key += i;
-        
-        coordinate_recorded++;
+        num_values++;
+        search_key = end;
     }
     
-    /* Record the last input as the radius */
-    *radius = atof(search_key);
-
-    free(tmp);
+    /* Missing values are read as zero like atof */
+    for (int i = num_values; i < max_values; i++) {
+        values[i] = 0;
+    }
     
-    return search_coordinates;
+    return num_values;
 }
 
-/* Traverse the KD tree and find the nearest point to the given input 
-    coordinate */
-int
-traverse_search_tree(tree_t *tree, char *key, double *coordinates, 
-                     const char *outputfile) {
+/* Record the values parsed from a key into the query, skipping the
+    given number of values after the metric coordinates. Attribute axes
+    without a range accept any value */
+void
+fill_query(query_t *query, double *values, int num_values, int skip) {
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        query->coordinates[d] = values[d];
+    }
+    for (int d = METRIC_DIMENSION; d < DIMENSION; d++) {
+        int i = skip + METRIC_DIMENSION + 2 * (d - METRIC_DIMENSION);
+        if (i + 1 < num_values) {
+            query->lo[d] = values[i];
+            query->hi[d] = values[i + 1];
+        } else {
+            query->lo[d] = -INFINITY;
+            query->hi[d] = INFINITY;
+        }
+    }
+}
+
+/* Find the nearest point to the key coordinate, or NULL if no point lies
+    within the attribute ranges */
+node_t
+*nearest_search(tree_t *tree, query_t *query, int *num_cmp,
+                approx_t *approx) {
 	assert(tree != NULL);
-    int num_cmp = 0;
-    node_t *root = tree->root;
-    double *root_coordinates = ((record_t*)((root->data)->data))->coordinates;
-    /* Initialise the nearest distance with the distance between the key
-        coordinate and the root coordinate */
-    double nearest_dist = calc_dist(root_coordinates[0], root_coordinates[1],
-                                    coordinates[0], coordinates[1]);
+    *num_cmp = 0;
+    /* The first point visited becomes the nearest point so far */
+    double nearest_dist = INFINITY;
     node_t *nearest_node = NULL;
     
-	recursive_traverse_search(tree->root, coordinates, &nearest_dist,
-                              &nearest_node, &num_cmp, 0);
+    if (approx != NULL) {
+        /* Nothing has been skipped yet */
+        approx->pruned_dist = INFINITY;
+        approx->budget_hit = 0;
+    }
     
-    /* Traverse the linked-list if theres any in the node and print
-        all the stores at the coordinate */
-    if (nearest_node != NULL) {
-        linknode_t *curr = nearest_node->data;
-        while (curr != NULL) {
-            append_output(outputfile, curr, key);
-            curr = curr->next;
-        }
+	recursive_traverse_search(tree->root, query, &nearest_dist,
+                              &nearest_node, num_cmp, 0, approx);
+    
+    if (approx != NULL) {
+        /* The answer is exact if every skipped subtree lies no closer than
+            the point found and the budget did not cut the search short */
+        approx->exact = !approx->budget_hit && 
+                        approx->pruned_dist >= nearest_dist;
     }
-    return num_cmp;
+    
+    return nearest_node;
 }
 
 /* Recursively traverse the KD tree to find the nearest point to the key 
     coordinate */
 void
-recursive_traverse_search(node_t *root, double *key_coordinate, 
+recursive_traverse_search(node_t *root, query_t *query, 
                           double *nearest_dist, node_t **nearest_node, 
-                          int *num_cmp, unsigned depth) {
+                          int *num_cmp, unsigned depth, approx_t *approx) {
 	if (root) {
+        if (approx != NULL && approx->node_budget > 0 && 
+            *num_cmp >= approx->node_budget) {
+            /* Out of budget, settle for the nearest point found so far */
+            approx->budget_hit = 1;
+            return;
+        }
         *num_cmp += 1;
         
-        double *coordinates = ((record_t*)((root->data)->data))->coordinates;
-        double eud_dist = calc_dist(coordinates[0], coordinates[1], 
-                                    key_coordinate[0], key_coordinate[1]);
+        double *coordinates = root->group.records->coordinates;
+        double eud_dist = calc_dist(coordinates, query->coordinates);
         /* Level indicates the dimension to compare based on the current
             depth of the node */
         unsigned level = depth % DIMENSION;
-        /* Compares the position of the coordinates and the key coordinates
-            based on the level of the node in the tree */
-        double dim_dist = coordinates[level] - key_coordinate[level];
         
-        if (eud_dist <= *nearest_dist) {
+        if (eud_dist <= *nearest_dist && in_range(coordinates, query)) {
             *nearest_dist = eud_dist;
             *nearest_node = root;
         }
         
-        if (dim_dist > 0) {
-            /* Positive dim_dist indicates the current coordinate is to the 
-                right of the key coordinate so search the left child instead */
-            recursive_traverse_search(root->left, key_coordinate, nearest_dist,
-                                      nearest_node, num_cmp, depth + 1);
-            
-            if (fabs(dim_dist) < *nearest_dist) {
-                /* However, if the current coordinate lies inside the radius of
-                    the nearest distance, search right child as well */
-                recursive_traverse_search(root->rght, key_coordinate, 
-                                          nearest_dist, nearest_node, 
-                                          num_cmp, depth + 1);
+        if (DIMENSION > METRIC_DIMENSION && level >= METRIC_DIMENSION) {
+            /* On an attribute axis only search the children that can hold
+                values inside the range */
+            if (coordinates[level] > query->lo[level]) {
+                recursive_traverse_search(root->left, query, nearest_dist,
+                                          nearest_node, num_cmp, depth + 1,
+                                          approx);
             }
-        } else {
-            /* Similar to the previous case but in opposite direction */
-            recursive_traverse_search(root->rght, key_coordinate, nearest_dist,
-                                      nearest_node, num_cmp, depth + 1);
-            
-            if (fabs(dim_dist) < *nearest_dist) {
-                recursive_traverse_search(root->left, key_coordinate, 
-                                          nearest_dist, nearest_node,
-                                          num_cmp, depth + 1);
+            if (coordinates[level] <= query->hi[level]) {
+                recursive_traverse_search(root->rght, query, nearest_dist,
+                                          nearest_node, num_cmp, depth + 1,
+                                          approx);
+            }
+            return;
+        }
+        
+        /* Compares the position of the coordinates and the key coordinates
+            based on the level of the node in the tree */
+        double dim_dist = coordinates[level] - query->coordinates[level];
+        
+        /* Positive dim_dist indicates the current coordinate is to the 
+            right of the key coordinate so search the left child first, 
+            otherwise search the right child first */
+        node_t *near = (dim_dist > 0) ? root->left : root->rght;
+        node_t *far = (dim_dist > 0) ? root->rght : root->left;
+        
+        recursive_traverse_search(near, query, nearest_dist,
+                                  nearest_node, num_cmp, depth + 1, approx);
+        
+        if (fabs(dim_dist) < *nearest_dist) {
+            /* However, if the current coordinate lies inside the radius of
+                the nearest distance, search the other child as well. In
+                approximate mode the other child is skipped when nothing in
+                it can beat the nearest distance by more than epsilon */
+            if (approx != NULL && 
+                fabs(dim_dist) * (1 + approx->epsilon) >= *nearest_dist) {
+                if (fabs(dim_dist) < approx->pruned_dist) {
+                    approx->pruned_dist = fabs(dim_dist);
+                }
+            } else {
+                recursive_traverse_search(far, query, nearest_dist,
+                                          nearest_node, num_cmp, depth + 1,
+                                          approx);
             }
         }
     }
 }
 
-/* Traverse the KD tree and find points within the radius of the given input 
-    coordinate */
-int
-traverse_radius_search(tree_t *tree, double *coordinates, char *key, 
-                       double radius, const char *outputfile) {
-	assert(tree != NULL);
-    int num_cmp = 0;
-    /* Flag to indicate if any points are found */
-    int found_flag = 0;
-    
-	num_cmp += recursive_radius_search(tree->root, coordinates, key, radius,
-                                          &found_flag, outputfile, 0);
-    
-    if (found_flag == 0) {
-        append_radius_fail(outputfile, key);
-    }
-    
-    return num_cmp;
-}
-
 /* Recursively traverse the KD tree to find points within radius distance to
-    the key coordinate */
+    the key coordinate, reporting each point found */
 int
-recursive_radius_search(node_t *root, double *key_coordinate, char *key, 
-                        double radius, int *found_flag, const char *outputfile, 
-                        unsigned depth) {
+recursive_radius_search(node_t *root, query_t *query, double radius,
+                        report_t report, void *arg, unsigned depth) {
 	if (root) {
-        double *coordinates = ((record_t*)((root->data)->data))->coordinates;
-        double eud_dist = calc_dist(coordinates[0], coordinates[1],
-                                    key_coordinate[0], key_coordinate[1]);
+        double *coordinates = root->group.records->coordinates;
+        double eud_dist = calc_dist(coordinates, query->coordinates);
         /* Level indicates the dimension to compare based on the current
             depth of the node */
         unsigned level = depth % DIMENSION;
-        /* Compares the position of the coordinates and the key coordinates
-            based on the level of the node in the tree */
-        double dim_dist = coordinates[level] - key_coordinate[level];
                                     
-        if (eud_dist <= radius) {
-            append_radius_output(outputfile, root, key);
-            *found_flag += 1;
+        if (eud_dist <= radius && in_range(coordinates, query)) {
+            report(root, eud_dist, arg);
+        }
+        
+        if (DIMENSION > METRIC_DIMENSION && level >= METRIC_DIMENSION) {
+            /* On an attribute axis only search the children that can hold
+                values inside the range */
+            int num_cmp = 1;
+            if (coordinates[level] > query->lo[level]) {
+                num_cmp += recursive_radius_search(root->left, query, radius,
+                                                   report, arg, depth + 1);
+            }
+            if (coordinates[level] <= query->hi[level]) {
+                num_cmp += recursive_radius_search(root->rght, query, radius,
+                                                   report, arg, depth + 1);
+            }
+            return num_cmp;
         }
         
+        /* Compares the position of the coordinates and the key coordinates
+            based on the level of the node in the tree */
+        double dim_dist = coordinates[level] - query->coordinates[level];
+        
         /* If current node lies inside the radius, search both child of
             the node */
         if (fabs(dim_dist) <= radius) {
-            return recursive_radius_search(root->left, key_coordinate, key,
-                                           radius, found_flag, outputfile, 
-                                           depth + 1) +
-                recursive_radius_search(root->rght, key_coordinate, key, 
-                                        radius, found_flag, outputfile, 
-                                        depth + 1) + 1;
+            return recursive_radius_search(root->left, query, radius,
+                                           report, arg, depth + 1) +
+                recursive_radius_search(root->rght, query, radius,
+                                        report, arg, depth + 1) + 1;
             
         } else if (dim_dist > 0) {
             /* Otherwise check if the node lies to the right of the key
                 coordinate, if so search left child instead */
-            return recursive_radius_search(root->left, key_coordinate, key,
-                                           radius, found_flag, outputfile, 
-                                           depth + 1) + 1;
+            return recursive_radius_search(root->left, query, radius,
+                                           report, arg, depth + 1) + 1;
             
         } else {
             /* If not, search right child */
-            return recursive_radius_search(root->rght, key_coordinate, key,
-                                           radius, found_flag, outputfile,
-                                           depth + 1) + 1;
+            return recursive_radius_search(root->rght, query, radius,
+                                           report, arg, depth + 1) + 1;
         }
         
     }
     return 0;
 }
 
+/* Recursively traverse the KD tree to find points inside the rectangle
+    [lo, hi] on the metric axes, reporting each point found */
+int
+recursive_range_search(node_t *root, query_t *query, double *lo, double *hi,
+                       report_t report, void *arg, unsigned depth) {
+	if (root) {
+        double *coordinates = root->group.records->coordinates;
+        unsigned level = depth % DIMENSION;
+        int num_cmp = 1;
+        
+        if (coordinates[0] >= lo[0] && coordinates[0] <= hi[0] &&
+            coordinates[1] >= lo[1] && coordinates[1] <= hi[1] &&
+            in_range(coordinates, query)) {
+            report(root, calc_dist(coordinates, query->coordinates), arg);
+        }
+        
+        /* Only search the children that can hold values inside the
+            rectangle (or the attribute range) on this axis */
+        double min = (level < METRIC_DIMENSION) ? lo[level] : query->lo[level];
+        double max = (level < METRIC_DIMENSION) ? hi[level] : query->hi[level];
+        if (coordinates[level] > min) {
+            num_cmp += recursive_range_search(root->left, query, lo, hi,
+                                              report, arg, depth + 1);
+        }
+        if (coordinates[level] <= max) {
+            num_cmp += recursive_range_search(root->rght, query, lo, hi,
+                                              report, arg, depth + 1);
+        }
+        return num_cmp;
+    }
+    return 0;
+}
 
-/* Calculate the euclidean distance between two points on a cartesian plane */
-double calc_dist(double root_x, double root_y, double key_x, double key_y) {
-    double dist;
-    dist = sqrt(pow(root_x - key_x, 2) + pow(root_y - key_y, 2));
-    return dist;
+/* Obtain a radius key for a page of distance-ordered results: the
+    coordinates, radius and optional attribute ranges, then optionally an
+    '@' followed by the distance and id of a cursor to continue after */
+query_t
+*get_page_key(double *radius, cursor_t *cursor, char **key) {
+    char *search_key = NULL;
+    size_t lineBufferLength = 0;
+    /* Flag to check if a line is read */
+    ssize_t read_flag;
+    
+    if ((read_flag = getline(&search_key, &lineBufferLength, stdin)) == -1) {
+        /* No key is found */
+        free(search_key);
+        return NULL;
+    }
+    
+    /* Create a duplicate string of search key for output later */
+    *key = duplicate_string(search_key);
+    
+    query_t *query = (query_t *) malloc(sizeof(query_t));
+    assert(query != NULL);
+    
+    /* Split the cursor from the search key */
+    memset(cursor, 0, sizeof(*cursor));
+    char *token = strchr(search_key, '@');
+    if (token != NULL) {
+        *token++ = '\0';
+        double values[2];
+        if (parse_key(token, values, 2) == 2) {
+            cursor->dist = values[0];
+            cursor->id = (int) values[1];
+            cursor->started = 1;
+        }
+    }
+    
+    double values[KEY_LENGTH + 1];
+    int num_values = parse_key(search_key, values, KEY_LENGTH + 1);
+    *radius = values[METRIC_DIMENSION];
+    fill_query(query, values, num_values, 1);
+    
+    free(search_key);
+    return query;
 }
 
-/* Append the information of the nearest point to key coordinate into the 
-    outputfile */
-void 
-append_output(const char *outputfile, linknode_t *node, char *key) {
-    FILE *fp = fopen(outputfile, "a");
-    if (!fp) {
-        fprintf(stderr, "Error appending to file '%s'\n", outputfile);
-        exit(EXIT_FAILURE);
-    }
-    
-    linknode_t *curr = node;
-    fprintf(fp, "%s --> Census year: %d || Block ID: %d || Property ID: %d "
-                "|| Base property ID: %d || CLUE small area: %s || "
-                "Trading Name: %s || Industry (ANZSIC4) code: %d || "
-                "Industry (ANZSIC4) description: %s || "
-                "x coordinate: %.4lf || y coordinate: %.4lf || "
-                "Location: %s || \n",
-            key, ((record_t*)(curr->data))->census_yr,
-            ((record_t*)(curr->data))->block_id,
-            ((record_t*)(curr->data))->property_id,
-            ((record_t*)(curr->data))->base_prop_id,
-            ((record_t*)(curr->data))->city_area_name,
-            ((record_t*)(curr->data))->trade_name,
-            ((record_t*)(curr->data))->industry_code,
-            ((record_t*)(curr->data))->industry_desc,
-            (((record_t*)(curr->data))->coordinates)[0],
-            (((record_t*)(curr->data))->coordinates)[1],
-            ((record_t*)(curr->data))->location);
-    
-    fflush(fp);
-    fclose(fp);
+/* Find the records within radius distance of the key in order of
+    distance, then id, storing the limit records that follow the cursor
+    into the result set. The first offset records are skipped on the first
+    page only: a cursor already marks where its page starts. Subtrees and
+    records are taken best first from a queue keyed by their distance, so
+    the search stops as soon as the page is full, and subtrees lying
+    wholly before the cursor are skipped from their summary. The cursor
+    moves to the end of the page once it fits the result set, so a search
+    repeated with a larger buffer returns the same page. Returns the number
+    of nodes visited */
+int
+ordered_radius_search(tree_t *tree, query_t *query, double radius,
+                      int offset, int limit, cursor_t *cursor,
+                      result_set_t *set) {
+    assert(tree != NULL);
+    queue_t queue = {NULL, 0, 0};
+    int num_cmp = 0, skipped = 0, more = 0;
+    waiting_t last = {0, 0, NULL, NULL};
+    if (cursor->started) {
+        offset = 0;
+    }
+    
+    push_subtree(&queue, tree->root, query, radius, cursor);
+    while (queue.num_entries > 0) {
+        waiting_t next = pop_waiting(&queue);
+        
+        if (next.record != NULL) {
+            /* Every record still waiting is further along */
+            if (skipped < offset) {
+                skipped++;
+            } else if (set->num_matches == limit) {
+                more = 1;
+                break;
+            } else {
+                if (set->num_results < set->capacity) {
+                    set->results[set->num_results].record = next.record;
+                    set->results[set->num_results].dist = next.dist;
+                    set->num_results++;
+                }
+                set->num_matches++;
+                last = next;
+            }
+            continue;
+        }
+        
+        node_t *node = next.node;
+        num_cmp++;
+        double *coordinates = node->group.records->coordinates;
+        double dist = calc_dist(coordinates, query->coordinates);
+        if (dist <= radius && in_range(coordinates, query)) {
+            for (int i = 0; i < node->group.num_records; i++) {
+                record_t *record = &node->group.records[i];
+                if (after_cursor(cursor, dist, record->id)) {
+                    push_waiting(&queue, dist, record->id, NULL, record);
+                }
+            }
+        }
+        push_subtree(&queue, node->left, query, radius, cursor);
+        push_subtree(&queue, node->rght, query, radius, cursor);
+    }
+    free(queue.entries);
+    
+    if (set->num_matches <= set->capacity) {
+        if (set->num_matches > 0) {
+            cursor->dist = last.dist;
+            cursor->id = last.id;
+            cursor->started = 1;
+        }
+        cursor->more = more;
+    }
+    return num_cmp;
 }
 
-/* Append the information of the points within radius distance from key 
-    coordinate into the outputfile */
-void 
-append_radius_output(const char *outputfile, node_t *node, char *key) {
-    FILE *fp = fopen(outputfile, "a");
-    if (!fp) {
-        fprintf(stderr, "Error appending to file '%s'\n", outputfile);
-        exit(EXIT_FAILURE);
-    }
-    
-    linknode_t *curr = node->data;
-    while (curr != NULL) {
-        fprintf(fp, "%s --> Census year: %d || Block ID: %d || "
-                    "Property ID: %d || Base property ID: %d || "
-                    "CLUE small area: %s || Trading Name: %s || " 
-                    "Industry (ANZSIC4) code: %d || "
-                    "Industry (ANZSIC4) description: %s || "
-                    "x coordinate: %.4lf || y coordinate: %.4lf || "
-                    "Location: %s || \n",
-                key, ((record_t*)(curr->data))->census_yr,
-                ((record_t*)(curr->data))->block_id,
-                ((record_t*)(curr->data))->property_id,
-                ((record_t*)(curr->data))->base_prop_id,
-                ((record_t*)(curr->data))->city_area_name,
-                ((record_t*)(curr->data))->trade_name,
-                ((record_t*)(curr->data))->industry_code,
-                ((record_t*)(curr->data))->industry_desc,
-                (((record_t*)(curr->data))->coordinates)[0],
-                (((record_t*)(curr->data))->coordinates)[1],
-                ((record_t*)(curr->data))->location);
+/* Queue a subtree unless its summary shows that it lies outside the
+    radius, outside an attribute range or wholly before the cursor */
+static void
+push_subtree(queue_t *queue, node_t *node, query_t *query, double radius,
+             cursor_t *cursor) {
+    if (node == NULL) {
+        return;
+    }
+    summary_t *summary = &node->summary;
+    
+    for (int d = METRIC_DIMENSION; d < DIMENSION; d++) {
+        if (summary->hi[d] < query->lo[d] || summary->lo[d] > query->hi[d]) {
+            return;
+        }
+    }
+    
+    /* Closest and furthest distances between the key and the box, computed
+        as calc_dist does so that a point on a corner is not lost */
+    double near[METRIC_DIMENSION], far[METRIC_DIMENSION];
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        double x = query->coordinates[d];
+        near[d] = (x < summary->lo[d]) ? summary->lo[d] - x :
+                  (x > summary->hi[d]) ? x - summary->hi[d] : 0;
+        far[d] = fmax(fabs(x - summary->lo[d]), fabs(x - summary->hi[d]));
+    }
+    double min_dist = sqrt(near[0] * near[0] + near[1] * near[1]);
+    double max_dist = sqrt(far[0] * far[0] + far[1] * far[1]);
+    
+    if (min_dist > radius ||
+        (cursor->started && max_dist < cursor->dist)) {
+        return;
+    }
+    push_waiting(queue, min_dist, -1, node, NULL);
+}
+
+/* Check if a record at the given distance comes after the cursor */
+static int
+after_cursor(const cursor_t *cursor, double dist, int id) {
+    return !cursor->started || dist > cursor->dist ||
+           (dist == cursor->dist && id > cursor->id);
+}
+
+static void
+push_waiting(queue_t *queue, double dist, int id, node_t *node,
+             record_t *record) {
+    if (queue->num_entries == queue->max_entries) {
+        queue->max_entries = queue->max_entries ? 2 * queue->max_entries : 64;
+        queue->entries = (waiting_t *) realloc(queue->entries,
+                                               sizeof(waiting_t) *
+                                               queue->max_entries);
+        assert(queue->entries != NULL);
+    }
+    
+    /* Sift the new entry up from the bottom of the heap */
+    waiting_t entry = {dist, id, node, record};
+    int i = queue->num_entries++;
+    while (i > 0 && waits_less(&entry, &queue->entries[(i - 1) / 2])) {
+        queue->entries[i] = queue->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->entries[i] = entry;
+}
+
+static waiting_t
+pop_waiting(queue_t *queue) {
+    waiting_t first = queue->entries[0];
+    waiting_t entry = queue->entries[--queue->num_entries];
+    
+    /* Sift the last entry down from the top of the heap */
+    int i = 0, child;
+    while ((child = 2 * i + 1) < queue->num_entries) {
+        if (child + 1 < queue->num_entries &&
+            waits_less(&queue->entries[child + 1], &queue->entries[child])) {
+            child++;
+        }
+        if (!waits_less(&queue->entries[child], &entry)) {
+            break;
+        }
+        queue->entries[i] = queue->entries[child];
+        i = child;
+    }
+    queue->entries[i] = entry;
+    return first;
+}
+
+/* Order entries by distance, then id, so that a subtree comes before any
+    record at its closest distance */
+static int
+waits_less(const waiting_t *a, const waiting_t *b) {
+    return a->dist < b->dist || (a->dist == b->dist && a->id < b->id);
+}
+
+/* Start with an empty polygon */
+void
+init_polygon(polygon_t *polygon) {
+    memset(polygon, 0, sizeof(*polygon));
+}
+
+/* Obtain a polygon key input by the user: the x and y of each vertex in
+    order, then optionally a ';' followed by the range of each attribute
+    axis. The vertices are stored into the polygon, and a trailing x
+    without its y is ignored */
+query_t
+*get_polygon(polygon_t *polygon, char **key) {
+    char *search_key = NULL;
+    size_t lineBufferLength = 0;
+    /* Flag to check if a line is read */
+    ssize_t read_flag;
+    
+    if ((read_flag = getline(&search_key, &lineBufferLength, stdin)) == -1) {
+        /* No key is found */
+        free(search_key);
+        return NULL;
+    }
+    
+    /* Create a duplicate string of search key for output later */
+    *key = duplicate_string(search_key);
+    
+    query_t *query = (query_t *) malloc(sizeof(query_t));
+    assert(query != NULL);
+    
+    /* Split the attribute ranges from the vertices */
+    char *ranges = strchr(search_key, ';');
+    if (ranges != NULL) {
+        *ranges++ = '\0';
+    }
+    
+    polygon->num_vertices = 0;
+    char *start = search_key, *end;
+    while (1) {
+        double x = strtod(start, &end);
+        if (end == start) {
+            break;
+        }
+        double y = strtod(start = end, &end);
+        if (end == start) {
+            break;
+        }
+        start = end;
         
-        curr = curr->next;
+        if (polygon->num_vertices == polygon->max_vertices) {
+            polygon->max_vertices = polygon->max_vertices ?
+                                    2 * polygon->max_vertices : 16;
+            polygon->vertices = (double *) realloc(polygon->vertices,
+                                                   sizeof(double) *
+                                                   METRIC_DIMENSION *
+                                                   polygon->max_vertices);
+            assert(polygon->vertices != NULL);
+        }
+        double *vertex = &polygon->vertices[METRIC_DIMENSION *
+                                            polygon->num_vertices++];
+        vertex[0] = x;
+        vertex[1] = y;
+    }
+    
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        polygon->lo[d] = INFINITY;
+        polygon->hi[d] = -INFINITY;
+    }
+    for (int i = 0; i < polygon->num_vertices; i++) {
+        for (int d = 0; d < METRIC_DIMENSION; d++) {
+            double value = polygon->vertices[METRIC_DIMENSION * i + d];
+            polygon->lo[d] = fmin(polygon->lo[d], value);
+            polygon->hi[d] = fmax(polygon->hi[d], value);
+        }
+    }
+    
+    /* The key point of the query is the first vertex, if any */
+    double values[KEY_LENGTH] = {0};
+    int num_values = METRIC_DIMENSION;
+    if (polygon->num_vertices > 0) {
+        values[0] = polygon->vertices[0];
+        values[1] = polygon->vertices[1];
+    }
+    if (ranges != NULL) {
+        num_values += parse_key(ranges, values + METRIC_DIMENSION,
+                                KEY_LENGTH - METRIC_DIMENSION);
+    }
+    fill_query(query, values, num_values, 0);
+    
+    free(search_key);
+    return query;
+}
+
+/* Find the points inside the polygon (and the attribute ranges of the
+    query), reporting each point found at distance 0. Subtrees are
+    classified against the polygon from their summaries: those outside it
+    are skipped, those inside it are reported without testing their
+    points, and only those straddling an edge have their points tested.
+    Returns the number of nodes tested, a subtree reported as a whole
+    counting once */
+int
+polygon_search(tree_t *tree, query_t *query, polygon_t *polygon,
+               report_t report, void *arg) {
+    assert(tree != NULL);
+    if (polygon->num_vertices < 3) {
+        /* Nothing lies inside a polygon without an area */
+        return 0;
+    }
+    return recursive_polygon_search(tree->root, query, polygon, 0, report,
+                                    arg);
+}
+
+/* Search a subtree, within being set once an ancestor was found to lie
+    inside the polygon */
+static int
+recursive_polygon_search(node_t *root, query_t *query, polygon_t *polygon,
+                         int within, report_t report, void *arg) {
+    if (root == NULL) {
+        return 0;
+    }
+    summary_t *summary = &root->summary;
+    
+    /* Skip subtrees lying outside an attribute range */
+    int inside = 1;
+    for (int d = METRIC_DIMENSION; d < DIMENSION; d++) {
+        if (summary->hi[d] < query->lo[d] || summary->lo[d] > query->hi[d]) {
+            return 1;
+        }
+        inside &= summary->lo[d] >= query->lo[d] &&
+                  summary->hi[d] <= query->hi[d];
+    }
+    
+    if (!within) {
+        int where = classify_box(polygon, summary->lo, summary->hi);
+        if (where == BOX_OUTSIDE) {
+            return 1;
+        }
+        within = (where == BOX_INSIDE);
+    }
+    if (within && inside) {
+        report_subtree(root, report, arg);
+        return 1;
+    }
+    
+    double *coordinates = root->group.records->coordinates;
+    if (in_range(coordinates, query) &&
+        (within || in_polygon(polygon, coordinates))) {
+        report(root, 0, arg);
     }
     
-    fflush(fp);
-    fclose(fp);
+    return 1 + recursive_polygon_search(root->left, query, polygon, within,
+                                        report, arg) +
+           recursive_polygon_search(root->rght, query, polygon, within,
+                                    report, arg);
+}
+
+/* Report every point of a subtree */
+static void
+report_subtree(node_t *root, report_t report, void *arg) {
+    while (root != NULL) {
+        report(root, 0, arg);
+        report_subtree(root->left, report, arg);
+        root = root->rght;
+    }
+}
+
+/* Check if a point lies inside the polygon by counting the edges crossed
+    by a ray from the point towards increasing x. A point exactly on an
+    edge may fall on either side */
+int
+in_polygon(const polygon_t *polygon, const double *point) {
+    const double *vertices = polygon->vertices;
+    int n = polygon->num_vertices;
+    int inside = 0;
+    
+    for (int i = 0, j = n - 1; i < n; j = i++) {
+        const double *a = &vertices[METRIC_DIMENSION * i];
+        const double *b = &vertices[METRIC_DIMENSION * j];
+        if ((a[1] > point[1]) != (b[1] > point[1]) &&
+            point[0] < (b[0] - a[0]) * (point[1] - a[1]) / (b[1] - a[1]) +
+                       a[0]) {
+            inside = !inside;
+        }
+    }
+    return inside;
 }
 
-/* Append the failed search result into the outputfile */
-void 
-append_radius_fail(const char *outputfile, char *key) {
-    FILE *fp = fopen(outputfile, "a");
-    if (!fp) {
-        fprintf(stderr, "Error appending to file '%s'\n", outputfile);
-        exit(EXIT_FAILURE);
+/* Classify the box [lo, hi] against the polygon. A box met by no edge
+    lies either wholly inside or wholly outside, which its centre decides */
+static int
+classify_box(const polygon_t *polygon, const double *lo, const double *hi) {
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        if (hi[d] < polygon->lo[d] || lo[d] > polygon->hi[d]) {
+            return BOX_OUTSIDE;
+        }
+    }
+    
+    int n = polygon->num_vertices;
+    for (int i = 0, j = n - 1; i < n; j = i++) {
+        if (segment_meets_box(&polygon->vertices[METRIC_DIMENSION * i],
+                              &polygon->vertices[METRIC_DIMENSION * j],
+                              lo, hi)) {
+            return BOX_STRADDLING;
+        }
     }
     
-    fprintf(fp, "%s --> NOTFOUND\n", key);
+    double centre[METRIC_DIMENSION] = {(lo[0] + hi[0]) / 2,
+                                       (lo[1] + hi[1]) / 2};
+    return in_polygon(polygon, centre) ? BOX_INSIDE : BOX_OUTSIDE;
+}
+
+/* Check if the segment ab meets the box [lo, hi], edges included, by
+    clipping the segment to the box one axis at a time */
+static int
+segment_meets_box(const double *a, const double *b, const double *lo,
+                  const double *hi) {
+    double enter = 0, leave = 1;
     
-    fflush(fp);
-    fclose(fp);
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        double delta = b[d] - a[d];
+        if (delta == 0) {
+            if (a[d] < lo[d] || a[d] > hi[d]) {
+                return 0;
+            }
+            continue;
+        }
+        double t0 = (lo[d] - a[d]) / delta;
+        double t1 = (hi[d] - a[d]) / delta;
+        enter = fmax(enter, fmin(t0, t1));
+        leave = fmin(leave, fmax(t0, t1));
+        if (enter > leave) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void
+free_polygon(polygon_t *polygon) {
+    assert(polygon != NULL);
+    free(polygon->vertices);
+}
+
+/* Append every record of a result set into the output, or the failed
+    search result if there is none */
+void
+append_results(output_t *out, char *key, result_set_t *set) {
+    if (set->num_results == 0) {
+        write_notfound(out, key);
+    }
+    for (int i = 0; i < set->num_results; i++) {
+        write_record(out, key, set->results[i].record);
+    }
 }
 
 /* Create a duplicate string without newline */
@@ -8,26 +8,126 @@
 #include <string.h>
 #include "kdtree.h"
 #include "csvparser.h"
+#include "output.h"
+
+#define KEY_LENGTH (METRIC_DIMENSION + 2 * (DIMENSION - METRIC_DIMENSION))
+                                  /* max numbers in a key besides radius */
+
+/* Point and attribute ranges that a key searches for */
+typedef struct {
+    double coordinates[DIMENSION];  /* key point on the metric axes */
+    double lo[DIMENSION];           /* accepted range on each attribute */
+    double hi[DIMENSION];           /* axis, inclusive */
+} query_t;
+
+/* Record found by a search */
+typedef struct {
+    record_t *record;
+    double dist;                  /* from the key on the metric axes */
+} result_t;
+
+/* Results of one search, stored in a buffer provided by the caller */
+typedef struct {
+    result_t *results;
+    int capacity;                 /* results the buffer can hold */
+    int num_results;              /* results stored in the buffer */
+    int num_matches;              /* records found, which may be more than
+                                     the buffer holds */
+    int num_cmp;                  /* comparisons made by the search */
+    int exact;                    /* nearest searches: set if the answer is
+                                     provably the true nearest point */
+    int plan;                     /* radius searches: plan chosen */
+    int estimate;                 /* radius searches: locations expected */
+} result_set_t;
+
+/* Called with every point (location) a search finds and its distance */
+typedef void (*report_t)(node_t *node, double dist, void *arg);
+
+/* Settings and outcome of an approximate nearest neighbour search */
+typedef struct {
+    double epsilon;               /* answer may be up to (1 + epsilon) times
+                                     the true nearest distance */
+    int node_budget;              /* maximum nodes visited per search
+                                     (0 for no limit) */
+    double pruned_dist;           /* closest bound of any subtree skipped
+                                     because of the approximation */
+    int budget_hit;               /* set if the node budget cut the search */
+    int exact;                    /* set if the answer is provably the true
+                                     nearest point */
+} approx_t;
+
+/* Polygon searched by a polygon key, given by its vertices in order. Its
+    vertex array is reused from key to key */
+typedef struct {
+    double *vertices;             /* x and y of each vertex in turn */
+    int num_vertices;
+    int max_vertices;             /* vertices the array can hold */
+    double lo[METRIC_DIMENSION];  /* box bounding the polygon */
+    double hi[METRIC_DIMENSION];
+} polygon_t;
+
+/* Position in the distance-ordered records of a radius key, just after
+    the last record of a page. Records are ordered by distance, then by id,
+    and a zeroed cursor starts from the nearest record */
+typedef struct {
+    double dist;                  /* distance of the last record returned */
+    int id;                       /* and its id */
+    int started;                  /* set once a page has been returned */
+    int more;                     /* set while records remain after it */
+} cursor_t;
 
 /* prototypes for the functions in this library */
-int search_coordinate(tree_t *tree, const char* outputfile, char **key);
-double *get_coordinate(char **key);
-int search_coordinate_radius(tree_t *tree, const char* outputfile, char **key);
-double *get_coordinate_radius(double *radius, char **key);
-int traverse_search_tree(tree_t *tree, char *key, double *coordinates,
-                          const char *outputfile);
-void recursive_traverse_search(node_t *root, double *key_coordinates, 
+query_t *get_coordinate(char **key);
+query_t *get_coordinate_radius(double *radius, char **key);
+int parse_key(char *search_key, double *values, int max_values);
+void fill_query(query_t *query, double *values, int num_values, int skip);
+node_t *nearest_search(tree_t *tree, query_t *query, int *num_cmp,
+                       approx_t *approx);
+void recursive_traverse_search(node_t *root, query_t *query, 
                                double *min_diff, node_t **min_diff_found, 
-                               int *num_cmp, unsigned depth);
-int traverse_radius_search(tree_t *tree, double *coordinates, char *key, 
-                            double radius, const char *outputfile);
-int recursive_radius_search(node_t *root, double *key_coordinate, char *key,
-                            double radius, int *found_flag, const char *outputfile,
-                            unsigned depth);
-void append_output(const char *outputfile, linknode_t *node, char *key);
-void append_radius_output(const char *outputfile, node_t *node, char *key);
-void append_radius_fail(const char *outputfile, char *key);
-double calc_dist(double root_x, double root_y, double key_x, double key_y);
+                               int *num_cmp, unsigned depth, approx_t *approx);
+int recursive_radius_search(node_t *root, query_t *query, double radius,
+                            report_t report, void *arg, unsigned depth);
+int recursive_range_search(node_t *root, query_t *query, double *lo,
+                           double *hi, report_t report, void *arg,
+                           unsigned depth);
+query_t *get_page_key(double *radius, cursor_t *cursor, char **key);
+int ordered_radius_search(tree_t *tree, query_t *query, double radius,
+                          int offset, int limit, cursor_t *cursor,
+                          result_set_t *set);
+void init_polygon(polygon_t *polygon);
+query_t *get_polygon(polygon_t *polygon, char **key);
+int polygon_search(tree_t *tree, query_t *query, polygon_t *polygon,
+                   report_t report, void *arg);
+int in_polygon(const polygon_t *polygon, const double *point);
+void free_polygon(polygon_t *polygon);
+void append_results(output_t *out, char *key, result_set_t *set);
 char *duplicate_string(char *src);
 
+/* Calculate the euclidean distance between two points on the metric
+    axes */
+static inline double
+calc_dist(const double *a, const double *b) {
+    double dx = a[0] - b[0];
+    double dy = a[1] - b[1];
+    return sqrt(dx * dx + dy * dy);
+}
+
+/* Check if a point lies inside the attribute ranges of the query */
+static inline int
+in_range(const double *coordinates, const query_t *query) {
+#if DIMENSION == 2
+    return 1;
+#elif DIMENSION == 3
+    return coordinates[2] >= query->lo[2] && coordinates[2] <= query->hi[2];
+#else
+    for (int d = METRIC_DIMENSION; d < DIMENSION; d++) {
+        if (coordinates[d] < query->lo[d] || coordinates[d] > query->hi[d]) {
+            return 0;
+        }
+    }
+    return 1;
+#endif
+}
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,591 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+* This is the sharded mode of the search. The plane is split into regions at *
+* the median locations, each region is served by its own process over a     *
+* Unix socket, and a router sends every key only to the shards whose region *
+* can hold an answer, merging what they find into one result set            *
+* Developed by: Oliver Ming Hui Tan                                          *
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "shard.h"
+
+/* Record as sent by a shard, followed by its strings in the order of
+    lengths */
+typedef struct {
+    int id, census_yr, block_id, property_id, base_prop_id, industry_code;
+    double coordinates[DIMENSION];
+    double dist;
+    int lengths[4];                      /* trade name, location, city area
+                                            and industry, each with its
+                                            null byte */
+} wire_record_t;
+
+static void split_regions(double *locations, int num_locations,
+                          region_t region, unsigned depth, region_t *regions,
+                          int num_shards);
+static void select_coordinate(double *locations, int num_locations, int nth,
+                              int axis);
+static void swap_locations(double *a, double *b);
+static void shard_path(char *path, size_t size, int shard);
+static int listen_shard(const char *path);
+static int connect_shard(const char *path);
+static void run_shard(const char *filename, const engine_opts_t *opts,
+                      const region_t *region, int listen_fd);
+static double region_dist(const region_t *region, const double *coordinates);
+static void ask_shard(shard_t *shard, int type, query_t *query,
+                      double radius);
+static void hear_shard(shard_t *shard);
+static int encode_records(result_set_t *set, char **buffer, int *size);
+static void decode_records(cluster_t *cluster, shard_t *shard,
+                           result_set_t *set);
+static void reserve_records(cluster_t *cluster, int num_records);
+static void forget_records(cluster_t *cluster);
+static int read_fully(int fd, void *buffer, size_t length);
+static int write_fully(int fd, const void *buffer, size_t length);
+
+/* Split the dataset into num_shards regions and start a shard process
+    for each of them, exiting if the dataset cannot be read. Every shard
+    loads only the records of its region */
+cluster_t
+*start_cluster(const char *filename, int num_shards,
+               const engine_opts_t *opts) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening file '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    int num_locations;
+    double *locations = read_locations(fp, &num_locations);
+    fclose(fp);
+
+    if (num_shards < 1) {
+        num_shards = 1;
+    } else if (num_shards > MAX_SHARDS) {
+        num_shards = MAX_SHARDS;
+    }
+    cluster_t *cluster = (cluster_t *) malloc(sizeof(*cluster));
+    assert(cluster != NULL);
+    cluster->shards = (shard_t *) calloc(num_shards, sizeof(shard_t));
+    assert(cluster->shards != NULL);
+    cluster->num_shards = num_shards;
+    cluster->records = NULL;
+    cluster->num_records = cluster->max_records = 0;
+
+    region_t plane;
+    region_t regions[MAX_SHARDS];
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        plane.lo[d] = -INFINITY;
+        plane.hi[d] = INFINITY;
+    }
+    split_regions(locations, num_locations, plane, 0, regions, num_shards);
+    free(locations);
+
+    /* Every socket listens before any shard starts, so the shards can be
+        connected to while they are still loading */
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    int listen_fds[MAX_SHARDS];
+    for (int i = 0; i < num_shards; i++) {
+        shard_path(path, sizeof(path), i);
+        listen_fds[i] = listen_shard(path);
+    }
+
+    /* Nothing buffered may be written twice by the shards */
+    fflush(NULL);
+    for (int i = 0; i < num_shards; i++) {
+        shard_t *shard = &cluster->shards[i];
+        shard->region = regions[i];
+        if ((shard->pid = fork()) < 0) {
+            fprintf(stderr, "Error starting shard %d\n", i);
+            exit(EXIT_FAILURE);
+        } else if (shard->pid == 0) {
+            for (int j = 0; j < num_shards; j++) {
+                if (j != i) {
+                    close(listen_fds[j]);
+                }
+            }
+            run_shard(filename, opts, &shard->region, listen_fds[i]);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+        shard_path(path, sizeof(path), i);
+        cluster->shards[i].fd = connect_shard(path);
+        close(listen_fds[i]);
+        unlink(path);
+    }
+
+    return cluster;
+}
+
+/* Split the locations at the median of the axis of this depth, giving each
+    side as many shards as its share of the locations. Locations on the
+    split go right, as in the KD tree */
+static void
+split_regions(double *locations, int num_locations, region_t region,
+              unsigned depth, region_t *regions, int num_shards) {
+    if (num_shards == 1) {
+        regions[0] = region;
+        return;
+    }
+
+    int axis = depth % METRIC_DIMENSION;
+    int num_left = num_shards / 2;
+    double value = 0;
+    if (num_locations > 0) {
+        int nth = (int) ((long) num_locations * num_left / num_shards);
+        select_coordinate(locations, num_locations, nth, axis);
+        value = locations[nth * METRIC_DIMENSION + axis];
+    } else if (isfinite(region.lo[axis])) {
+        value = region.lo[axis];
+    } else if (isfinite(region.hi[axis])) {
+        value = region.hi[axis];
+    }
+
+    int split = 0;
+    for (int i = 0; i < num_locations; i++) {
+        if (locations[i * METRIC_DIMENSION + axis] < value) {
+            swap_locations(&locations[i * METRIC_DIMENSION],
+                           &locations[split++ * METRIC_DIMENSION]);
+        }
+    }
+
+    region_t left = region, rght = region;
+    left.hi[axis] = rght.lo[axis] = value;
+    split_regions(locations, split, left, depth + 1, regions, num_left);
+    split_regions(locations + split * METRIC_DIMENSION, num_locations - split,
+                  rght, depth + 1, regions + num_left, num_shards - num_left);
+}
+
+/* Serial quickselect of the nth location by one axis */
+static void
+select_coordinate(double *locations, int num_locations, int nth, int axis) {
+    int lo = 0, hi = num_locations - 1;
+
+    while (lo < hi) {
+        double pivot = locations[(lo + (hi - lo) / 2) * METRIC_DIMENSION +
+                                 axis];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (locations[i * METRIC_DIMENSION + axis] < pivot) {
+                i++;
+            }
+            while (locations[j * METRIC_DIMENSION + axis] > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                swap_locations(&locations[i++ * METRIC_DIMENSION],
+                               &locations[j-- * METRIC_DIMENSION]);
+            }
+        }
+
+        /* Continue only with the side holding the nth location */
+        if (nth <= j) {
+            hi = j;
+        } else if (nth >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+}
+
+static void
+swap_locations(double *a, double *b) {
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        double swap = a[d];
+        a[d] = b[d];
+        b[d] = swap;
+    }
+}
+
+static void
+shard_path(char *path, size_t size, int shard) {
+    snprintf(path, size, "%s.%d.%d", SHARD_PATH, (int) getpid(), shard);
+}
+
+static int
+listen_shard(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &address,
+                       sizeof(address)) != 0 || listen(fd, 1) != 0) {
+        fprintf(stderr, "Error listening on '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static int
+connect_shard(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address,
+                          sizeof(address)) != 0) {
+        fprintf(stderr, "Error connecting to '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/* Load the region of the dataset and answer the router until it closes
+    the connection. Runs in the shard process */
+static void
+run_shard(const char *filename, const engine_opts_t *opts,
+          const region_t *region, int listen_fd) {
+    engine_opts_t shard_opts = *opts;
+    shard_opts.region = region;
+    engine_t *engine = open_engine(filename, &shard_opts);
+
+    int fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    if (fd >= 0) {
+        serve_shard(engine, fd);
+        close(fd);
+    }
+    close_engine(engine);
+}
+
+/* Answer every search read from the connection, until it is closed */
+void
+serve_shard(engine_t *engine, int fd) {
+    shard_request_t request;
+    result_set_t set;
+    init_result_set(&set, NULL, 0);
+    char *buffer = NULL;
+    int size = 0;
+
+    while (read_fully(fd, &request, sizeof(request))) {
+        dataset_t *data = engine_enter(engine, 0);
+        if (request.type == SHARD_NEAREST) {
+            while (search_nearest(engine, data, &request.query, &set) >
+                   set.capacity) {
+                grow_result_set(&set);
+            }
+        } else {
+            while (search_radius(engine, data, &request.query,
+                                 request.radius, &set) > set.capacity) {
+                grow_result_set(&set);
+            }
+        }
+
+        shard_reply_t reply = {set.num_cmp, set.num_results, set.exact,
+                               set.plan, set.estimate, 0, INFINITY};
+        if (set.num_results > 0) {
+            reply.dist = set.results[0].dist;
+        }
+        reply.length = encode_records(&set, &buffer, &size);
+        engine_exit(engine, 0);
+
+        if (!write_fully(fd, &reply, sizeof(reply)) ||
+            !write_fully(fd, buffer, reply.length)) {
+            break;
+        }
+    }
+
+    free(buffer);
+    free(set.results);
+}
+
+/* Find every record at the nearest point to the key. Shards are asked in
+    order of the distance to their region, stopping at the first region
+    further than the nearest record found so far. The records found stay
+    valid until the next search of the cluster */
+int
+cluster_nearest(cluster_t *cluster, query_t *query, result_set_t *set) {
+    int order[MAX_SHARDS];
+    double dists[MAX_SHARDS];
+
+    clear_result_set(set);
+    forget_records(cluster);
+
+    /* Insertion sort of the shards by the distance to their region */
+    for (int i = 0; i < cluster->num_shards; i++) {
+        double dist = region_dist(&cluster->shards[i].region,
+                                  query->coordinates);
+        int j = i;
+        while (j > 0 && dists[j - 1] > dist) {
+            order[j] = order[j - 1];
+            dists[j] = dists[j - 1];
+            j--;
+        }
+        order[j] = i;
+        dists[j] = dist;
+    }
+
+    shard_t *nearest = NULL;
+    double nearest_dist = INFINITY;
+    for (int i = 0; i < cluster->num_shards && dists[i] <= nearest_dist;
+         i++) {
+        shard_t *shard = &cluster->shards[order[i]];
+        ask_shard(shard, SHARD_NEAREST, query, 0);
+        hear_shard(shard);
+        set->num_cmp += shard->reply.num_cmp;
+        set->exact &= shard->reply.exact;
+        if (shard->reply.num_records > 0 &&
+            shard->reply.dist < nearest_dist) {
+            nearest = shard;
+            nearest_dist = shard->reply.dist;
+        }
+    }
+
+    if (nearest != NULL) {
+        reserve_records(cluster, nearest->reply.num_records);
+        decode_records(cluster, nearest, set);
+    }
+    return set->num_matches;
+}
+
+/* Find every record within the radius of the key. The search is sent to
+    every shard whose region comes within the radius at once, and their
+    records are merged in the order of the shards. The records found stay
+    valid until the next search of the cluster */
+int
+cluster_radius(cluster_t *cluster, query_t *query, double radius,
+               result_set_t *set) {
+    int asked[MAX_SHARDS];
+    int num_records = 0;
+
+    clear_result_set(set);
+    forget_records(cluster);
+
+    for (int i = 0; i < cluster->num_shards; i++) {
+        shard_t *shard = &cluster->shards[i];
+        asked[i] = region_dist(&shard->region, query->coordinates) <= radius;
+        if (asked[i]) {
+            ask_shard(shard, SHARD_RADIUS, query, radius);
+        }
+    }
+    for (int i = 0; i < cluster->num_shards; i++) {
+        shard_t *shard = &cluster->shards[i];
+        if (asked[i]) {
+            hear_shard(shard);
+            set->num_cmp += shard->reply.num_cmp;
+            set->estimate += shard->reply.estimate;
+            if (shard->reply.plan == PLAN_SCAN) {
+                set->plan = PLAN_SCAN;
+            }
+            num_records += shard->reply.num_records;
+        }
+    }
+
+    reserve_records(cluster, num_records);
+    for (int i = 0; i < cluster->num_shards; i++) {
+        if (asked[i]) {
+            decode_records(cluster, &cluster->shards[i], set);
+        }
+    }
+    return set->num_matches;
+}
+
+/* Distance from the key to the closest point of the region */
+static double
+region_dist(const region_t *region, const double *coordinates) {
+    double dist = 0;
+    for (int d = 0; d < METRIC_DIMENSION; d++) {
+        double gap = 0;
+        if (coordinates[d] < region->lo[d]) {
+            gap = region->lo[d] - coordinates[d];
+        } else if (coordinates[d] > region->hi[d]) {
+            gap = coordinates[d] - region->hi[d];
+        }
+        dist += gap * gap;
+    }
+    return sqrt(dist);
+}
+
+static void
+ask_shard(shard_t *shard, int type, query_t *query, double radius) {
+    shard_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.type = type;
+    request.radius = radius;
+    request.query = *query;
+    if (!write_fully(shard->fd, &request, sizeof(request))) {
+        fprintf(stderr, "Shard process %d stopped answering\n",
+                (int) shard->pid);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void
+hear_shard(shard_t *shard) {
+    if (!read_fully(shard->fd, &shard->reply, sizeof(shard->reply))) {
+        fprintf(stderr, "Shard process %d stopped answering\n",
+                (int) shard->pid);
+        exit(EXIT_FAILURE);
+    }
+    if (shard->reply.length > shard->size) {
+        shard->size = shard->reply.length;
+        shard->buffer = (char *) realloc(shard->buffer, shard->size);
+        assert(shard->buffer != NULL);
+    }
+    if (!read_fully(shard->fd, shard->buffer, shard->reply.length)) {
+        fprintf(stderr, "Shard process %d stopped answering\n",
+                (int) shard->pid);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Write the records of a result set into the buffer, growing it as
+    needed, and return the number of bytes written */
+static int
+encode_records(result_set_t *set, char **buffer, int *size) {
+    int length = 0;
+
+    for (int i = 0; i < set->num_results; i++) {
+        record_t *record = set->results[i].record;
+        char *strings[4] = {record->trade_name, record->location,
+                            record->city_area_name, record->industry_desc};
+        wire_record_t wire = {record->id, record->census_yr, record->block_id,
+                              record->property_id, record->base_prop_id,
+                              record->industry_code};
+        memcpy(wire.coordinates, record->coordinates,
+               sizeof(wire.coordinates));
+        wire.dist = set->results[i].dist;
+        int needed = length + (int) sizeof(wire);
+        for (int s = 0; s < 4; s++) {
+            wire.lengths[s] = (int) strlen(strings[s]) + 1;
+            needed += wire.lengths[s];
+        }
+
+        if (needed > *size) {
+            *size = (needed > 2 * *size) ? needed : 2 * *size;
+            *buffer = (char *) realloc(*buffer, *size);
+            assert(*buffer != NULL);
+        }
+        memcpy(*buffer + length, &wire, sizeof(wire));
+        length += (int) sizeof(wire);
+        for (int s = 0; s < 4; s++) {
+            memcpy(*buffer + length, strings[s], wire.lengths[s]);
+            length += wire.lengths[s];
+        }
+    }
+
+    return length;
+}
+
+/* Add the records of the last answer of a shard to the result set. Their
+    strings are left in the buffer of the shard */
+static void
+decode_records(cluster_t *cluster, shard_t *shard, result_set_t *set) {
+    char *curr = shard->buffer;
+
+    for (int i = 0; i < shard->reply.num_records; i++) {
+        wire_record_t wire;
+        memcpy(&wire, curr, sizeof(wire));
+        curr += sizeof(wire);
+
+        record_t *record = &cluster->records[cluster->num_records++];
+        record->id = wire.id;
+        record->census_yr = wire.census_yr;
+        record->block_id = wire.block_id;
+        record->property_id = wire.property_id;
+        record->base_prop_id = wire.base_prop_id;
+        record->industry_code = wire.industry_code;
+        memcpy(record->coordinates, wire.coordinates,
+               sizeof(record->coordinates));
+        memcpy(record->degrees, wire.coordinates, sizeof(record->degrees));
+        char **strings[4] = {&record->trade_name, &record->location,
+                             &record->city_area_name, &record->industry_desc};
+        for (int s = 0; s < 4; s++) {
+            *strings[s] = curr;
+            curr += wire.lengths[s];
+        }
+        record->rendered = NULL;
+
+        if (set->num_results < set->capacity) {
+            set->results[set->num_results].record = record;
+            set->results[set->num_results].dist = wire.dist;
+            set->num_results++;
+        }
+        set->num_matches++;
+    }
+}
+
+/* Make room for the records of a search before any is handed out, since
+    growing the array moves them */
+static void
+reserve_records(cluster_t *cluster, int num_records) {
+    if (num_records > cluster->max_records) {
+        cluster->max_records = num_records;
+        cluster->records = (record_t *) realloc(cluster->records,
+                                                sizeof(record_t) *
+                                                cluster->max_records);
+        assert(cluster->records != NULL);
+    }
+}
+
+/* Drop the records of the last search, along with what the output
+    rendered of them */
+static void
+forget_records(cluster_t *cluster) {
+    for (int i = 0; i < cluster->num_records; i++) {
+        free(cluster->records[i].rendered);
+    }
+    cluster->num_records = 0;
+}
+
+static int
+read_fully(int fd, void *buffer, size_t length) {
+    char *curr = buffer;
+    while (length > 0) {
+        ssize_t num_read = read(fd, curr, length);
+        if (num_read < 0 && errno == EINTR) {
+            continue;
+        } else if (num_read <= 0) {
+            return 0;
+        }
+        curr += num_read;
+        length -= (size_t) num_read;
+    }
+    return 1;
+}
+
+/* Write without raising SIGPIPE if the other side is gone */
+static int
+write_fully(int fd, const void *buffer, size_t length) {
+    const char *curr = buffer;
+    while (length > 0) {
+        ssize_t num_written = send(fd, curr, length, MSG_NOSIGNAL);
+        if (num_written < 0 && errno == EINTR) {
+            continue;
+        } else if (num_written <= 0) {
+            return 0;
+        }
+        curr += num_written;
+        length -= (size_t) num_written;
+    }
+    return 1;
+}
+
+/* Close the connections, which stops every shard, and wait for the shard
+    processes to exit */
+void
+stop_cluster(cluster_t *cluster) {
+    assert(cluster != NULL);
+    for (int i = 0; i < cluster->num_shards; i++) {
+        close(cluster->shards[i].fd);
+    }
+    for (int i = 0; i < cluster->num_shards; i++) {
+        waitpid(cluster->shards[i].pid, NULL, 0);
+        free(cluster->shards[i].buffer);
+    }
+    forget_records(cluster);
+    free(cluster->records);
+    free(cluster->shards);
+    free(cluster);
+}
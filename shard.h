@@ -0,0 +1,71 @@
+#ifndef shard_h
+#define shard_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <sys/types.h>
+#include "kdtree.h"
+#include "csvparser.h"
+#include "search.h"
+#include "planner.h"
+#include "engine.h"
+
+#define MAX_SHARDS 64                    /* shard processes of a cluster */
+#define SHARD_PATH "/tmp/kdshard"        /* prefix of the shard sockets */
+
+#define SHARD_NEAREST 0
+#define SHARD_RADIUS 1                   /* searches a shard answers */
+
+/* Search sent by the router to a shard */
+typedef struct {
+    int type;
+    double radius;
+    query_t query;
+} shard_request_t;
+
+/* Answer of a shard, followed by length bytes of records */
+typedef struct {
+    int num_cmp;
+    int num_records;
+    int exact;
+    int plan;
+    int estimate;
+    int length;
+    double dist;                         /* of the nearest record found */
+} shard_reply_t;
+
+/* Shard as seen by the router. The buffer holds the records of its last
+    answer, which the records handed out by the router point into */
+typedef struct {
+    region_t region;
+    pid_t pid;
+    int fd;                              /* connection to the shard */
+    shard_reply_t reply;
+    char *buffer;
+    int size;                            /* bytes the buffer can hold */
+} shard_t;
+
+/* Router over shard processes, each serving the part of the dataset in
+    one region of the plane. The regions are split at the median location
+    as in the top levels of a balanced KD tree */
+typedef struct {
+    shard_t *shards;
+    int num_shards;
+    record_t *records;                   /* records of the last search */
+    int num_records;
+    int max_records;
+} cluster_t;
+
+/* prototypes for the functions in this library */
+cluster_t *start_cluster(const char *filename, int num_shards,
+                         const engine_opts_t *opts);
+int cluster_nearest(cluster_t *cluster, query_t *query, result_set_t *set);
+int cluster_radius(cluster_t *cluster, query_t *query, double radius,
+                   result_set_t *set);
+void serve_shard(engine_t *engine, int fd);
+void stop_cluster(cluster_t *cluster);
+
+#endif /* shard_h */